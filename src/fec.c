@@ -0,0 +1,290 @@
+#include "fec.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FEC_X86
+#endif
+
+// --- Forward error correction ---
+
+#define GF_POLY 0x11d // x^8 + x^4 + x^3 + x^2 + 1, 2 generates the field
+
+static uint8_t gf_exp[512]; // Doubled so gf_exp[log a + log b] needs no modulo
+static uint8_t gf_log[256];
+static uint8_t gf_mul_table[256][256];
+static uint8_t gf_nibble[256][2][16]; // c times every low nibble, and every high nibble, for byte shuffles
+static uint8_t cauchy[FEC_MAX_PARITY][FEC_MAX_DATA]; // Coefficient of data fragment i in parity fragment j
+
+static pthread_once_t fec_once = PTHREAD_ONCE_INIT;
+// dst ^= c * src over len bytes
+static void (*mul_add)(uint8_t* dst, const uint8_t* src, uint8_t c, size_t len);
+static const char* kernel_name;
+
+static uint8_t gf_mul(uint8_t a, uint8_t b) { return gf_mul_table[a][b]; }
+
+static uint8_t gf_inv(uint8_t a) { return gf_exp[255 - gf_log[a]]; }
+
+static void mul_add_scalar(uint8_t* dst, const uint8_t* src, uint8_t c, size_t len) {
+	size_t i = 0;
+	if (c == 0) return;
+	if (c == 1) { // XOR parity, a word at a time
+		for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+			uint64_t a, b;
+			memcpy(&a, dst + i, sizeof(a));
+			memcpy(&b, src + i, sizeof(b));
+			a ^= b;
+			memcpy(dst + i, &a, sizeof(a));
+		}
+		for (; i < len; ++i)
+			dst[i] ^= src[i];
+		return;
+	}
+	const uint8_t* row = gf_mul_table[c];
+	for (; i < len; ++i)
+		dst[i] ^= row[src[i]];
+}
+
+#ifdef FEC_X86
+// c * x = c * (x & 0xf) ^ c * (x & 0xf0), both looked up 16 bytes at a time with pshufb
+__attribute__((target("ssse3"))) static void mul_add_ssse3(uint8_t* dst, const uint8_t* src, uint8_t c, size_t len) {
+	size_t i = 0;
+	if (c == 0) return;
+	__m128i lo = _mm_loadu_si128((const __m128i*)gf_nibble[c][0]);
+	__m128i hi = _mm_loadu_si128((const __m128i*)gf_nibble[c][1]);
+	__m128i mask = _mm_set1_epi8(0x0f);
+	for (; i + 16 <= len; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i*)(src + i));
+		if (c != 1) {
+			x = _mm_xor_si128(_mm_shuffle_epi8(lo, _mm_and_si128(x, mask)),
+				_mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(x, 4), mask)));
+		}
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(_mm_loadu_si128((const __m128i*)(dst + i)), x));
+	}
+	mul_add_scalar(dst + i, src + i, c, len - i);
+}
+
+__attribute__((target("avx2"))) static void mul_add_avx2(uint8_t* dst, const uint8_t* src, uint8_t c, size_t len) {
+	size_t i = 0;
+	if (c == 0) return;
+	__m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)gf_nibble[c][0]));
+	__m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)gf_nibble[c][1]));
+	__m256i mask = _mm256_set1_epi8(0x0f);
+	for (; i + 32 <= len; i += 32) {
+		__m256i x = _mm256_loadu_si256((const __m256i*)(src + i));
+		if (c != 1) {
+			x = _mm256_xor_si256(_mm256_shuffle_epi8(lo, _mm256_and_si256(x, mask)),
+				_mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi64(x, 4), mask)));
+		}
+		_mm256_storeu_si256((__m256i*)(dst + i), _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(dst + i)), x));
+	}
+	mul_add_scalar(dst + i, src + i, c, len - i);
+}
+#endif
+
+static void fec_setup(void) {
+	int x = 1;
+	for (int i = 0; i < 255; ++i) {
+		gf_exp[i] = x;
+		gf_log[x] = i;
+		x <<= 1;
+		if (x & 0x100) x ^= GF_POLY;
+	}
+	for (int i = 255; i < 512; ++i)
+		gf_exp[i] = gf_exp[i - 255];
+	for (int a = 0; a < 256; ++a) {
+		for (int b = 0; b < 256; ++b)
+			gf_mul_table[a][b] = a && b ? gf_exp[gf_log[a] + gf_log[b]] : 0;
+		for (int v = 0; v < 16; ++v) {
+			gf_nibble[a][0][v] = gf_mul_table[a][v];
+			gf_nibble[a][1][v] = gf_mul_table[a][v << 4];
+		}
+	}
+
+	// Cauchy matrix 1 / (x_j + y_i) with x_j = FEC_MAX_DATA + j and y_i = i, every square submatrix is invertible.
+	// Scaling column i by x_0 + y_i keeps that and turns row 0 into all ones.
+	for (int j = 0; j < FEC_MAX_PARITY; ++j) {
+		for (int i = 0; i < FEC_MAX_DATA; ++i)
+			cauchy[j][i] = gf_mul(FEC_MAX_DATA ^ i, gf_inv((FEC_MAX_DATA + j) ^ i));
+	}
+
+	mul_add = mul_add_scalar;
+	kernel_name = "scalar";
+#ifdef FEC_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		mul_add = mul_add_avx2;
+		kernel_name = "avx2";
+	} else if (__builtin_cpu_supports("ssse3")) {
+		mul_add = mul_add_ssse3;
+		kernel_name = "ssse3";
+	}
+#endif
+}
+
+void fec_encode(const unsigned char* data, size_t len, int n, int k, size_t frag_size, unsigned char* parity) {
+	pthread_once(&fec_once, fec_setup);
+	memset(parity, 0, (size_t)k * frag_size);
+	// One data fragment at a time against every parity row, it stays in cache for all k
+	for (int i = 0; i < n; ++i) {
+		size_t off = (size_t)i * frag_size;
+		if (off >= len) break;
+		size_t flen = len - off < frag_size ? len - off : frag_size;
+		for (int j = 0; j < k; ++j)
+			mul_add(parity + (size_t)j * frag_size, data + off, cauchy[j][i], flen);
+	}
+}
+
+// Gauss-Jordan on the e x e matrix a, which ends up as the identity. Returns -1 if it is singular.
+static int gf_invert(uint8_t a[FEC_MAX_PARITY][FEC_MAX_PARITY], uint8_t inv[FEC_MAX_PARITY][FEC_MAX_PARITY], int e) {
+	for (int r = 0; r < e; ++r) {
+		for (int c = 0; c < e; ++c)
+			inv[r][c] = r == c;
+	}
+	for (int col = 0; col < e; ++col) {
+		int piv = col;
+		while (piv < e && !a[piv][col])
+			piv++;
+		if (piv == e) return -1;
+		for (int c = 0; c < e; ++c) {
+			uint8_t t = a[col][c];
+			a[col][c] = a[piv][c];
+			a[piv][c] = t;
+			t = inv[col][c];
+			inv[col][c] = inv[piv][c];
+			inv[piv][c] = t;
+		}
+		uint8_t f = gf_inv(a[col][col]);
+		for (int c = 0; c < e; ++c) {
+			a[col][c] = gf_mul(a[col][c], f);
+			inv[col][c] = gf_mul(inv[col][c], f);
+		}
+		for (int r = 0; r < e; ++r) {
+			f = a[r][col];
+			if (r == col || !f) continue;
+			for (int c = 0; c < e; ++c) {
+				a[r][c] ^= gf_mul(f, a[col][c]);
+				inv[r][c] ^= gf_mul(f, inv[col][c]);
+			}
+		}
+	}
+	return 0;
+}
+
+int fec_decode(unsigned char** frags, uint64_t have_data, uint32_t have_parity, int n, int k, size_t frag_size) {
+	pthread_once(&fec_once, fec_setup);
+	int missing[FEC_MAX_PARITY], rows[FEC_MAX_PARITY];
+	int e = 0, r = 0;
+	for (int i = 0; i < n; ++i) {
+		if (have_data & (1ull << i)) continue;
+		if (e == FEC_MAX_PARITY) return -1;
+		missing[e++] = i;
+	}
+	for (int j = 0; j < k && r < e; ++j) {
+		if (have_parity & (1u << j)) rows[r++] = j;
+	}
+	if (r < e) return -1;
+	if (e == 0) return 0;
+
+	// Take the data we have out of the parity, what is left only depends on the missing fragments
+	for (int t = 0; t < e; ++t) {
+		unsigned char* s = frags[n + rows[t]];
+		for (int i = 0; i < n; ++i) {
+			if (have_data & (1ull << i)) mul_add(s, frags[i], cauchy[rows[t]][i], frag_size);
+		}
+	}
+
+	uint8_t a[FEC_MAX_PARITY][FEC_MAX_PARITY], inv[FEC_MAX_PARITY][FEC_MAX_PARITY];
+	for (int t = 0; t < e; ++t) {
+		for (int u = 0; u < e; ++u)
+			a[t][u] = cauchy[rows[t]][missing[u]];
+	}
+	if (gf_invert(a, inv, e) < 0) return -1;
+
+	for (int u = 0; u < e; ++u) {
+		unsigned char* out = frags[missing[u]];
+		memset(out, 0, frag_size);
+		for (int t = 0; t < e; ++t)
+			mul_add(out, frags[n + rows[t]], inv[u][t], frag_size);
+	}
+	return e;
+}
+
+const char* fec_kernel(void) {
+	pthread_once(&fec_once, fec_setup);
+	return kernel_name;
+}
+
+// Encodes and rebuilds blocks of a typical file transfer with every kernel the CPU has and prints their rates
+int fec_benchmark(void) {
+	pthread_once(&fec_once, fec_setup);
+	const int n = 32, k = 4, rounds = 4000;
+	const size_t frag_size = 1400;
+	unsigned char* block = malloc((size_t)(n + k) * frag_size);
+	unsigned char* work = malloc((size_t)(n + k) * frag_size);
+	if (!block || !work) {
+		free(block);
+		free(work);
+		return -1;
+	}
+	for (size_t i = 0; i < (size_t)n * frag_size; ++i)
+		block[i] = rand();
+
+	struct {
+		const char* name;
+		void (*fn)(uint8_t*, const uint8_t*, uint8_t, size_t);
+		int usable;
+	} kernels[] = {
+		{"scalar", mul_add_scalar, 1},
+#ifdef FEC_X86
+		{"ssse3", mul_add_ssse3, __builtin_cpu_supports("ssse3")},
+		{"avx2", mul_add_avx2, __builtin_cpu_supports("avx2")},
+#endif
+	};
+	void (*chosen)(uint8_t*, const uint8_t*, uint8_t, size_t) = mul_add;
+	int ret = 0;
+
+	for (size_t m = 0; m < sizeof(kernels) / sizeof(kernels[0]); ++m) {
+		if (!kernels[m].usable) {
+			printf("%-7s not supported on this CPU\n", kernels[m].name);
+			continue;
+		}
+		mul_add = kernels[m].fn;
+		struct timespec start, mid, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (int r = 0; r < rounds; ++r)
+			fec_encode(block, (size_t)n * frag_size, n, k, frag_size, block + (size_t)n * frag_size);
+		clock_gettime(CLOCK_MONOTONIC, &mid);
+
+		// Worst case, as many data fragments lost as there is parity
+		unsigned char* frags[FEC_MAX_DATA + FEC_MAX_PARITY];
+		for (int i = 0; i < n + k; ++i)
+			frags[i] = work + (size_t)i * frag_size;
+		for (int r = 0; r < rounds; ++r) {
+			memcpy(work, block, (size_t)(n + k) * frag_size);
+			fec_decode(frags, ~0ull << k, (1u << k) - 1, n, k, frag_size);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		if (memcmp(work, block, (size_t)n * frag_size)) {
+			printf("%-7s rebuilt the wrong data\n", kernels[m].name);
+			ret = -1;
+		}
+
+		double enc = (mid.tv_sec - start.tv_sec) + (mid.tv_nsec - start.tv_nsec) / 1e9;
+		double dec = (end.tv_sec - mid.tv_sec) + (end.tv_nsec - mid.tv_nsec) / 1e9;
+		double mb = (double)rounds * n * frag_size / (1024 * 1024);
+		printf("%-7s n=%d k=%d encode %8.0f MB/s decode %8.0f MB/s\n", kernels[m].name, n, k, mb / enc, mb / dec);
+	}
+
+	mul_add = chosen;
+	free(block);
+	free(work);
+	return ret;
+}
+
+// --- ### ---
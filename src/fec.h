@@ -0,0 +1,29 @@
+#ifndef FEC_H
+#define FEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// --- Forward error correction ---
+// Systematic Reed-Solomon over GF(256) with a Cauchy matrix. A block of n data fragments gets k parity fragments,
+// any n of the n + k rebuild the block. The first parity row is all ones, so k = 1 is plain XOR parity.
+// Region kernels use AVX2 or SSSE3 nibble tables when the CPU has them, picked once at first use.
+
+#define FEC_MAX_DATA 64 // Data fragments per block, the receiver tracks a block in a 64 bit mask
+#define FEC_MAX_PARITY 8
+
+// parity receives k fragments of frag_size bytes for the n data fragments at data, fragment i at
+// data + i * frag_size. Only len bytes of data are read, the rest of the block counts as zeros.
+void fec_encode(const unsigned char* data, size_t len, int n, int k, size_t frag_size, unsigned char* parity);
+
+// frags[0, n) are the data fragments, frags[n, n + k) the parity fragments, each frag_size bytes. Bit i of
+// have_data and bit j of have_parity tell which are filled in. Rebuilds the missing data fragments in place,
+// the parity buffers used are overwritten. Returns the number rebuilt, -1 if too few fragments are in.
+int fec_decode(unsigned char** frags, uint64_t have_data, uint32_t have_parity, int n, int k, size_t frag_size);
+
+const char* fec_kernel(void); // Name of the region kernel in use
+int fec_benchmark(void);
+
+// --- ### ---
+
+#endif /* ifndef FEC_H */
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // sendmmsg
 #include <arpa/inet.h>
 #include <asm-generic/socket.h>
 #include <assert.h>
@@ -8,17 +9,28 @@
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <netinet/udp.h>
+#include <linux/filter.h>
+#include <linux/io_uring.h>
+#include <poll.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "fec.h"
 #include "libspoof.h"
 
 /* Checksum function */
@@ -77,73 +89,1187 @@ int get_host_ip_and_broadcast(char* host_ip, size_t host_len, char* broadcast_ip
 	return 0;
 }
 
-void* udp_receive_thread(void* arg) {
-	node_t* node = (node_t*)arg;
+// Returns the MTU of the interface that owns host_ip, DEFAULT_MTU if it can't be found.
+int get_host_mtu(const char* host_ip) {
+	struct ifaddrs *ifaddr, *ifa;
+	struct in_addr host;
+	int mtu = DEFAULT_MTU;
+
+	if (inet_pton(AF_INET, host_ip, &host) != 1) return mtu;
+	if (getifaddrs(&ifaddr) == -1) {
+		perror("getifaddrs");
+		return mtu;
+	}
+
+	for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) {
+		if (!ifa->ifa_addr || ifa->ifa_addr->sa_family != AF_INET) continue;
+		if (((struct sockaddr_in*)ifa->ifa_addr)->sin_addr.s_addr != host.s_addr) continue;
+
+		int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+		if (sockfd < 0) break;
+		struct ifreq ifr;
+		memset(&ifr, 0, sizeof(ifr));
+		strncpy(ifr.ifr_name, ifa->ifa_name, IFNAMSIZ - 1);
+		if (ioctl(sockfd, SIOCGIFMTU, &ifr) == 0) {
+			mtu = ifr.ifr_mtu;
+		}
+		close(sockfd);
+		break;
+	}
+	freeifaddrs(ifaddr);
+	return mtu;
+}
+
+// Largest payload that fits a single datagram of mtu bytes together with our header.
+uint16_t frag_size_from_mtu(int mtu) {
+	if (mtu > MAX_MTU) mtu = MAX_MTU;
+	if (mtu < MIN_MTU) mtu = MIN_MTU;
+	return mtu - IP_UDP_OVERHEAD - sizeof(header_t);
+}
+
+// Grows the socket receive buffer so bursts of fragments survive until we get to them.
+// SO_RCVBUFFORCE lets root go past net.core.rmem_max, plain SO_RCVBUF is capped by it.
+static void set_rcvbuf(int sockfd, int size) {
+	if (size <= 0) return;
+	if (setsockopt(sockfd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0
+		&& setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0) {
+		perror("setsockopt SO_RCVBUF");
+		return;
+	}
+
+	int actual = 0;
+	socklen_t len = sizeof(actual);
+	getsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &actual, &len);
+	if (actual < size) {
+		fprintf(stderr, "Receive buffer is %d bytes, asked for %d (see net.core.rmem_max)\n", actual, size);
+	}
+}
+
+#define RECV_SLOT (sizeof(header_t) + MAX_FRAGMENT)
+
+// Receive socket for one shard. Every shard binds the same port with SO_REUSEPORT and the kernel
+// spreads datagrams over them.
+static int open_receive_socket(const node_t* node, uint16_t listen_port) {
 	int sockfd;
-	struct sockaddr_in servaddr, cliaddr;
-	char buffer[MAX_FRAGMENT + sizeof(header_t)];
-	socklen_t len = sizeof(cliaddr);
+	struct sockaddr_in servaddr;
 
 	if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
 		perror("UDP receive socket failed");
-		return NULL;
+		return -1;
+	}
+
+	int one = 1;
+	if (node->num_shards > 1 && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+		perror("setsockopt SO_REUSEPORT");
+		close(sockfd);
+		return -1;
+	}
+
+	set_rcvbuf(sockfd, node->rcvbuf);
+
+	// Have the kernel report its drop counter with every datagram
+	if (setsockopt(sockfd, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one)) < 0) {
+		perror("setsockopt SO_RXQ_OVFL");
 	}
 
 	memset(&servaddr, 0, sizeof(servaddr));
 	servaddr.sin_family = AF_INET;
 	servaddr.sin_addr.s_addr = INADDR_ANY;
-	servaddr.sin_port = htons(node->sock_listen); // use .sock_listen as port
+	servaddr.sin_port = htons(listen_port);
 
 	if (bind(sockfd, (struct sockaddr*)&servaddr, sizeof(servaddr)) < 0) {
 		perror("UDP receive bind failed");
 		close(sockfd);
+		return -1;
+	}
+	return sockfd;
+}
+
+// Steers every datagram to shard (uid ^ id) % num_shards, so all fragments of a packet land on
+// the same thread and reassembly needs no locking. Reuseport programs see the packet from the
+// start of the UDP payload, which is our header_t.
+static int attach_shard_filter(int sockfd, int num_shards) {
+	struct sock_filter code[] = {
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(header_t, uid)),
+		BPF_STMT(BPF_MISC | BPF_TAX, 0),
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(header_t, uid) + 4),
+		BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+		BPF_STMT(BPF_MISC | BPF_TAX, 0),
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, offsetof(header_t, id)),
+		BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+		BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, num_shards),
+		BPF_STMT(BPF_RET | BPF_A, 0),
+	};
+	struct sock_fprog prog = {
+		.len = sizeof(code) / sizeof(code[0]),
+		.filter = code,
+	};
+
+	if (setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0) {
+		perror("setsockopt SO_ATTACH_REUSEPORT_CBPF");
+		return -1;
+	}
+	return 0;
+}
+
+// Per-shard SO_RXQ_OVFL bookkeeping, shared by both engines
+typedef struct {
+	uint32_t last_dropped;
+	time_t last_report;
+} rx_drops_t;
+
+// Accounts the drop counter carried in hdr's control messages and hands one datagram to the callback.
+static void handle_datagram(recv_shard_t* shard, struct msghdr* hdr, char* buffer, size_t n, int truncated,
+	rx_drops_t* drops) {
+	node_t* node = shard->node;
+	for (struct cmsghdr* cm = CMSG_FIRSTHDR(hdr); cm; cm = CMSG_NXTHDR(hdr, cm)) {
+		if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SO_RXQ_OVFL) {
+			uint32_t dropped;
+			memcpy(&dropped, CMSG_DATA(cm), sizeof(dropped));
+			if (dropped != drops->last_dropped) {
+				// Counter is per socket, node->rx_dropped sums up all shards
+				atomic_fetch_add(&node->rx_dropped, dropped - drops->last_dropped);
+				drops->last_dropped = dropped;
+				if (time(NULL) != drops->last_report) { // At most one warning per second
+					fprintf(stderr, "Receiver %d is falling behind, kernel dropped %u datagrams so far\n", shard->index,
+						dropped);
+					drops->last_report = time(NULL);
+				}
+			}
+		}
+	}
+
+	if (n < sizeof(header_t) || truncated || !node->on_message) return;
+
+	header_t* custom = (header_t*)buffer;
+	char* msg = (char*)(buffer + sizeof(header_t));
+	size_t msg_len = n - sizeof(header_t);
+	custom->size = ntohs(custom->size);
+	custom->frag_size = ntohs(custom->frag_size);
+	node->on_message(shard->index, custom, msg, msg_len); // callback to GUI
+}
+
+// Tags of the events every shard loop waits on, as epoll data or io_uring user_data
+#define LOOP_RECV 1 // The shard's receive socket
+#define LOOP_WAKE 2 // node->wake_fd, written by stop_udp_receiver
+#define LOOP_TIMER 16 // Node timer i is LOOP_TIMER + i, only on shard 0
+#define RECV_DRAIN 8 // recvmmsg batches per readiness before timers and wakeups get a look in
+
+static int timer_runs_on(const recv_shard_t* shard, int i) {
+	return shard->index == 0 || shard->node->timers[i].per_shard;
+}
+
+static void timer_run(recv_shard_t* shard, int i) {
+	node_timer_t* timer = &shard->node->timers[i];
+	timer->handler(timer->per_shard ? (void*)shard : timer->handler_arg);
+}
+
+// Receive loop of one shard on epoll: the socket, the wakeup eventfd and a timerfd per node timer it runs.
+// Nothing here sleeps or polls, stop_udp_receiver wakes every shard at once through wake_fd.
+void* udp_receive_thread(void* arg) {
+	recv_shard_t* shard = (recv_shard_t*)arg;
+	node_t* node = shard->node;
+	int sockfd = shard->sockfd;
+
+	// Ring of RECV_BATCH slots, refilled by every recvmmsg call
+	char* slots = malloc(RECV_BATCH * RECV_SLOT);
+	int epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (!slots || epfd < 0) {
+		perror("receive loop");
+		free(slots);
+		if (epfd >= 0) close(epfd);
 		return NULL;
 	}
 
-	node->recv_running = 1;
-	node->sock_listen = sockfd;
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u64 = LOOP_RECV;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &ev);
+	ev.data.u64 = LOOP_WAKE;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, node->wake_fd, &ev);
+
+	int num_timers = node->num_timers;
+	int timer_fds[MAX_NODE_TIMERS];
+	for (int i = 0; i < num_timers; ++i) {
+		timer_fds[i] = -1;
+		if (!timer_runs_on(shard, i)) continue;
+		timer_fds[i] = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (timer_fds[i] < 0) {
+			perror("timerfd_create");
+			continue;
+		}
+		struct itimerspec its;
+		its.it_interval.tv_sec = node->timers[i].u_delay / 1000000;
+		its.it_interval.tv_nsec = (node->timers[i].u_delay % 1000000) * 1000;
+		its.it_value = its.it_interval;
+		timerfd_settime(timer_fds[i], 0, &its, NULL);
+		ev.data.u64 = LOOP_TIMER + i;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, timer_fds[i], &ev);
+	}
+
+	struct mmsghdr msgs[RECV_BATCH];
+	struct iovec iovs[RECV_BATCH];
+	char control[RECV_BATCH][CMSG_SPACE(sizeof(uint32_t))];
+	rx_drops_t drops = {0};
+	int done = 0;
 
-	while (node->recv_running) {
-		ssize_t n = recvfrom(sockfd, buffer, sizeof(buffer), 0, (struct sockaddr*)&cliaddr, &len);
-		if (n > 0 && node->on_message) {
-			header_t* custom = (header_t*)buffer;
-			char* msg = (char*)(buffer + sizeof(header_t));
-			size_t msg_len = n - sizeof(header_t);
-			custom->size = ntohs(custom->size);
-			node->on_message(custom, msg, msg_len); // callback to GUI
+	while (!done && node->recv_running) {
+		struct epoll_event events[2 + MAX_NODE_TIMERS];
+		int nev = epoll_wait(epfd, events, 2 + MAX_NODE_TIMERS, -1);
+		if (nev < 0) {
+			if (errno == EINTR) continue;
+			perror("epoll_wait");
+			break;
 		}
+
+		for (int e = 0; e < nev; ++e) {
+			uint64_t tag = events[e].data.u64;
+			if (tag == LOOP_WAKE) {
+				done = 1; // Left set on purpose so every shard sees it
+			} else if (tag >= LOOP_TIMER && tag < LOOP_TIMER + (uint64_t)num_timers) {
+				int i = tag - LOOP_TIMER;
+				uint64_t expirations;
+				if (read(timer_fds[i], &expirations, sizeof(expirations)) == sizeof(expirations)) {
+					timer_run(shard, i);
+				}
+			} else if (tag == LOOP_RECV) {
+				for (int round = 0; round < RECV_DRAIN; ++round) {
+					for (int i = 0; i < RECV_BATCH; ++i) {
+						iovs[i].iov_base = slots + i * RECV_SLOT;
+						iovs[i].iov_len = RECV_SLOT;
+						memset(&msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+						msgs[i].msg_hdr.msg_iov = &iovs[i];
+						msgs[i].msg_hdr.msg_iovlen = 1;
+						msgs[i].msg_hdr.msg_control = control[i];
+						msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+					}
+
+					// Take whatever is already queued, epoll tells us when there is more
+					int count = recvmmsg(sockfd, msgs, RECV_BATCH, MSG_DONTWAIT, NULL);
+					if (count < 0) {
+						if (errno != EAGAIN && errno != EINTR) perror("recvmmsg");
+						break;
+					}
+					atomic_fetch_add(&node->rx_packets, count);
+
+					for (int i = 0; i < count; ++i) {
+						struct msghdr* hdr = &msgs[i].msg_hdr;
+						handle_datagram(
+							shard, hdr, iovs[i].iov_base, msgs[i].msg_len, hdr->msg_flags & MSG_TRUNC, &drops);
+					}
+					if (count < RECV_BATCH) break;
+				}
+			}
+		}
+	}
+
+	for (int i = 0; i < num_timers; ++i) {
+		if (timer_fds[i] >= 0) close(timer_fds[i]);
 	}
-	close(sockfd);
+	close(epfd);
+	free(slots);
 	return NULL;
 }
 
+// --- io_uring ---
+// liburing isn't a dependency, this is the small part of it we need on top of the raw syscalls.
+
+typedef struct {
+	int fd;
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned sq_mask;
+	unsigned* sq_array;
+	struct io_uring_sqe* sqes;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe* cqes;
+
+	void* ring_ptr;
+	size_t ring_len;
+	size_t sqes_len;
+	unsigned to_submit; // SQEs written since the last uring_enter
+} uring_t;
+
+static int uring_init(uring_t* ring, unsigned entries) {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd < 0) return -1;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) { // 5.4+, older kernels lack multishot anyway
+		close(ring->fd);
+		errno = ENOSYS;
+		return -1;
+	}
+
+	size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->ring_len = sq_len > cq_len ? sq_len : cq_len;
+	ring->ring_ptr
+		= mmap(NULL, ring->ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->ring_ptr == MAP_FAILED) {
+		close(ring->fd);
+		return -1;
+	}
+	ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		munmap(ring->ring_ptr, ring->ring_len);
+		close(ring->fd);
+		return -1;
+	}
+
+	char* base = ring->ring_ptr;
+	ring->sq_head = (unsigned*)(base + p.sq_off.head);
+	ring->sq_tail = (unsigned*)(base + p.sq_off.tail);
+	ring->sq_mask = *(unsigned*)(base + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned*)(base + p.sq_off.array);
+	ring->cq_head = (unsigned*)(base + p.cq_off.head);
+	ring->cq_tail = (unsigned*)(base + p.cq_off.tail);
+	ring->cq_mask = *(unsigned*)(base + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)(base + p.cq_off.cqes);
+	return 0;
+}
+
+static void uring_exit(uring_t* ring) {
+	munmap(ring->sqes, ring->sqes_len);
+	munmap(ring->ring_ptr, ring->ring_len);
+	close(ring->fd);
+}
+
+// Next free SQE, zeroed, or NULL if the submission queue is full.
+static struct io_uring_sqe* uring_get_sqe(uring_t* ring) {
+	unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	unsigned tail = *ring->sq_tail;
+	if (tail - head > ring->sq_mask) return NULL;
+
+	unsigned idx = tail & ring->sq_mask;
+	struct io_uring_sqe* sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[idx] = idx;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->to_submit++;
+	return sqe;
+}
+
+// Submits the queued SQEs and waits until at least wait_nr completions are posted.
+static int uring_enter(uring_t* ring, unsigned wait_nr) {
+	int ret
+		= syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	if (ret >= 0) ring->to_submit -= ret;
+	return ret;
+}
+
+// uring_get_sqe that submits what is queued when the SQ is full and tries again. NULL if there is still no room.
+static struct io_uring_sqe* uring_get_sqe_submit(uring_t* ring) {
+	struct io_uring_sqe* sqe = uring_get_sqe(ring);
+	if (sqe) return sqe;
+	int ret;
+	do {
+		ret = uring_enter(ring, 0);
+	} while (ret < 0 && errno == EINTR);
+	return ret < 0 ? NULL : uring_get_sqe(ring);
+}
+
+// Free SQ entries
+static unsigned uring_sq_space(uring_t* ring) {
+	return ring->sq_mask + 1 - (*ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE));
+}
+
+static struct io_uring_cqe* uring_peek_cqe(uring_t* ring) {
+	unsigned head = *ring->cq_head;
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+	return &ring->cqes[head & ring->cq_mask];
+}
+
+static void uring_cqe_seen(uring_t* ring) { __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE); }
+
+// Probes for everything the io_uring engine relies on: a ring, provided buffer rings (5.19) and
+// multishot recvmsg (6.0). The last one only shows when armed, udp_receive_uring falls back then.
+static int uring_supported(void) {
+	uring_t ring;
+	if (uring_init(&ring, 4) < 0) return 0;
+
+	struct io_uring_buf_reg reg;
+	void* br = mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long)br;
+	reg.ring_entries = 1;
+	int ok = br != MAP_FAILED && syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) == 0;
+	if (br != MAP_FAILED) munmap(br, 4096);
+	uring_exit(&ring);
+	return ok;
+}
+
+#define URING_BGID 0 // Buffer group of the receive buffers
+// Every provided buffer holds io_uring_recvmsg_out, our control message, then the datagram
+#define URING_CONTROL CMSG_SPACE(sizeof(uint32_t))
+#define URING_RECV_SLOT (sizeof(struct io_uring_recvmsg_out) + URING_CONTROL + RECV_SLOT)
+
+// Returns -1 if there is no SQE for it, the receive loop can't go on on the ring then
+static int uring_arm_recv(uring_t* ring, int sockfd, struct msghdr* tmpl) {
+	struct io_uring_sqe* sqe = uring_get_sqe_submit(ring);
+	if (!sqe) return -1;
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = sockfd;
+	sqe->addr = (unsigned long)tmpl;
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	sqe->user_data = LOOP_RECV;
+	return 0;
+}
+
+static int uring_arm_timer(uring_t* ring, struct __kernel_timespec* ts, unsigned int u_delay, int i) {
+	struct io_uring_sqe* sqe = uring_get_sqe_submit(ring);
+	if (!sqe) return -1;
+	ts->tv_sec = u_delay / 1000000;
+	ts->tv_nsec = (u_delay % 1000000) * 1000;
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->fd = -1;
+	sqe->addr = (unsigned long)ts;
+	sqe->len = 1;
+	sqe->user_data = LOOP_TIMER + i;
+	return 0;
+}
+
+// Hands buffer bid back to the kernel.
+static void uring_recycle(struct io_uring_buf_ring* br, char* bufs, unsigned short bid) {
+	unsigned short tail = br->tail;
+	struct io_uring_buf* buf = &br->bufs[tail & (URING_RECV_BUFS - 1)];
+	buf->addr = (unsigned long)(bufs + (size_t)bid * URING_RECV_SLOT);
+	buf->len = URING_RECV_SLOT;
+	buf->bid = bid;
+	__atomic_store_n(&br->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// Receive loop of one shard on io_uring. Datagrams land in provided buffers without a syscall per
+// batch, node timers run as timeout SQEs. Returns -1 if the ring couldn't be set
+// up, the caller then runs the blocking loop instead.
+static int udp_receive_uring(recv_shard_t* shard) {
+	node_t* node = shard->node;
+	uring_t ring;
+	if (uring_init(&ring, URING_ENTRIES) < 0) {
+		perror("io_uring_setup");
+		return -1;
+	}
+
+	size_t br_len = URING_RECV_BUFS * sizeof(struct io_uring_buf);
+	struct io_uring_buf_ring* br = mmap(NULL, br_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	char* bufs = malloc(URING_RECV_BUFS * URING_RECV_SLOT);
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long)br;
+	reg.ring_entries = URING_RECV_BUFS;
+	reg.bgid = URING_BGID;
+	if (br == MAP_FAILED || !bufs || syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		perror("io_uring provided buffers");
+		if (br != MAP_FAILED) munmap(br, br_len);
+		free(bufs);
+		uring_exit(&ring);
+		return -1;
+	}
+	br->tail = 0;
+	for (int i = 0; i < URING_RECV_BUFS; ++i) {
+		uring_recycle(br, bufs, i);
+	}
+
+	// Multishot recvmsg only reads the name and control lengths from this, the data goes to the buffers
+	struct msghdr tmpl;
+	memset(&tmpl, 0, sizeof(tmpl));
+	tmpl.msg_controllen = URING_CONTROL;
+	// Anything we can't arm leaves the shard to the blocking loop
+	int ret = uring_arm_recv(&ring, shard->sockfd, &tmpl);
+
+	struct io_uring_sqe* sqe = ret < 0 ? NULL : uring_get_sqe_submit(&ring);
+	if (sqe) {
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = node->wake_fd;
+		sqe->poll32_events = POLLIN;
+		sqe->user_data = LOOP_WAKE;
+	} else {
+		ret = -1;
+	}
+
+	int num_timers = node->num_timers;
+	struct __kernel_timespec timeouts[MAX_NODE_TIMERS];
+	for (int i = 0; i < num_timers && ret == 0; ++i) {
+		if (timer_runs_on(shard, i)) ret = uring_arm_timer(&ring, &timeouts[i], node->timers[i].u_delay, i);
+	}
+
+	rx_drops_t drops = {0};
+	int multishot_ok = 0;
+	int done = ret < 0;
+	while (!done && node->recv_running) {
+		if (uring_enter(&ring, 1) < 0 && errno != EINTR) {
+			perror("io_uring_enter");
+			break;
+		}
+
+		struct io_uring_cqe* cqe;
+		while ((cqe = uring_peek_cqe(&ring))) {
+			uint64_t tag = cqe->user_data;
+			int res = cqe->res;
+			unsigned flags = cqe->flags;
+			uring_cqe_seen(&ring);
+
+			if (tag == LOOP_WAKE) {
+				done = 1;
+			} else if (tag >= LOOP_TIMER && tag < LOOP_TIMER + (uint64_t)num_timers) {
+				int i = tag - LOOP_TIMER;
+				if (res == -ETIME) timer_run(shard, i);
+				if (uring_arm_timer(&ring, &timeouts[i], node->timers[i].u_delay, i) < 0) {
+					ret = -1;
+					done = 1;
+					break;
+				}
+			} else if (tag == LOOP_RECV) {
+				if (res == -EINVAL && !multishot_ok) { // No multishot recvmsg before 6.0
+					ret = -1;
+					done = 1;
+					break;
+				}
+				if (flags & IORING_CQE_F_BUFFER) {
+					multishot_ok = 1;
+					unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+					char* buf = bufs + (size_t)bid * URING_RECV_SLOT;
+					struct io_uring_recvmsg_out* out = (struct io_uring_recvmsg_out*)buf;
+					if (res >= 0) {
+						atomic_fetch_add(&node->rx_packets, 1);
+						struct msghdr hdr;
+						memset(&hdr, 0, sizeof(hdr));
+						hdr.msg_control = buf + sizeof(*out) + tmpl.msg_namelen;
+						hdr.msg_controllen = out->controllen;
+						char* payload = (char*)hdr.msg_control + tmpl.msg_controllen;
+						handle_datagram(shard, &hdr, payload, out->payloadlen, out->flags & MSG_TRUNC, &drops);
+					}
+					uring_recycle(br, bufs, bid);
+				}
+				// ENOBUFS (every buffer in use) and errors end the multishot, buffers are back by now
+				if (!(flags & IORING_CQE_F_MORE) && uring_arm_recv(&ring, shard->sockfd, &tmpl) < 0) {
+					ret = -1;
+					done = 1;
+					break;
+				}
+			}
+		}
+	}
+
+	// Closing the ring cancels whatever is still armed
+	uring_exit(&ring);
+	munmap(br, br_len);
+	free(bufs);
+	return ret;
+}
+
+static void* udp_receive_shard(void* arg) {
+	recv_shard_t* shard = (recv_shard_t*)arg;
+	node_t* node = shard->node;
+	if (node->engine == RECV_URING && udp_receive_uring(shard) == 0) return NULL;
+	if (node->engine == RECV_URING) {
+		fprintf(stderr, "Receiver %d: io_uring engine unavailable, using epoll\n", shard->index);
+	}
+	return udp_receive_thread(arg);
+}
+
+// Registers a handler shard 0 runs every u_delay microseconds, as a timerfd with epoll or a timeout SQE
+// with io_uring. Must be called before start_udp_receiver. Returns -1 when the table is full.
+int node_add_timer(node_t* node, unsigned int u_delay, void* (*handler)(void*), void* handler_arg) {
+	if (node->num_timers >= MAX_NODE_TIMERS) return -1;
+	node->timers[node->num_timers].u_delay = u_delay;
+	node->timers[node->num_timers].handler = handler;
+	node->timers[node->num_timers].handler_arg = handler_arg;
+	node->timers[node->num_timers].per_shard = 0;
+	node->num_timers++;
+	return 0;
+}
+
+// Like node_add_timer, but every shard runs handler with its own recv_shard_t, for per-shard state that must
+// not be touched from another thread.
+int node_add_shard_timer(node_t* node, unsigned int u_delay, void* (*handler)(void*)) {
+	if (node_add_timer(node, u_delay, handler, NULL) < 0) return -1;
+	node->timers[node->num_timers - 1].per_shard = 1;
+	return 0;
+}
+
+// Starts node->num_shards receiver threads (at least one) on listen_port, on the engine in node->engine.
 int start_udp_receiver(node_t* node, uint16_t listen_port, message_callback_t cb) {
 	if (node->recv_running) return 0; // Already running
+	if (node->num_shards < 1) node->num_shards = 1;
+	if (node->num_shards > MAX_RECV_SHARDS) node->num_shards = MAX_RECV_SHARDS;
+
 	node->on_message = cb;
+	atomic_store(&node->rx_packets, 0);
+	atomic_store(&node->rx_dropped, 0);
 	node->sock_listen = listen_port;
-	if (pthread_create(&node->recv_thread, NULL, udp_receive_thread, node) != 0) {
-		perror("pthread_create failed");
+
+	if (node->engine == RECV_URING && !uring_supported()) {
+		fprintf(stderr, "io_uring with provided buffer rings is not available, using epoll\n");
+		node->engine = RECV_BLOCKING;
+	}
+	// Every shard waits on this next to its socket, one write stops them all
+	if ((node->wake_fd = eventfd(0, EFD_CLOEXEC)) < 0) {
+		perror("eventfd");
 		return -1;
 	}
+	node->tx.uring = node->engine == RECV_URING;
+
+	// Bind every socket before any thread starts, the filter indexes them in bind order
+	for (int i = 0; i < node->num_shards; ++i) {
+		node->shards[i].node = node;
+		node->shards[i].index = i;
+		node->shards[i].sockfd = open_receive_socket(node, listen_port);
+		if (node->shards[i].sockfd < 0) {
+			while (i-- > 0)
+				close(node->shards[i].sockfd);
+			close(node->wake_fd);
+			node->wake_fd = -1;
+			return -1;
+		}
+	}
+
+	if (node->num_shards > 1 && attach_shard_filter(node->shards[0].sockfd, node->num_shards) < 0) {
+		// Without steering the kernel hashes on addresses and ports only, which keeps
+		// a single sender on one shard but can split relayed packets. Fall back to one shard.
+		for (int i = 1; i < node->num_shards; ++i)
+			close(node->shards[i].sockfd);
+		node->num_shards = 1;
+	}
+
+	node->recv_running = 1;
+	for (int i = 0; i < node->num_shards; ++i) {
+		if (pthread_create(&node->shards[i].thread, NULL, udp_receive_shard, &node->shards[i]) != 0) {
+			perror("pthread_create failed");
+			for (int j = i; j < node->num_shards; ++j)
+				close(node->shards[j].sockfd);
+			node->num_shards = i;
+			stop_udp_receiver(node);
+			return -1;
+		}
+	}
 	return 0;
 }
 
+// Stops the receivers start_udp_receiver left running, nothing to do if it never got that far or failed
 int stop_udp_receiver(node_t* node) {
-	node->recv_running = 0;
-	// Optionally, send a dummy datagram to self to unblock recvfrom if needed
-	udp_send(NULL, 0, node->name, node->uid, node->type, atomic_load(&node->id), 0, "255.255.255.255", RECV_PORT, CL_DISCONNECTED,
-		NULL);
 	if (!node->recv_running) return 0;
-	pthread_join(node->recv_thread, NULL);
+	node->recv_running = 0;
+	// Both engines wait on wake_fd, nobody reads it so it stays readable for every shard
+	if (node->wake_fd >= 0) {
+		uint64_t one = 1;
+		if (write(node->wake_fd, &one, sizeof(one)) < 0) perror("write eventfd");
+	}
+	for (int i = 0; i < node->num_shards; ++i) {
+		pthread_join(node->shards[i].thread, NULL);
+		close(node->shards[i].sockfd);
+		node->shards[i].sockfd = -1;
+	}
+	node->num_shards = 0;
+	if (node->wake_fd >= 0) close(node->wake_fd);
+	node->wake_fd = -1;
+	node->tx.uring = 0;
 	node->sock_listen = -1;
 	return 0;
 }
 
+// --- Rate control ---
+
+static uint64_t clock_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void rate_ctl_init(rate_ctl_t* ctl) {
+	pthread_mutex_init(&ctl->lock, NULL);
+	ctl->rate = RATE_INITIAL;
+	ctl->slow_start = 1;
+	ctl->loss = 0;
+	ctl->srtt = 0;
+	ctl->next_ns = 0;
+	ctl->interval_ns = clock_ns();
+	ctl->interval_bytes = 0;
+	ctl->interval_reports = 0;
+	ctl->cuts = 0;
+	ctl->cut_ns = 0;
+}
+
+static uint64_t rate_ctl_interval(const rate_ctl_t* ctl) {
+	return (ctl->srtt > RATE_INTERVAL ? ctl->srtt : RATE_INTERVAL) * 1e6;
+}
+
+// Closes the interval once it ran out. A sender that used less than half the rate learns nothing about the link,
+// so only a busy one grows it. Called with the lock held.
+static void rate_ctl_tick(rate_ctl_t* ctl, uint64_t now) {
+	if (now - ctl->interval_ns < rate_ctl_interval(ctl)) return;
+
+	double elapsed = (now - ctl->interval_ns) / 1e9;
+	if (ctl->interval_bytes >= ctl->rate * elapsed / 2) {
+		ctl->rate = ctl->slow_start ? ctl->rate * 2 : ctl->rate + RATE_STEP;
+		if (ctl->rate > RATE_MAX) ctl->rate = RATE_MAX;
+	}
+	if (!ctl->interval_reports) ctl->loss *= 0.875;
+	ctl->interval_ns = now;
+	ctl->interval_bytes = 0;
+	ctl->interval_reports = 0;
+}
+
+uint64_t rate_ctl_delay(rate_ctl_t* ctl) {
+	uint64_t now = clock_ns();
+	pthread_mutex_lock(&ctl->lock);
+	uint64_t until = ctl->next_ns;
+	pthread_mutex_unlock(&ctl->lock);
+	return until > now ? until - now : 0;
+}
+
+void rate_ctl_wait(rate_ctl_t* ctl) {
+	uint64_t delay = rate_ctl_delay(ctl);
+	if (delay > 0) {
+		struct timespec ts = {.tv_sec = delay / 1000000000, .tv_nsec = delay % 1000000000};
+		nanosleep(&ts, NULL);
+	}
+}
+
+// Charges bytes just sent, the next send waits until the rate has paid them off. What an idle sender saved up
+// lets the next RATE_BURST milliseconds worth go out back to back.
+void rate_ctl_charge(rate_ctl_t* ctl, size_t bytes) {
+	uint64_t now = clock_ns();
+	pthread_mutex_lock(&ctl->lock);
+	rate_ctl_tick(ctl, now);
+	uint64_t burst = RATE_BURST * 1000000ull;
+	if (ctl->next_ns + burst < now) ctl->next_ns = now - burst;
+	ctl->next_ns += bytes * 1e9 / ctl->rate;
+	ctl->interval_bytes += bytes;
+	pthread_mutex_unlock(&ctl->lock);
+}
+
+void rate_ctl_report(rate_ctl_t* ctl, int sent, int lost, uint32_t echo) {
+	if (sent <= 0) return;
+	uint64_t now = clock_ns();
+	double fraction = lost > sent ? 1 : (double)lost / sent;
+	uint32_t rtt = (uint32_t)(now / 1000000) - echo;
+
+	pthread_mutex_lock(&ctl->lock);
+	rate_ctl_tick(ctl, now);
+	if (echo && rtt < 10000) ctl->srtt = ctl->srtt ? 0.875 * ctl->srtt + 0.125 * rtt : rtt;
+	ctl->loss = 0.875 * ctl->loss + 0.125 * fraction;
+	ctl->interval_reports++;
+	// One cut per interval, the rest of the reports are about the same burst. The cut starts a new interval.
+	if (fraction > RATE_LOSS_TOLERANCE && (!ctl->cuts || now - ctl->cut_ns >= rate_ctl_interval(ctl))) {
+		ctl->rate *= fraction > 1 - RATE_DECREASE ? 1 - fraction : RATE_DECREASE;
+		if (ctl->rate < RATE_MIN) ctl->rate = RATE_MIN;
+		ctl->slow_start = 0;
+		ctl->cuts++;
+		ctl->cut_ns = now;
+		ctl->interval_ns = now;
+		ctl->interval_bytes = 0;
+	}
+	pthread_mutex_unlock(&ctl->lock);
+}
+
+// Any of the out parameters may be NULL
+void rate_ctl_stats(rate_ctl_t* ctl, double* rate, double* loss, double* srtt, unsigned long* cuts) {
+	pthread_mutex_lock(&ctl->lock);
+	rate_ctl_tick(ctl, clock_ns());
+	if (rate) *rate = ctl->rate;
+	if (loss) *loss = ctl->loss;
+	if (srtt) *srtt = ctl->srtt;
+	if (cuts) *cuts = ctl->cuts;
+	pthread_mutex_unlock(&ctl->lock);
+}
+
+// --- ### ---
+
+// Opens the broadcast and raw sockets, and one connected socket per gateway.
+// if_mtu is the MTU of our interface and sizes fragments sent to the subnet.
+// Returns 0 on success, -1 if the broadcast socket couldn't be created.
+int send_ctx_open(send_ctx_t* ctx, int if_mtu, char (*peer_ips)[INET_ADDRSTRLEN], int num_peers, uint16_t peer_port) {
+	ctx->sock_bcast = -1;
+	ctx->sock_raw = -1;
+	ctx->peers = NULL;
+	ctx->num_peers = 0;
+	ctx->frag_size = frag_size_from_mtu(if_mtu);
+	ctx->mode = SEND_BATCH;
+	ctx->uring = 0;
+	ctx->gso = 0;
+	ctx->batch_size = 0;
+	ctx->msgs = NULL;
+	ctx->iovs = NULL;
+	ctx->headers = NULL;
+	ctx->sched = NULL;
+	atomic_store(&ctx->frags_sent, 0);
+	atomic_store(&ctx->send_calls, 0);
+	pthread_mutex_init(&ctx->lock, NULL);
+	rate_ctl_init(&ctx->rate);
+
+	if (send_ctx_set_batch(ctx, SEND_BATCH_SIZE) < 0) {
+		send_ctx_close(ctx);
+		return -1;
+	}
+
+	ctx->sock_bcast = socket(AF_INET, SOCK_DGRAM, 0);
+	if (ctx->sock_bcast < 0) {
+		perror("socket");
+		send_ctx_close(ctx);
+		return -1;
+	}
+
+	int broadcast = 1;
+	if (setsockopt(ctx->sock_bcast, SOL_SOCKET, SO_BROADCAST, &broadcast, sizeof(broadcast)) < 0) {
+		perror("setsockopt");
+		send_ctx_close(ctx);
+		return -1;
+	}
+	// Takes what doesn't fit the path MTU towards a gateway, clear DF so it is fragmented on the way
+	int pmtu = IP_PMTUDISC_DONT;
+	if (setsockopt(ctx->sock_bcast, IPPROTO_IP, IP_MTU_DISCOVER, &pmtu, sizeof(pmtu)) < 0) {
+		perror("setsockopt");
+	}
+
+	// Probe for UDP GSO (Linux 4.18+). The segment size itself is passed per send as a control message.
+	int gso_size = sizeof(header_t) + ctx->frag_size;
+	ctx->gso = setsockopt(ctx->sock_bcast, SOL_UDP, UDP_SEGMENT, &gso_size, sizeof(gso_size)) == 0;
+	if (ctx->gso) {
+		gso_size = 0;
+		setsockopt(ctx->sock_bcast, SOL_UDP, UDP_SEGMENT, &gso_size, sizeof(gso_size));
+	}
+
+	// Spoofed sends need CAP_NET_RAW, keep going without them
+	ctx->sock_raw = socket(PF_INET, SOCK_RAW, IPPROTO_UDP);
+	if (ctx->sock_raw < 0) {
+		fprintf(stderr, "Raw socket unavailable - %s\n", strerror(errno));
+	} else {
+		int one = 1;
+		if (setsockopt(ctx->sock_raw, IPPROTO_IP, IP_HDRINCL, &one, sizeof(one)) < 0) {
+			fprintf(stderr, "Socket Option Error (Header Include) - %s\n", strerror(errno));
+			close(ctx->sock_raw);
+			ctx->sock_raw = -1;
+		}
+	}
+
+	if (num_peers > 0) {
+		ctx->peers = calloc(num_peers, sizeof(send_peer_t));
+		if (!ctx->peers) {
+			perror("calloc");
+			send_ctx_close(ctx);
+			return -1;
+		}
+	}
+
+	for (int i = 0; i < num_peers; ++i) {
+		send_peer_t* peer = &ctx->peers[ctx->num_peers];
+		struct sockaddr_in dest;
+		memset(&dest, 0, sizeof(dest));
+		dest.sin_family = AF_INET;
+		dest.sin_port = htons(peer_port);
+		if (inet_pton(AF_INET, peer_ips[i], &dest.sin_addr) != 1) {
+			fprintf(stderr, "Invalid gateway ip '%s'\n", peer_ips[i]);
+			continue;
+		}
+
+		peer->sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+		if (peer->sockfd < 0) {
+			perror("socket");
+			continue;
+		}
+		// Set DF so the kernel does path MTU discovery towards the gateway for us
+		int pmtu = IP_PMTUDISC_DO;
+		if (setsockopt(peer->sockfd, IPPROTO_IP, IP_MTU_DISCOVER, &pmtu, sizeof(pmtu)) < 0) {
+			perror("setsockopt");
+		}
+		// Connected sockets skip the route lookup on every send
+		if (connect(peer->sockfd, (struct sockaddr*)&dest, sizeof(dest)) < 0) {
+			perror("connect");
+			close(peer->sockfd);
+			continue;
+		}
+		memcpy(peer->ip, peer_ips[i], INET_ADDRSTRLEN);
+		peer->port = peer_port;
+		peer->addr = dest;
+		atomic_store(&peer->frag_size, ctx->frag_size);
+		ctx->num_peers++;
+	}
+
+	send_ctx_refresh_pmtu(ctx);
+	return 0;
+}
+
+// Re-reads the path MTU the kernel learned for every gateway. Cheap, called with every heartbeat.
+void send_ctx_refresh_pmtu(send_ctx_t* ctx) {
+	for (int i = 0; i < ctx->num_peers; ++i) {
+		int mtu;
+		socklen_t len = sizeof(mtu);
+		if (getsockopt(ctx->peers[i].sockfd, IPPROTO_IP, IP_MTU, &mtu, &len) < 0) continue;
+
+		uint16_t frag_size = frag_size_from_mtu(mtu);
+		if (atomic_exchange(&ctx->peers[i].frag_size, frag_size) != frag_size) {
+			printf("Path MTU to %s is %d, fragments are now %u bytes\n", ctx->peers[i].ip, mtu, frag_size);
+		}
+	}
+}
+
+void send_ctx_close(send_ctx_t* ctx) {
+	if (ctx->sock_bcast >= 0) close(ctx->sock_bcast);
+	if (ctx->sock_raw >= 0) close(ctx->sock_raw);
+	for (int i = 0; i < ctx->num_peers; ++i) {
+		close(ctx->peers[i].sockfd);
+	}
+	free(ctx->peers);
+	free(ctx->msgs);
+	free(ctx->iovs);
+	free(ctx->headers);
+	pthread_mutex_destroy(&ctx->lock);
+	pthread_mutex_destroy(&ctx->rate.lock);
+
+	ctx->sock_bcast = -1;
+	ctx->sock_raw = -1;
+	ctx->peers = NULL;
+	ctx->num_peers = 0;
+	ctx->batch_size = 0;
+	ctx->msgs = NULL;
+	ctx->iovs = NULL;
+	ctx->headers = NULL;
+}
+
+// (Re)allocates the sendmmsg batch for batch_size fragments.
+int send_ctx_set_batch(send_ctx_t* ctx, int batch_size) {
+	if (batch_size <= 0) return -1;
+
+	struct mmsghdr* msgs = calloc(batch_size, sizeof(struct mmsghdr));
+	struct iovec* iovs = calloc(2 * batch_size, sizeof(struct iovec));
+	header_t* headers = calloc(batch_size, sizeof(header_t));
+	if (!msgs || !iovs || !headers) {
+		perror("malloc");
+		free(msgs);
+		free(iovs);
+		free(headers);
+		return -1;
+	}
+
+	pthread_mutex_lock(&ctx->lock);
+	free(ctx->msgs);
+	free(ctx->iovs);
+	free(ctx->headers);
+	ctx->msgs = msgs;
+	ctx->iovs = iovs;
+	ctx->headers = headers;
+	ctx->batch_size = batch_size;
+	pthread_mutex_unlock(&ctx->lock);
+	return 0;
+}
+
+// Returns the connected socket for datagrams with size bytes of payload towards d_ip:d_port, or -1 if d_ip isn't a
+// known gateway or they don't fit its path MTU. The broadcast socket takes those.
+static int send_ctx_peer_sock(const send_ctx_t* ctx, const char d_ip[INET_ADDRSTRLEN], uint16_t d_port, size_t size) {
+	for (int i = 0; i < ctx->num_peers; ++i) {
+		if (ctx->peers[i].port == d_port && !strcmp(ctx->peers[i].ip, d_ip)) {
+			return size <= atomic_load(&ctx->peers[i].frag_size) ? ctx->peers[i].sockfd : -1;
+		}
+	}
+	return -1;
+}
+
+// Fragment payload size to use towards d_ip:d_port.
+uint16_t send_ctx_frag_size(const send_ctx_t* ctx, const char d_ip[INET_ADDRSTRLEN], uint16_t d_port) {
+	for (int i = 0; i < ctx->num_peers; ++i) {
+		if (ctx->peers[i].port == d_port && !strcmp(ctx->peers[i].ip, d_ip)) {
+			return atomic_load(&ctx->peers[i].frag_size);
+		}
+	}
+	return ctx->frag_size;
+}
+
+static pthread_key_t tx_ring_key;
+static pthread_once_t tx_ring_once = PTHREAD_ONCE_INIT;
+
+static void tx_ring_free(void* arg) {
+	uring_t* ring = (uring_t*)arg;
+	uring_exit(ring);
+	free(ring);
+}
+
+static void tx_ring_key_init(void) { pthread_key_create(&tx_ring_key, tx_ring_free); }
+
+// Send ring of the calling thread. udp_send runs on the GTK, timer and worker threads, each of them
+// gets its own ring so submissions need no locking. NULL if io_uring can't be set up.
+static uring_t* tx_ring_get(void) {
+	pthread_once(&tx_ring_once, tx_ring_key_init);
+	uring_t* ring = pthread_getspecific(tx_ring_key);
+	if (ring) return ring;
+
+	ring = malloc(sizeof(uring_t));
+	if (!ring || uring_init(ring, URING_ENTRIES) < 0) {
+		perror("io_uring_setup");
+		free(ring);
+		return NULL;
+	}
+	pthread_setspecific(tx_ring_key, ring);
+	return ring;
+}
+
+// Sends msgs[0..n) with one io_uring_enter per URING_ENTRIES datagrams. fds[i] is the socket of msgs[i],
+// or sockfd for all of them if fds is NULL. Linked chains keep fragments in order, and the first failure
+// cancels the rest of the chain just like sendmmsg stops. Returns the number sent, -1 without a ring or room on it.
+static int uring_send_chain(send_ctx_t* ctx, int sockfd, const int* fds, struct mmsghdr* msgs, int n, int link) {
+	uring_t* ring = tx_ring_get();
+	if (!ring) {
+		ctx->uring = 0;
+		return -1;
+	}
+
+	int done = 0;
+	for (int first = 0; first < n;) {
+		int batch = n - first;
+		if (batch > URING_ENTRIES) batch = URING_ENTRIES;
+		// A chain goes in with one submission, make room for all of it first
+		if (uring_sq_space(ring) < (unsigned)batch) {
+			while (uring_enter(ring, 0) < 0 && errno == EINTR) {
+			}
+		}
+		if (uring_sq_space(ring) < (unsigned)batch) {
+			if (first == 0) return -1; // The caller sends without the ring
+			break;
+		}
+		for (int i = 0; i < batch; ++i) {
+			struct io_uring_sqe* sqe = uring_get_sqe(ring);
+			sqe->opcode = IORING_OP_SENDMSG;
+			sqe->fd = fds ? fds[first + i] : sockfd;
+			sqe->addr = (unsigned long)&msgs[first + i].msg_hdr;
+			sqe->len = 1;
+			if (link && i < batch - 1) sqe->flags = IOSQE_IO_LINK;
+		}
+
+		int ret;
+		do {
+			ret = uring_enter(ring, batch);
+		} while (ret < 0 && errno == EINTR);
+		atomic_fetch_add(&ctx->send_calls, 1);
+		if (ret < 0) {
+			perror("io_uring_enter");
+			*ring->sq_tail -= ring->to_submit; // Drop what the kernel didn't take
+			ring->to_submit = 0;
+			break;
+		}
+
+		// Every submitted SQE posts exactly one completion
+		for (int seen = 0; seen < ret;) {
+			struct io_uring_cqe* cqe = uring_peek_cqe(ring);
+			if (!cqe) {
+				if (uring_enter(ring, 1) < 0 && errno != EINTR) break;
+				continue;
+			}
+			if (cqe->res >= 0) {
+				done++;
+			} else if (cqe->res != -ECANCELED) {
+				if (cqe->res == -EMSGSIZE) send_ctx_refresh_pmtu(ctx);
+				fprintf(stderr, "io_uring sendmsg - %s\n", strerror(-cqe->res));
+			}
+			uring_cqe_seen(ring);
+			seen++;
+		}
+		first += batch;
+	}
+	atomic_fetch_add(&ctx->frags_sent, done);
+	return done;
+}
+
+// Pushes n prepared datagrams, retrying when the kernel accepts only part of them.
+// Returns the number of datagrams sent.
+static int send_ctx_flush(send_ctx_t* ctx, int sockfd, struct mmsghdr* msgs, int n) {
+	if (ctx->uring) {
+		int sent = uring_send_chain(ctx, sockfd, NULL, msgs, n, 1);
+		if (sent >= 0) return sent;
+	}
+
+	int done = 0;
+	while (done < n) {
+		int sent = sendmmsg(sockfd, msgs + done, n - done, 0);
+		atomic_fetch_add(&ctx->send_calls, 1);
+		if (sent < 0) {
+			if (errno == EINTR) continue;
+			// The path MTU shrank under us, later packets pick up the new fragment size
+			if (errno == EMSGSIZE) send_ctx_refresh_pmtu(ctx);
+			perror("sendmmsg");
+			break;
+		}
+		done += sent;
+	}
+	atomic_fetch_add(&ctx->frags_sent, done);
+	return done;
+}
+
+// Sends the n fragments already laid out in ctx->iovs as one UDP_SEGMENT buffer. Every segment is
+// header_t + seg_payload bytes, only the last one may be shorter, so the kernel splits it back into
+// exactly the datagrams the per-fragment path would have sent. Returns -1 if nothing went out, the
+// caller sends the batch without GSO then.
+static int send_ctx_gso(send_ctx_t* ctx, int sockfd, struct sockaddr_in* dest, int n, uint16_t seg_payload) {
+	char control[CMSG_SPACE(sizeof(uint16_t))];
+	struct msghdr hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memset(control, 0, sizeof(control));
+	hdr.msg_name = dest;
+	hdr.msg_namelen = dest ? sizeof(struct sockaddr_in) : 0;
+	hdr.msg_iov = ctx->iovs;
+	hdr.msg_iovlen = 2 * n;
+	hdr.msg_control = control;
+	hdr.msg_controllen = sizeof(control);
+
+	struct cmsghdr* cm = CMSG_FIRSTHDR(&hdr);
+	cm->cmsg_level = SOL_UDP;
+	cm->cmsg_type = UDP_SEGMENT;
+	cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+	*(uint16_t*)CMSG_DATA(cm) = sizeof(header_t) + seg_payload;
+
+	ssize_t sent;
+	do {
+		sent = sendmsg(sockfd, &hdr, 0);
+	} while (sent < 0 && errno == EINTR);
+	atomic_fetch_add(&ctx->send_calls, 1);
+
+	if (sent < 0 && errno == EMSGSIZE) {
+		// The path MTU shrank under us, not a GSO problem. The resend picks a socket for the new one.
+		send_ctx_refresh_pmtu(ctx);
+		return -1;
+	}
+	if (sent < 0) {
+		// EIO: the egress device can't checksum offload, EINVAL/ENOPROTOOPT: no GSO for this route
+		fprintf(stderr, "UDP GSO send failed, falling back to sendmmsg - %s\n", strerror(errno));
+		ctx->gso = 0;
+		return -1;
+	}
+	atomic_fetch_add(&ctx->frags_sent, n);
+	return n;
+}
+
+// Sends a single datagram through the peer socket if there is one, otherwise through the broadcast socket.
+static ssize_t send_ctx_sendto(send_ctx_t* ctx, const void* buf, size_t len, const char d_ip[INET_ADDRSTRLEN],
+	uint16_t d_port) {
+	atomic_fetch_add(&ctx->send_calls, 1);
+	atomic_fetch_add(&ctx->frags_sent, 1);
+
+	int peer_fd = send_ctx_peer_sock(ctx, d_ip, d_port, len > sizeof(header_t) ? len - sizeof(header_t) : 0);
+	if (peer_fd >= 0) {
+		return send(peer_fd, buf, len, 0);
+	}
+
+	struct sockaddr_in dest;
+	memset(&dest, 0, sizeof(dest));
+	dest.sin_family = AF_INET;
+	dest.sin_port = htons(d_port);
+	dest.sin_addr.s_addr = inet_addr(d_ip);
+
+	return sendto(ctx->sock_bcast, buf, len, 0, (struct sockaddr*)&dest, sizeof(dest));
+}
+
 // takes a  data with size data_size
 // broadcasts to d_port with spoofed ip if randomize_ip is set
-void udp_send_raw(const char* msg, size_t size, const char name[NAME_LEN], const char uid[UID_LEN], node_e n_type, uint16_t id,
-	uint8_t num_keys, char s_ip[INET_ADDRSTRLEN], char d_ip[INET_ADDRSTRLEN], uint16_t s_port, uint16_t d_port, enum cl_e flags,
-	const char filename[FILENAME_LEN]) {
+void udp_send_raw(send_ctx_t* ctx, const char* msg, size_t size, const char name[NAME_LEN], const char uid[UID_LEN],
+	node_e n_type, uint16_t id, uint8_t num_keys, char s_ip[INET_ADDRSTRLEN], char d_ip[INET_ADDRSTRLEN], uint16_t s_port,
+	uint16_t d_port, enum cl_e flags, const char filename[FILENAME_LEN]) {
 	// Initialize variables.
 	char buffer[MAX_FRAGMENT];
 
@@ -152,9 +1278,12 @@ void udp_send_raw(const char* msg, size_t size, const char name[NAME_LEN], const
 	struct udphdr* udphdr = (struct udphdr*)(buffer + sizeof(struct iphdr));
 	header_t* custom_header = (header_t*)(buffer + sizeof(struct iphdr) + sizeof(struct udphdr));
 
-	int sockfd;
 	struct sockaddr_in sin;
-	int one = 1;
+
+	if (ctx->sock_raw < 0) {
+		fprintf(stderr, "Raw socket is not open, can't send spoofed packet\n");
+		return;
+	}
 
 	// Set packet buffer to 0's.
 	memset(buffer, 0, MAX_FRAGMENT);
@@ -169,6 +1298,7 @@ void udp_send_raw(const char* msg, size_t size, const char name[NAME_LEN], const
 	custom_header->num_key = num_keys;
 	custom_header->frag_num = 0;
 	custom_header->total_fragments = 0;
+	custom_header->frag_size = htons(size);
 	char* pcktData = (char*)(buffer + sizeof(struct iphdr) + sizeof(struct udphdr) + sizeof(header_t));
 
 	memcpy(pcktData, msg, size);
@@ -202,136 +1332,594 @@ void udp_send_raw(const char* msg, size_t size, const char name[NAME_LEN], const
 	// IP Checksum.
 	iphdr->check = csum((unsigned short*)buffer, sizeof(struct iphdr) + sizeof(struct udphdr));
 
-	// Create the socket.
-	sockfd = socket(PF_INET, SOCK_RAW, IPPROTO_UDP);
+	// Check for send error.
+	if (sendto(ctx->sock_raw, buffer, total_len, 0, (struct sockaddr*)&sin, sizeof(sin)) <= 0) {
+		fprintf(stderr, "Error sending packet...\n\n");
+		perror("sendto");
+	}
+}
 
-	// Check for socket error.
-	if (sockfd <= 0) {
-		fprintf(stderr, "Socket Error - %s\n", strerror(errno));
-		perror("sockfd");
+// Header of one fragment from the packet's template, fields are put in wire order
+static void fill_header(header_t* header, const header_t* tmpl, uint16_t size, uint16_t frag_num,
+	uint16_t total_fragments) {
+	*header = *tmpl;
+	header->size = htons(size);
+	header->frag_num = frag_num;
+	header->total_fragments = total_fragments;
+	header->frag_size = htons(tmpl->frag_size);
+	if (tmpl->fec_data && frag_num < total_fragments) {
+		header->fec_block = frag_num / tmpl->fec_data;
+		header->fec_index = frag_num % tmpl->fec_data;
+	} else if (tmpl->fec_data) { // Parity
+		header->fec_block = (frag_num - total_fragments) / tmpl->fec_parity;
+		header->fec_index = tmpl->fec_data + (frag_num - total_fragments) % tmpl->fec_parity;
+	}
+}
+
+// Template of a whole packet for udp_send and udp_queue, returns its number of fragments
+static int packet_tmpl(header_t* tmpl, const send_ctx_t* ctx, size_t size, const char name[NAME_LEN],
+	const char uid[UID_LEN], node_e n_type, uint16_t id, uint8_t num_keys, const char d_ip[INET_ADDRSTRLEN],
+	uint16_t d_port, enum cl_e flags, const char filename[FILENAME_LEN]) {
+	memset(tmpl, 0, sizeof(header_t));
+	memcpy(tmpl->name, name, NAME_LEN);
+	memcpy(tmpl->uid, uid, UID_LEN);
+	if (filename) memcpy(tmpl->filename, filename, FILENAME_LEN);
+	tmpl->node_type = n_type;
+	tmpl->cl_flags = flags;
+	tmpl->id = id;
+	tmpl->num_key = num_keys;
+	tmpl->frag_size = send_ctx_frag_size(ctx, d_ip, d_port);
+
+	// divide the packet to as many fragments as necessary
+	// we need header in all fragments so ignore it
+	return ceil((double)size / (double)tmpl->frag_size);
+}
+
+void udp_send(send_ctx_t* ctx, const char* msg, size_t size, const char name[NAME_LEN], const char uid[UID_LEN],
+	node_e n_type, uint16_t id, uint8_t num_keys, char d_ip[INET_ADDRSTRLEN], uint16_t d_port, enum cl_e flags,
+	const char filename[FILENAME_LEN]) {
+	header_t tmpl;
+	int num_fragments = packet_tmpl(&tmpl, ctx, size, name, uid, n_type, id, num_keys, d_ip, d_port, flags, filename);
+	udp_send_frags(ctx, msg, size, &tmpl, 0, num_fragments, d_ip, d_port);
+}
+
+void udp_queue(send_ctx_t* ctx, const char* msg, size_t size, const char name[NAME_LEN], const char uid[UID_LEN],
+	node_e n_type, uint16_t id, uint8_t num_keys, char d_ip[INET_ADDRSTRLEN], uint16_t d_port, enum cl_e flags,
+	const char filename[FILENAME_LEN]) {
+	header_t tmpl;
+	int num_fragments = packet_tmpl(&tmpl, ctx, size, name, uid, n_type, id, num_keys, d_ip, d_port, flags, filename);
+	udp_queue_frags(ctx, msg, size, &tmpl, 0, num_fragments, d_ip, d_port);
+}
+
+// Sends count fragments numbered from first_frag, cut from the len bytes at msg. Only the last may be short. Bulk
+// sends are charged to the rate control, but never wait for it here, see bulk_slice.
+static void send_run(send_ctx_t* ctx, const char* msg, size_t len, const header_t* tmpl, int first_frag, int count,
+	uint16_t num_fragments, char d_ip[INET_ADDRSTRLEN], uint16_t d_port) {
+	uint16_t frag_size = tmpl->frag_size;
+	enum cl_e flags = tmpl->cl_flags;
+	int end_frag = first_frag + count;
+	size_t bytes_sent = 0;
+	int cur_send = 0;
+	// Files are paced by the rate control, everything else keeps the fixed pace
+	int bulk = (flags & CL_FILE) && num_fragments > 1;
+	header_t stamped = *tmpl;
 
-		exit(1);
+	if (ctx->mode == SEND_SINGLE) {
+		for (int i = first_frag; i < end_frag; ++i) {
+			// Compose payload: header + message
+			char buffer[MAX_FRAGMENT + sizeof(header_t)];
+
+			if (len - bytes_sent > frag_size)
+				cur_send = frag_size;
+			else // Last fragment
+				cur_send = len - bytes_sent;
+
+			stamped.stamp = clock_ns() / 1000000;
+			fill_header((header_t*)buffer, &stamped, cur_send, i, num_fragments);
+			memcpy(buffer + sizeof(header_t), msg + bytes_sent, cur_send);
+
+			// Send UDP datagram
+			ssize_t sent = send_ctx_sendto(ctx, buffer, sizeof(header_t) + cur_send, d_ip, d_port);
+			if (sent < 0) {
+				perror("sendto");
+			}
+			bytes_sent += cur_send;
+			if (bulk)
+				rate_ctl_charge(&ctx->rate, sizeof(header_t) + cur_send);
+			else
+				usleep(100);
+		}
+		return;
 	}
 
-	// Let the socket know we want to pass our own headers.
-	if (setsockopt(sockfd, IPPROTO_IP, IP_HDRINCL, &one, sizeof(one)) < 0) {
-		fprintf(stderr, "Socket Option Error (Header Include) - %s\n", strerror(errno));
-		perror("setsockopt");
+	struct sockaddr_in dest;
+	memset(&dest, 0, sizeof(dest));
+	dest.sin_family = AF_INET;
+	dest.sin_port = htons(d_port);
+	dest.sin_addr.s_addr = inet_addr(d_ip);
+
+	// Gateways have their own connected socket while the fragments fit its path MTU, everything else goes out through
+	// the broadcast socket. GSO segments must fit the path MTU, fragments too big for a gateway's go without it.
+	int gateway = send_ctx_peer_sock(ctx, d_ip, d_port, 0) >= 0;
+
+	// File transfers are handed to the kernel as one buffer per batch when UDP GSO is available
+	int gso_segments = GSO_MAX_BYTES / (sizeof(header_t) + frag_size);
+	if (gso_segments > GSO_MAX_SEGMENTS) gso_segments = GSO_MAX_SEGMENTS;
 
-		exit(1);
+	for (int first = first_frag; first < end_frag;) {
+		pthread_mutex_lock(&ctx->lock);
+
+		int sockfd = send_ctx_peer_sock(ctx, d_ip, d_port, frag_size);
+		int connected = sockfd >= 0;
+		if (!connected) sockfd = ctx->sock_bcast;
+		int use_gso = bulk && ctx->gso && (connected || !gateway);
+		int batch = end_frag - first;
+		if (batch > ctx->batch_size) batch = ctx->batch_size;
+		if (use_gso && batch > gso_segments) batch = gso_segments;
+		stamped.stamp = clock_ns() / 1000000;
+		size_t batch_bytes = bytes_sent;
+
+		for (int j = 0; j < batch; ++j) {
+			if (len - bytes_sent > frag_size)
+				cur_send = frag_size;
+			else // Last fragment
+				cur_send = len - bytes_sent;
+
+			fill_header(&ctx->headers[j], &stamped, cur_send, first + j, num_fragments);
+
+			// Only the header is built here, the payload is read straight from msg by the kernel
+			struct iovec* iov = &ctx->iovs[2 * j];
+			iov[0].iov_base = &ctx->headers[j];
+			iov[0].iov_len = sizeof(header_t);
+			iov[1].iov_base = (char*)msg + bytes_sent;
+			iov[1].iov_len = cur_send;
+
+			bytes_sent += cur_send;
+		}
+
+		if (use_gso && send_ctx_gso(ctx, sockfd, connected ? NULL : &dest, batch, frag_size) < 0) {
+			use_gso = 0; // Same iovecs go out through sendmmsg instead
+			sockfd = send_ctx_peer_sock(ctx, d_ip, d_port, frag_size);
+			connected = sockfd >= 0;
+			if (!connected) sockfd = ctx->sock_bcast;
+		}
+
+		if (!use_gso) {
+			for (int j = 0; j < batch; ++j) {
+				struct msghdr* hdr = &ctx->msgs[j].msg_hdr;
+				memset(hdr, 0, sizeof(struct msghdr));
+				hdr->msg_name = connected ? NULL : &dest;
+				hdr->msg_namelen = connected ? 0 : sizeof(dest);
+				hdr->msg_iov = &ctx->iovs[2 * j];
+				hdr->msg_iovlen = 2;
+			}
+			send_ctx_flush(ctx, sockfd, ctx->msgs, batch);
+		}
+		pthread_mutex_unlock(&ctx->lock);
+
+		first += batch;
+		if (bulk)
+			rate_ctl_charge(&ctx->rate, bytes_sent - batch_bytes + batch * sizeof(header_t));
+		else if (first < end_frag)
+			usleep(SEND_BATCH_PACE);
 	}
+}
 
-	// Check for send error.
-	if (sendto(sockfd, buffer, total_len, 0, (struct sockaddr*)&sin, sizeof(sin)) <= 0) {
-		fprintf(stderr, "Error sending packet...\n\n");
-		perror("sendto");
+static int tx_sched_queue(tx_sched_t* sched, const char* msg, size_t size, const header_t* tmpl, int first_frag,
+	int count, int num_fragments, char d_ip[INET_ADDRSTRLEN], uint16_t d_port);
+static int tx_sched_queue_copy(tx_sched_t* sched, const char* msg, size_t size, const header_t* tmpl, int first_frag,
+	int count, int num_fragments, char d_ip[INET_ADDRSTRLEN], uint16_t d_port);
+static int send_frags_paced(send_ctx_t* ctx, const char* msg, size_t size, const header_t* tmpl, int first_frag,
+	int count, int num_fragments, char d_ip[INET_ADDRSTRLEN], uint16_t d_port);
+
+// udp_send_frags without the scheduler, on the caller's thread
+static int send_frags(send_ctx_t* ctx, const char* msg, size_t size, const header_t* tmpl, int first_frag, int count,
+	int num_fragments, char d_ip[INET_ADDRSTRLEN], uint16_t d_port) {
+	uint16_t frag_size = tmpl->frag_size;
+	int end_frag = first_frag + count;
+	size_t start = (size_t)first_frag * frag_size; // Offset in the packet msg points at
+	int n = tmpl->fec_data;
+	int k = tmpl->fec_parity;
+	int blocks = n ? (num_fragments + n - 1) / n : 0;
+	if (!n || n > FEC_MAX_DATA || k < 1 || k > FEC_MAX_PARITY || num_fragments + blocks * k > UINT16_MAX) {
+		header_t plain = *tmpl;
+		plain.fec_data = 0;
+		plain.fec_parity = 0;
+		send_run(ctx, msg, size - start < (size_t)count * frag_size ? size - start : (size_t)count * frag_size, &plain,
+			first_frag, count, num_fragments, d_ip, d_port);
+		return count;
 	}
 
-	// Close socket.
-	close(sockfd);
+	header_t coded = *tmpl;
+	coded.last_size = size - (size_t)(num_fragments - 1) * frag_size;
+	unsigned char parity[FEC_MAX_PARITY * MAX_FRAGMENT];
+	for (int f = first_frag; f < end_frag;) {
+		int block = f / n;
+		int block_end = (block + 1) * n < num_fragments ? (block + 1) * n : num_fragments;
+		int stop = block_end < end_frag ? block_end : end_frag;
+		const char* data = msg + ((size_t)f * frag_size - start);
+		size_t len = size - (size_t)f * frag_size;
+		if (len > (size_t)(stop - f) * frag_size) len = (size_t)(stop - f) * frag_size;
+		send_run(ctx, data, len, &coded, f, stop - f, num_fragments, d_ip, d_port);
+
+		if (f == block * n && stop == block_end) { // The whole block went out, its parity follows
+			fec_encode((const unsigned char*)data, len, stop - f, k, frag_size, parity);
+			send_run(ctx, (const char*)parity, (size_t)k * frag_size, &coded, num_fragments + block * k, k,
+				num_fragments, d_ip, d_port);
+		}
+		f = stop;
+	}
+	return count;
 }
 
-void udp_send(const char* msg, size_t size, const char name[NAME_LEN], const char uid[UID_LEN], node_e n_type, uint16_t id,
-	uint8_t num_keys, char d_ip[INET_ADDRSTRLEN], uint16_t d_port, enum cl_e flags, const char filename[FILENAME_LEN]) {
+int udp_send_frags(send_ctx_t* ctx, const char* msg, size_t size, const header_t* tmpl, int first_frag, int count,
+	char d_ip[INET_ADDRSTRLEN], uint16_t d_port) {
+	int num_fragments = ceil((double)size / (double)tmpl->frag_size);
+	if (first_frag < 0 || count <= 0 || first_frag + count > num_fragments) return 0;
 
-	// Setup UDP socket
-	int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-	if (sockfd < 0) {
-		perror("socket");
-		exit(EXIT_FAILURE);
+	int sent;
+	if (ctx->sched && (sent = tx_sched_queue(ctx->sched, msg, size, tmpl, first_frag, count, num_fragments, d_ip, d_port))
+			>= 0)
+		return sent;
+	return send_frags_paced(ctx, msg, size, tmpl, first_frag, count, num_fragments, d_ip, d_port);
+}
+
+int udp_queue_frags(send_ctx_t* ctx, const char* msg, size_t size, const header_t* tmpl, int first_frag, int count,
+	char d_ip[INET_ADDRSTRLEN], uint16_t d_port) {
+	int num_fragments = ceil((double)size / (double)tmpl->frag_size);
+	if (first_frag < 0 || count <= 0 || first_frag + count > num_fragments) return 0;
+
+	int queued;
+	if (ctx->sched
+		&& (queued = tx_sched_queue_copy(ctx->sched, msg, size, tmpl, first_frag, count, num_fragments, d_ip, d_port))
+			>= 0)
+		return queued;
+	return send_frags_paced(ctx, msg, size, tmpl, first_frag, count, num_fragments, d_ip, d_port);
+}
+
+// --- Transmit scheduler ---
+
+// A packet waiting in its class queue. Lives on the stack of the udp_send_frags call that queued it, or is detached
+// and owned by the scheduler.
+struct tx_item {
+	tx_item* next;
+	header_t tmpl;
+	const char* msg; // At fragment first_frag
+	size_t size;
+	int first_frag; // Next fragment to send
+	int count; // Left to send
+	int num_fragments;
+	char d_ip[INET_ADDRSTRLEN];
+	uint16_t d_port;
+	uint64_t queued_ns;
+	int started;
+	int sent;
+	int done;
+	size_t copied; // Detached from udp_queue_frags: bytes of the copy of msg that follows the item, freed with it
+};
+
+static const char* tx_class_names[TX_CLASSES] = {"control", "interactive", "bulk"};
+
+const char* tx_class_name(tx_class_e cls) { return cls < TX_CLASSES ? tx_class_names[cls] : "?"; }
+
+static tx_class_e tx_class_of(const header_t* tmpl, int num_fragments) {
+	if (tmpl->cl_flags & (CL_CONNECTED | CL_DISCONNECTED | CL_ALIVE | CL_NACK | CL_SENDER_KEY | CL_KEY)) return TX_CONTROL;
+	if (tmpl->cl_flags & CL_FILE && num_fragments > 1) return TX_BULK;
+	return TX_INTERACTIVE;
+}
+
+static void tx_queue_push(tx_queue_t* q, tx_item* item) {
+	item->next = NULL;
+	if (q->tail)
+		q->tail->next = item;
+	else
+		q->head = item;
+	q->tail = item;
+}
+
+// Fragments of a bulk packet to send between two rate control waits: what send_run hands the kernel in one call,
+// rounded to whole FEC blocks so every block keeps its parity
+static int bulk_slice(const send_ctx_t* ctx, const header_t* tmpl, int first_frag, int count) {
+	int batch = ctx->batch_size;
+	int gso_segments = GSO_MAX_BYTES / (sizeof(header_t) + tmpl->frag_size);
+	if (ctx->gso && gso_segments < batch) batch = gso_segments;
+	int n = tmpl->fec_data;
+	int end = first_frag + batch;
+	if (n) {
+		end = end / n * n;
+		if (end <= first_frag) end = (first_frag / n + 1) * n;
+	}
+	return end - first_frag < count ? end - first_frag : count;
+}
+
+// send_frags for packets the scheduler doesn't pace, bulk ones wait for the rate control before every slice
+static int send_frags_paced(send_ctx_t* ctx, const char* msg, size_t size, const header_t* tmpl, int first_frag,
+	int count, int num_fragments, char d_ip[INET_ADDRSTRLEN], uint16_t d_port) {
+	if (tx_class_of(tmpl, num_fragments) != TX_BULK)
+		return send_frags(ctx, msg, size, tmpl, first_frag, count, num_fragments, d_ip, d_port);
+	int sent = 0;
+	while (count > 0) {
+		int slice = bulk_slice(ctx, tmpl, first_frag, count);
+		rate_ctl_wait(&ctx->rate);
+		sent += send_frags(ctx, msg, size, tmpl, first_frag, slice, num_fragments, d_ip, d_port);
+		msg += (size_t)slice * tmpl->frag_size;
+		first_frag += slice;
+		count -= slice;
 	}
+	return sent;
+}
 
-	int broadcast = 1;
-	if (setsockopt(sockfd, SOL_SOCKET, SO_BROADCAST, &broadcast, sizeof(broadcast)) < 0) {
-		perror("setsockopt");
-		close(sockfd);
+// Lets the caller waiting for item go on, or frees a detached one. Called with the lock held.
+static void tx_item_done(tx_sched_t* sched, tx_item* item) {
+	if (item->copied) {
+		sched->detached_bytes -= item->copied;
+		free(item);
 		return;
 	}
+	item->done = 1;
+	pthread_cond_broadcast(&sched->done);
+}
 
-	int num_fragments = 0;
+static void* tx_sched_thread(void* arg) {
+	tx_sched_t* sched = (tx_sched_t*)arg;
+	send_ctx_t* ctx = sched->ctx;
 
-	// divide the packet to as many fragments as necessary
-	// we need header in all fragments so ignore it
-	num_fragments = ceil((double)size / (double)MAX_FRAGMENT);
+	pthread_mutex_lock(&sched->lock);
+	while (sched->running) {
+		int cls = 0;
+		while (cls < TX_CLASSES && !sched->queues[cls].head)
+			cls++;
+		if (cls == TX_CLASSES) {
+			pthread_cond_wait(&sched->wake, &sched->lock);
+			continue;
+		}
+		// Bulk waits for the rate control here rather than in send_run, anything queued meanwhile goes first
+		if (cls == TX_BULK) {
+			uint64_t delay = rate_ctl_delay(&ctx->rate);
+			if (delay > 0) {
+				uint64_t until = clock_ns() + delay;
+				struct timespec ts = {.tv_sec = until / 1000000000, .tv_nsec = until % 1000000000};
+				pthread_cond_timedwait(&sched->wake, &sched->lock, &ts);
+				continue;
+			}
+		}
 
-	int bytes_sent = 0;
-	int cur_send = 0;
-	for (int i = 0; i < num_fragments; ++i) {
-		// Compose payload: header + message
-		char buffer[MAX_FRAGMENT + sizeof(header_t)];
-		header_t* custom_header = (header_t*)buffer;
-
-		memset(buffer, 0, sizeof(buffer));
-
-		if (size - bytes_sent > MAX_FRAGMENT)
-			cur_send = MAX_FRAGMENT;
-		else // Last fragment
-			cur_send = size - bytes_sent;
-
-		custom_header->size = htons(cur_send);
-		memcpy(custom_header->name, name, NAME_LEN);
-		memcpy(custom_header->uid, uid, UID_LEN);
-		if (filename) memcpy(custom_header->filename, filename, FILENAME_LEN);
-		custom_header->node_type = n_type;
-		custom_header->cl_flags = flags;
-		custom_header->id = id;
-		custom_header->num_key = num_keys;
-		custom_header->frag_num = i;
-		custom_header->total_fragments = num_fragments;
-
-		// Actual message we are sending
-		char* pcktData = buffer + sizeof(header_t);
-		memcpy(pcktData, msg + bytes_sent, cur_send);
-
-		int payload_len = sizeof(header_t) + cur_send;
+		tx_queue_t* q = &sched->queues[cls];
+		tx_item* item = q->head;
+		if (!item->started) {
+			double wait = (clock_ns() - item->queued_ns) / 1e6;
+			item->started = 1;
+			q->wait_ms += wait;
+			if (wait > q->max_wait_ms) q->max_wait_ms = wait;
+		}
+		int slice = cls == TX_BULK ? bulk_slice(ctx, &item->tmpl, item->first_frag, item->count) : item->count;
+		pthread_mutex_unlock(&sched->lock);
 
-		struct sockaddr_in dest;
-		memset(&dest, 0, sizeof(dest));
-		dest.sin_family = AF_INET;
-		dest.sin_port = htons(d_port);
-		dest.sin_addr.s_addr = inet_addr(d_ip);
+		int sent = send_frags(ctx, item->msg, item->size, &item->tmpl, item->first_frag, slice, item->num_fragments,
+			item->d_ip, item->d_port);
 
-		// Send UDP datagram
-		ssize_t sent = sendto(sockfd, buffer, payload_len, 0, (struct sockaddr*)&dest, sizeof(dest));
-		if (sent < 0) {
-			perror("sendto");
+		pthread_mutex_lock(&sched->lock);
+		q->fragments += sent;
+		item->sent += sent;
+		item->msg += (size_t)slice * item->tmpl.frag_size;
+		item->first_frag += slice;
+		item->count -= slice;
+		q->head = item->next;
+		if (!q->head) q->tail = NULL;
+		if (item->count > 0) { // Concurrent bulk packets take turns
+			tx_queue_push(q, item);
+		} else {
+			q->depth--;
+			q->packets++;
+			tx_item_done(sched, item);
 		}
-		bytes_sent += cur_send;
-        usleep(100);
 	}
 
-	close(sockfd);
+	// Stopped, what is still queued is dropped and its callers go on
+	for (int cls = 0; cls < TX_CLASSES; ++cls) {
+		tx_queue_t* q = &sched->queues[cls];
+		for (tx_item* item = q->head; item;) {
+			tx_item* next = item->next;
+			q->depth--;
+			q->dropped++;
+			tx_item_done(sched, item);
+			item = next;
+		}
+		q->head = q->tail = NULL;
+	}
+	pthread_cond_broadcast(&sched->done);
+	pthread_mutex_unlock(&sched->lock);
+	return NULL;
 }
 
-void udp_relay(
-	const char* msg, size_t size, const header_t* header, char d_ip[INET_ADDRSTRLEN], uint16_t d_port, enum cl_e flags) {
+static void tx_item_init(tx_item* item, const char* msg, size_t size, const header_t* tmpl, int first_frag, int count,
+	int num_fragments, const char d_ip[INET_ADDRSTRLEN], uint16_t d_port) {
+	memset(item, 0, sizeof(tx_item));
+	item->tmpl = *tmpl;
+	item->msg = msg;
+	item->size = size;
+	item->first_frag = first_frag;
+	item->count = count;
+	item->num_fragments = num_fragments;
+	strncpy(item->d_ip, d_ip, INET_ADDRSTRLEN - 1);
+	item->d_port = d_port;
+	item->queued_ns = clock_ns();
+}
 
-	// Setup UDP socket
-	int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-	if (sockfd < 0) {
-		perror("socket");
-		exit(EXIT_FAILURE);
+// Puts item in the queue of its class. Returns -1 if the scheduler isn't running, or this is its own thread. Called
+// with the lock held.
+static int tx_sched_push(tx_sched_t* sched, tx_item* item) {
+	if (!sched->running || pthread_equal(pthread_self(), sched->thread)) return -1;
+	tx_queue_t* q = &sched->queues[tx_class_of(&item->tmpl, item->num_fragments)];
+	tx_queue_push(q, item);
+	if (++q->depth > q->max_depth) q->max_depth = q->depth;
+	pthread_cond_signal(&sched->wake);
+	return 0;
+}
+
+// Queues a packet and waits until the scheduler sent it. Returns the data fragments sent, -1 if the scheduler isn't
+// running, the caller sends it itself then.
+static int tx_sched_queue(tx_sched_t* sched, const char* msg, size_t size, const header_t* tmpl, int first_frag,
+	int count, int num_fragments, char d_ip[INET_ADDRSTRLEN], uint16_t d_port) {
+	tx_item item;
+	tx_item_init(&item, msg, size, tmpl, first_frag, count, num_fragments, d_ip, d_port);
+
+	pthread_mutex_lock(&sched->lock);
+	if (tx_sched_push(sched, &item) < 0) {
+		pthread_mutex_unlock(&sched->lock);
+		return -1;
 	}
+	while (!item.done)
+		pthread_cond_wait(&sched->done, &sched->lock);
+	pthread_mutex_unlock(&sched->lock);
+	return item.sent;
+}
 
-	int broadcast = 1;
-	if (setsockopt(sockfd, SOL_SOCKET, SO_BROADCAST, &broadcast, sizeof(broadcast)) < 0) {
-		perror("setsockopt");
-		close(sockfd);
+// Queues a copy of the fragments and returns right away, see udp_queue_frags
+static int tx_sched_queue_copy(tx_sched_t* sched, const char* msg, size_t size, const header_t* tmpl, int first_frag,
+	int count, int num_fragments, char d_ip[INET_ADDRSTRLEN], uint16_t d_port) {
+	size_t start = (size_t)first_frag * tmpl->frag_size;
+	size_t len = size - start < (size_t)count * tmpl->frag_size ? size - start : (size_t)count * tmpl->frag_size;
+	tx_item* item = malloc(sizeof(tx_item) + len);
+	if (!item) return -1;
+	memcpy(item + 1, msg, len);
+	tx_item_init(item, (const char*)(item + 1), size, tmpl, first_frag, count, num_fragments, d_ip, d_port);
+	item->copied = len;
+
+	pthread_mutex_lock(&sched->lock);
+	if (sched->detached_bytes + len > TX_DETACHED_MAX) { // Dropped, whoever needs it asks again
+		pthread_mutex_unlock(&sched->lock);
+		free(item);
+		return 0;
+	}
+	int ret = tx_sched_push(sched, item);
+	if (ret == 0) sched->detached_bytes += len;
+	pthread_mutex_unlock(&sched->lock);
+	if (ret < 0) free(item);
+	return ret < 0 ? -1 : count;
+}
+
+int tx_sched_start(tx_sched_t* sched, send_ctx_t* ctx) {
+	memset(sched->queues, 0, sizeof(sched->queues));
+	sched->detached_bytes = 0;
+	sched->ctx = ctx;
+	pthread_mutex_init(&sched->lock, NULL);
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC); // Rate control delays are on the monotonic clock
+	pthread_cond_init(&sched->wake, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_cond_init(&sched->done, NULL);
+
+	sched->running = 1;
+	if (pthread_create(&sched->thread, NULL, tx_sched_thread, sched) != 0) {
+		perror("pthread_create");
+		sched->running = 0;
+		pthread_cond_destroy(&sched->wake);
+		pthread_cond_destroy(&sched->done);
+		pthread_mutex_destroy(&sched->lock);
+		sched->ctx = NULL;
+		return -1;
+	}
+	ctx->sched = sched;
+	return 0;
+}
+
+void tx_sched_stop(tx_sched_t* sched) {
+	if (!sched->ctx) return;
+	pthread_mutex_lock(&sched->lock);
+	sched->running = 0;
+	pthread_cond_signal(&sched->wake);
+	pthread_mutex_unlock(&sched->lock);
+	pthread_join(sched->thread, NULL);
+
+	sched->ctx->sched = NULL;
+	sched->ctx = NULL;
+	pthread_cond_destroy(&sched->wake);
+	pthread_cond_destroy(&sched->done);
+	pthread_mutex_destroy(&sched->lock);
+}
+
+void tx_sched_stats(tx_sched_t* sched, tx_queue_t stats[TX_CLASSES]) {
+	if (!sched->ctx) {
+		memcpy(stats, sched->queues, sizeof(sched->queues));
 		return;
 	}
+	pthread_mutex_lock(&sched->lock);
+	memcpy(stats, sched->queues, sizeof(sched->queues));
+	pthread_mutex_unlock(&sched->lock);
+}
 
-	char buffer[header->size + sizeof(header_t)];
-	header_t* custom_header = (header_t*)buffer;
+// --- ### ---
 
-	memset(buffer, 0, sizeof(buffer));
+// Sends rounds messages of msg_size bytes with every send mode and prints the fragment rate of each.
+int udp_send_benchmark(const char* d_ip, uint16_t d_port, size_t msg_size, int rounds) {
+	send_ctx_t ctx;
+	if (send_ctx_open(&ctx, DEFAULT_MTU, NULL, 0, d_port) < 0) return -1;
 
-	memcpy(custom_header, header, sizeof(header_t));
+	char* msg = malloc(msg_size);
+	if (!msg) {
+		send_ctx_close(&ctx);
+		return -1;
+	}
+	memset(msg, 0xAB, msg_size);
 
-	// Actual message we are sending
-	char* pcktData = buffer + sizeof(header_t);
-	memcpy(pcktData, msg, header->size);
+	char ip[INET_ADDRSTRLEN];
+	strncpy(ip, d_ip, INET_ADDRSTRLEN - 1);
+	ip[INET_ADDRSTRLEN - 1] = '\0';
 
-	int payload_len = sizeof(header_t) + header->size;
+	const char* names[] = {"sendto", "sendmmsg", "io_uring", "gso"};
+	send_mode_e modes[] = {SEND_SINGLE, SEND_BATCH, SEND_BATCH, SEND_BATCH};
+	int urings[] = {0, 0, 1, 0};
+	enum cl_e flags[] = {0, 0, 0, CL_FILE};
+	char name[NAME_LEN] = "bench";
+	char uid[UID_LEN] = {0};
+	int has_gso = ctx.gso;
+	ctx.rate.rate = RATE_MAX; // Measures the send paths, not the rate control
+
+	for (int m = 0; m < 4; ++m) {
+		if (flags[m] & CL_FILE && !has_gso) {
+			printf("%-9s not supported on this kernel\n", names[m]);
+			continue;
+		}
+		ctx.mode = modes[m];
+		ctx.uring = urings[m];
+		atomic_store(&ctx.frags_sent, 0);
+		atomic_store(&ctx.send_calls, 0);
+
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (int r = 0; r < rounds; ++r) {
+			udp_send(&ctx, msg, msg_size, name, uid, N_CLIENT, r, 0, ip, d_port, flags[m], NULL);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+		unsigned long frags = atomic_load(&ctx.frags_sent);
+		printf("%-9s %8lu fragments %7lu syscalls %8.3f s %12.0f fragments/s\n", names[m], frags,
+			atomic_load(&ctx.send_calls), secs, frags / secs);
+	}
+
+	free(msg);
+	send_ctx_close(&ctx);
+	return 0;
+}
+
+// Forwards one received fragment. header is in host byte order as handed to the receive callback,
+// msg/size is the fragment payload. Nothing is copied, the header and payload go out as two iovecs.
+void udp_relay(send_ctx_t* ctx, const char* msg, size_t size, const header_t* header, char d_ip[INET_ADDRSTRLEN],
+	uint16_t d_port, enum cl_e flags) {
+
+	header_t custom_header;
+	memcpy(&custom_header, header, sizeof(header_t));
+	custom_header.size = htons(size);
+	custom_header.frag_size = htons(header->frag_size);
+
+	struct iovec iov[2];
+	iov[0].iov_base = &custom_header;
+	iov[0].iov_len = sizeof(header_t);
+	iov[1].iov_base = (char*)msg;
+	iov[1].iov_len = size;
 
 	struct sockaddr_in dest;
 	memset(&dest, 0, sizeof(dest));
@@ -339,11 +1927,66 @@ void udp_relay(
 	dest.sin_port = htons(d_port);
 	dest.sin_addr.s_addr = inet_addr(d_ip);
 
+	struct msghdr hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.msg_iov = iov;
+	hdr.msg_iovlen = 2;
+
+	int sockfd = send_ctx_peer_sock(ctx, d_ip, d_port, size);
+	if (sockfd < 0) {
+		sockfd = ctx->sock_bcast;
+		hdr.msg_name = &dest;
+		hdr.msg_namelen = sizeof(dest);
+	}
+
 	// Send UDP datagram
-	ssize_t sent = sendto(sockfd, buffer, payload_len, 0, (struct sockaddr*)&dest, sizeof(dest));
+	atomic_fetch_add(&ctx->send_calls, 1);
+	atomic_fetch_add(&ctx->frags_sent, 1);
+	ssize_t sent = sendmsg(sockfd, &hdr, 0);
 	if (sent < 0) {
-		perror("sendto");
+		perror("sendmsg");
 	}
+}
+
+// Forwards one received fragment to every gateway peer, header unchanged, see udp_relay. With the io_uring
+// engine the whole fan-out is one submission instead of a sendmsg per gateway. The fragment was cut for the
+// sender's path, towards a gateway with a smaller path MTU it goes out without DF.
+void udp_relay_peers(send_ctx_t* ctx, const char* msg, size_t size, const header_t* header) {
+	if (ctx->num_peers == 0) return;
+
+	header_t custom_header;
+	memcpy(&custom_header, header, sizeof(header_t));
+	custom_header.size = htons(size);
+	custom_header.frag_size = htons(header->frag_size);
+
+	struct iovec iov[2];
+	iov[0].iov_base = &custom_header;
+	iov[0].iov_len = sizeof(header_t);
+	iov[1].iov_base = (char*)msg;
+	iov[1].iov_len = size;
 
-	close(sockfd);
+	struct mmsghdr msgs[ctx->num_peers];
+	int fds[ctx->num_peers];
+	memset(msgs, 0, sizeof(msgs));
+	for (int i = 0; i < ctx->num_peers; ++i) {
+		msgs[i].msg_hdr.msg_iov = iov;
+		msgs[i].msg_hdr.msg_iovlen = 2;
+		fds[i] = ctx->peers[i].sockfd;
+		if (size > atomic_load(&ctx->peers[i].frag_size)) {
+			msgs[i].msg_hdr.msg_name = &ctx->peers[i].addr;
+			msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+			fds[i] = ctx->sock_bcast;
+		}
+	}
+
+	// Peers are independent, one unreachable gateway must not cancel the others
+	if (ctx->uring && uring_send_chain(ctx, -1, fds, msgs, ctx->num_peers, 0) >= 0) return;
+
+	for (int i = 0; i < ctx->num_peers; ++i) {
+		atomic_fetch_add(&ctx->send_calls, 1);
+		atomic_fetch_add(&ctx->frags_sent, 1);
+		if (sendmsg(fds[i], &msgs[i].msg_hdr, 0) < 0) {
+			perror("sendmsg");
+		}
+	}
 }
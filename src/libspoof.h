@@ -14,12 +14,24 @@ typedef enum {
 	N_GATEWAY,
 } node_e;
 
-#define MAX_FRAGMENT 1500// 48552 // 16184 // MAX len of our fragments
+// Fragment payload size is worked out per destination from the MTU, these are its bounds
+#define DEFAULT_MTU 1500
+#define MAX_MTU 9000 // Jumbo frames
+#define MIN_MTU 576 // Smallest datagram every IPv4 host must accept
+#define IP_UDP_OVERHEAD 28 // IPv4 header without options + UDP header
+#define MAX_FRAGMENT (MAX_MTU - IP_UDP_OVERHEAD - sizeof(header_t)) // MAX len of our fragments
+#define MIN_FRAGMENT (MIN_MTU - IP_UDP_OVERHEAD - sizeof(header_t))
 #define RECV_PORT 6969
+#define RECV_BATCH 64 // Datagrams pulled per recvmmsg call
+#define MAX_RECV_SHARDS 16 // Upper bound for SO_REUSEPORT receiver threads
+#define URING_ENTRIES 256 // Submission queue size of every io_uring
+#define URING_RECV_BUFS 256 // Provided receive buffers per shard, a power of two
+#define MAX_NODE_TIMERS 4
 
 #define NAME_LEN 32
 #define FILENAME_LEN 32
 #define UID_LEN 8
+#define KEY_FPR_LEN 16 // Public key fingerprint, the first bytes of a SHA-256 over its DER encoding
 
 /*
  *      gw1 <--------> gw2 <------> c1,c2    gw3 <------> c3,c4
@@ -38,6 +50,12 @@ enum cl_e {
 	CL_ENCRYPTED = 0x10, // Packet is encrypted
 	CL_FILE = 0x20, // This is a file and not a regular text message
     CL_PRIV = 0x40, // This is a private message
+	CL_AEAD = 0x80, // Fragments are sealed one by one, see key_frags
+	CL_NACK = 0x100, // Asks the sender of a packet for the fragments missing from it
+	CL_SENDER_KEY = 0x200, // Hands out, or asks for, the chain key a peer's group messages are sealed under
+	CL_GROUP = 0x400, // With CL_ENCRYPTED, sealed under the sender's chain key instead of a key wrapped per recipient
+	CL_CHACHA = 0x800, // Sealed with ChaCha20-Poly1305, not AES-256-GCM. On CL_CONNECTED/ALIVE/KEY: the sender asks for it
+	CL_KEY = 0x1000, // Asks a peer for its public key, or hands ours out, see key_message
 };
 
 typedef struct {
@@ -46,14 +64,182 @@ typedef struct {
 	char uid[UID_LEN]; // uid of the sender
 	char filename[FILENAME_LEN];
 	node_e node_type;
-	uint8_t cl_flags; // control bit. If set, indicates the message is a control message
+	uint16_t cl_flags; // control bit. If set, indicates the message is a control message
 	uint16_t id; // Packet ID
 	uint16_t frag_num; // Fragmentation number
 	uint16_t total_fragments; // Total number of fragments
+	uint16_t frag_size; // Payload size of every fragment but the last, fragment i starts at i * frag_size
 	uint8_t num_key; // How many encrypted AES keys in the payload
+	uint8_t key_frags; // CL_AEAD: fragments [0, key_frags) carry the key block, every later one is sealed on its own
+	uint8_t resend; // Retransmission round, 0 for the first copy. Each round gets past dedup and relays once more.
+	// FEC: every fec_data data fragments are followed by fec_parity parity fragments, see fec.h. Parity fragment j
+	// of block b is numbered total_fragments + b * fec_parity + j, so dedup and relaying treat it like any other.
+	uint8_t fec_data; // 0 if the packet carries no parity
+	uint8_t fec_parity;
+	uint16_t fec_block; // Fragment i is in block i / fec_data
+	uint8_t fec_index; // Position in the block, data fragments first, then parity
+	uint16_t last_size; // Size of the last data fragment, to rebuild it
+	uint32_t stamp; // Sender's CLOCK_MONOTONIC in millisecond when the fragment left, NACKs echo it for RTT samples
 } header_t;
 
-typedef void (*message_callback_t)(const header_t* header, const char* message, size_t message_len);
+// shard is the index of the receiver thread the callback runs on. All fragments of one packet
+// arrive on the same shard, so per-shard state needs no locking.
+typedef void (*message_callback_t)(int shard, const header_t* header, const char* message, size_t message_len);
+
+// Connected socket towards a single gateway from gw_ips.txt. It sets DF, datagrams bigger than the path MTU, like
+// relayed fragments cut for another path, go out through the broadcast socket instead.
+typedef struct {
+	char ip[INET_ADDRSTRLEN];
+	uint16_t port;
+	struct sockaddr_in addr;
+	int sockfd;
+	atomic_ushort frag_size; // From the path MTU towards this gateway, refreshed while others send
+} send_peer_t;
+
+#define SEND_BATCH_SIZE 32 // Default number of fragments per sendmmsg call
+#define SEND_BATCH_PACE 100 // in microsecond, sleep between two batches of anything but bulk sends
+#define GSO_MAX_SEGMENTS 64 // Kernel limit of UDP_SEGMENT segments per send
+#define GSO_MAX_BYTES 65507 // Largest IPv4 UDP payload a single GSO send may carry
+
+// --- Rate control ---
+// Bulk sends are paced by a token bucket whose rate follows AIMD on what receivers report. Without a report the
+// rate grows, doubling per interval until the first loss and by RATE_STEP after it. A loss report above
+// RATE_LOSS_TOLERANCE cuts it by RATE_DECREASE, once per interval as every receiver reports the same burst.
+// The interval is the smoothed RTT from the stamps NACKs echo, and no shorter than RATE_INTERVAL.
+
+#define RATE_INITIAL (4 * 1024 * 1024) // in byte per second
+#define RATE_MIN (64 * 1024)
+#define RATE_MAX (1250 * 1000 * 1000) // 10 Gbit/s
+#define RATE_STEP (512 * 1024) // Added per interval once past the first loss
+#define RATE_DECREASE 0.7 // At least, a report that missed more cuts down to what got through
+#define RATE_LOSS_TOLERANCE 0.01 // Fraction of a packet a report may miss before the rate is cut
+#define RATE_INTERVAL 200 // in millisecond, loss is reported every NACK_DELAY at best
+#define RATE_BURST 2 // in millisecond of sending at the current rate an idle sender may save up
+
+typedef struct {
+	pthread_mutex_t lock; // Bulk senders and the workers answering NACKs share the controller
+	double rate; // Byte per second
+	int slow_start; // Until the first loss
+	double loss; // Moving average of the fraction reports missed, decays over intervals without one
+	double srtt; // in millisecond, 0 until the first sample
+	uint64_t next_ns; // When the bytes charged so far are paid off
+	uint64_t interval_ns; // Start of the current interval
+	size_t interval_bytes; // Charged in the current interval
+	int interval_reports;
+	unsigned long cuts;
+	uint64_t cut_ns; // Time of the latest cut
+} rate_ctl_t;
+
+void rate_ctl_init(rate_ctl_t* ctl);
+uint64_t rate_ctl_delay(rate_ctl_t* ctl); // in nanosecond, until the bytes charged so far are paid off
+void rate_ctl_wait(rate_ctl_t* ctl);
+void rate_ctl_charge(rate_ctl_t* ctl, size_t bytes);
+// A receiver missed lost of the sent fragments of one of our packets. echo is the stamp of its NACK, 0 if none.
+void rate_ctl_report(rate_ctl_t* ctl, int sent, int lost, uint32_t echo);
+void rate_ctl_stats(rate_ctl_t* ctl, double* rate, double* loss, double* srtt, unsigned long* cuts);
+
+// --- ### ---
+
+typedef enum {
+	SEND_SINGLE, // One sendto per fragment
+	SEND_BATCH, // Up to batch_size fragments per sendmmsg
+} send_mode_e;
+
+// Sockets used by udp_send, udp_relay and udp_send_raw. Opened once on connect
+// and reused for every datagram instead of a socket() + close() per call.
+typedef struct {
+	int sock_bcast; // SO_BROADCAST UDP socket, used for the subnet and unknown destinations
+	int sock_raw; // IP_HDRINCL socket for spoofed sends, -1 if we lack the privileges
+	send_peer_t* peers;
+	int num_peers;
+	uint16_t frag_size; // From the interface MTU, used for the subnet and unknown destinations
+
+	send_mode_e mode;
+	int uring; // Batches and relay fan-out go through a per-thread io_uring, see RECV_URING
+	int gso; // UDP_SEGMENT is usable, CL_FILE sends go out as one large buffer per batch
+	// Preallocated batch, guarded by lock as udp_send runs on the GTK and timer threads
+	pthread_mutex_t lock;
+	int batch_size;
+	struct mmsghdr* msgs;
+	struct iovec* iovs; // Two per fragment: its header and the caller's payload
+	header_t* headers;
+	rate_ctl_t rate; // Paces multi-fragment CL_FILE sends to every destination together
+	struct tx_sched* sched; // udp_send_frags queues here while set, see tx_sched_start
+
+	atomic_ulong frags_sent;
+	atomic_ulong send_calls; // sendto/sendmmsg syscalls
+} send_ctx_t;
+
+// --- Transmit scheduler ---
+// Once started, every udp_send and udp_send_frags is queued by class and sent from one scheduler thread, the caller
+// waits until its packet is out. Classes are served in strict priority. Bulk packets go out one send batch at a time,
+// rounded to whole FEC blocks, so a heartbeat or chat message waits for one batch at most, and concurrent bulk
+// packets take turns. Pacing happens between those slices only: while the rate control holds bulk back, the
+// scheduler keeps serving the other classes.
+
+#define TX_DETACHED_MAX (16 * 1024 * 1024) // Bytes udp_queue_frags may hold in copies, more is dropped
+
+typedef enum {
+	TX_CONTROL, // Heartbeats, connects, NACKs
+	TX_INTERACTIVE, // Chat
+	TX_BULK, // Files
+	TX_CLASSES,
+} tx_class_e;
+
+typedef struct tx_item tx_item;
+
+typedef struct {
+	tx_item* head;
+	tx_item* tail;
+	int depth; // Packets queued or being sent
+	int max_depth;
+	unsigned long packets;
+	unsigned long fragments;
+	unsigned long dropped; // Still queued when the scheduler stopped
+	double wait_ms; // Summed over packets, from queueing to the first fragment leaving
+	double max_wait_ms;
+} tx_queue_t;
+
+typedef struct tx_sched {
+	send_ctx_t* ctx;
+	pthread_mutex_t lock;
+	pthread_cond_t wake; // Something was queued, or the scheduler is stopping
+	pthread_cond_t done; // A packet went out
+	tx_queue_t queues[TX_CLASSES];
+	size_t detached_bytes; // Held by packets from udp_queue_frags
+	pthread_t thread;
+	int running;
+} tx_sched_t;
+
+int tx_sched_start(tx_sched_t* sched, send_ctx_t* ctx);
+void tx_sched_stop(tx_sched_t* sched);
+// Copy of the class metrics, taken under the lock
+void tx_sched_stats(tx_sched_t* sched, tx_queue_t stats[TX_CLASSES]);
+const char* tx_class_name(tx_class_e cls);
+
+// --- ### ---
+
+typedef enum {
+	RECV_BLOCKING, // One epoll loop per shard: recvmmsg on readiness, timerfds for the node timers
+	RECV_URING, // One io_uring loop per shard: multishot recvmsg, wakeup and node timers on the same ring
+} recv_engine_e;
+
+// Periodic handler run on receiver shard 0 by either engine
+typedef struct {
+	unsigned int u_delay;
+	void* (*handler)(void*);
+	void* handler_arg;
+	int per_shard; // Runs on every shard instead, with its recv_shard_t as argument
+} node_timer_t;
+
+struct Node;
+
+typedef struct {
+	struct Node* node;
+	int index;
+	int sockfd;
+	pthread_t thread;
+} recv_shard_t;
 
 typedef struct Node {
 	char name[NAME_LEN];
@@ -61,12 +247,23 @@ typedef struct Node {
 	node_e type;
 	atomic_uint_fast16_t id;
 	int sock_listen;
-	pthread_t recv_thread;
+	int num_shards; // Receiver threads to start, more than one binds RECV_PORT with SO_REUSEPORT
+	recv_shard_t shards[MAX_RECV_SHARDS];
 	int recv_running;
+	recv_engine_e engine; // Asked for before start_udp_receiver, reset to RECV_BLOCKING if io_uring is unusable
+	int wake_fd; // eventfd every shard waits on to notice stop_udp_receiver
+	node_timer_t timers[MAX_NODE_TIMERS]; // Run on shard 0, or on every shard
+	int num_timers;
+	int rcvbuf; // SO_RCVBUF to ask for in bytes, 0 keeps the kernel default
+	atomic_ulong rx_packets;
+	atomic_ulong rx_dropped; // Datagrams the kernel dropped because our socket buffer was full
 	message_callback_t on_message; // function pointer for callback
+	send_ctx_t tx;
+	tx_sched_t sched;
 
 	EVP_PKEY* keypair;
 	char* pubkey_pem;
+	unsigned char fingerprint[KEY_FPR_LEN]; // What CL_ALIVE carries instead of pubkey_pem
 } node_t;
 
 // Functions
@@ -74,17 +271,48 @@ void generate_random_ip(char* ip_str);
 
 int get_host_ip_and_broadcast(char* host_ip, size_t host_len, char* broadcast_ip, size_t broad_len);
 
+int get_host_mtu(const char* host_ip);
+uint16_t frag_size_from_mtu(int mtu);
+
+int send_ctx_open(send_ctx_t* ctx, int if_mtu, char (*peer_ips)[INET_ADDRSTRLEN], int num_peers, uint16_t peer_port);
+void send_ctx_close(send_ctx_t* ctx);
+int send_ctx_set_batch(send_ctx_t* ctx, int batch_size);
+void send_ctx_refresh_pmtu(send_ctx_t* ctx);
+uint16_t send_ctx_frag_size(const send_ctx_t* ctx, const char d_ip[INET_ADDRSTRLEN], uint16_t d_port);
+
+int udp_send_benchmark(const char* d_ip, uint16_t d_port, size_t msg_size, int rounds);
+
 int start_udp_receiver(node_t* node, uint16_t listen_port, message_callback_t cb);
 int stop_udp_receiver(node_t* node);
+int node_add_timer(node_t* node, unsigned int u_delay, void* (*handler)(void*), void* handler_arg);
+int node_add_shard_timer(node_t* node, unsigned int u_delay, void* (*handler)(void*));
 
 // udp_send needs to know the senders name, and node_id of the sender.
-void udp_send_raw(const char* msg, size_t size, const char name[NAME_LEN], const char uid[UID_LEN], node_e n_type, uint16_t id,
-	uint8_t num_keys, char s_ip[INET_ADDRSTRLEN], char d_ip[INET_ADDRSTRLEN], uint16_t s_port, uint16_t d_port, enum cl_e flags,
-	const char filename[FILENAME_LEN]);
+void udp_send_raw(send_ctx_t* ctx, const char* msg, size_t size, const char name[NAME_LEN], const char uid[UID_LEN],
+	node_e n_type, uint16_t id, uint8_t num_keys, char s_ip[INET_ADDRSTRLEN], char d_ip[INET_ADDRSTRLEN], uint16_t s_port,
+	uint16_t d_port, enum cl_e flags, const char filename[FILENAME_LEN]);
 
-void udp_send(const char* msg, size_t size, const char name[NAME_LEN], const char uid[UID_LEN], node_e n_type, uint16_t id,
-	uint8_t num_keys, char d_ip[INET_ADDRSTRLEN], uint16_t d_port, enum cl_e flags, const char filename[FILENAME_LEN]);
+void udp_send(send_ctx_t* ctx, const char* msg, size_t size, const char name[NAME_LEN], const char uid[UID_LEN],
+	node_e n_type, uint16_t id, uint8_t num_keys, char d_ip[INET_ADDRSTRLEN], uint16_t d_port, enum cl_e flags,
+	const char filename[FILENAME_LEN]);
+// Sends fragments [first_frag, first_frag + count) of a size byte packet cut into tmpl->frag_size pieces. msg
+// points at byte first_frag * frag_size of the packet, so a packet can be sent piece by piece as it is produced.
+// tmpl carries every header field but size, frag_num and total_fragments, in host order. With tmpl->fec_data set,
+// every block lying entirely within the range is followed by its parity fragments. Goes through ctx->sched if set.
+// Returns the number of data fragments handed to the kernel.
+int udp_send_frags(send_ctx_t* ctx, const char* msg, size_t size, const header_t* tmpl, int first_frag, int count,
+	char d_ip[INET_ADDRSTRLEN], uint16_t d_port);
+// udp_send and udp_send_frags for threads that must not wait for the scheduler: the fragments are copied and queued,
+// and the call returns right away. Returns the data fragments queued, 0 if TX_DETACHED_MAX is used up. Without the
+// scheduler they are sent on the caller's thread like udp_send_frags does.
+void udp_queue(send_ctx_t* ctx, const char* msg, size_t size, const char name[NAME_LEN], const char uid[UID_LEN],
+	node_e n_type, uint16_t id, uint8_t num_keys, char d_ip[INET_ADDRSTRLEN], uint16_t d_port, enum cl_e flags,
+	const char filename[FILENAME_LEN]);
+int udp_queue_frags(send_ctx_t* ctx, const char* msg, size_t size, const header_t* tmpl, int first_frag, int count,
+	char d_ip[INET_ADDRSTRLEN], uint16_t d_port);
 
-void udp_relay(const char* msg, size_t size, const header_t* header, char d_ip[INET_ADDRSTRLEN], uint16_t d_port, enum cl_e flags);
+void udp_relay(send_ctx_t* ctx, const char* msg, size_t size, const header_t* header, char d_ip[INET_ADDRSTRLEN],
+	uint16_t d_port, enum cl_e flags);
+void udp_relay_peers(send_ctx_t* ctx, const char* msg, size_t size, const header_t* header);
 
 #endif
@@ -1,5 +1,6 @@
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <gtk/gtk.h>
 #include <openssl/aes.h>
 #include <openssl/crypto.h>
@@ -7,6 +8,7 @@
 #include <openssl/rand.h>
 #include <openssl/rsa.h>
 #include <pthread.h>
+#include <stdarg.h>
 #include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -14,10 +16,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "fec.h"
 #include "glib.h"
 #include "libspoof.h"
 #include "utils.h"
@@ -27,18 +32,29 @@ GtkWidget* text_view;
 GtkWidget* entry;
 GtkWidget* statusbar;
 guint context_id;
+guint transfer_context_id; // Progress of the file being sent
 GtkWidget* user_list;
 
 char nickname[NAME_LEN] = "Anonymous";
 gboolean connected = FALSE;
 char node_mode[16] = "Client";
+bool ephemeral_identity = false; // --ephemeral: a new keypair from the pool on every connect, see node_identity
+static char identity_file[PATH_MAX]; // Our keypair across runs, see identity_path
 
 int num_gw_ips = 0;
 char (*gateway_ips)[INET_ADDRSTRLEN];
 
+int file_sends; // File sender threads running, under file_sends_lock, disconnect waits for them on file_sends_done
+pthread_mutex_t file_sends_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t file_sends_done = PTHREAD_COND_INITIALIZER;
+atomic_bool file_sends_cancel;
+atomic_ulong nacks_sent, nacks_answered, nacks_ignored, frags_resent; // Printed on disconnect
+
 ll_clients known_clients;
+// Receiver shards, the prune timer and the GTK thread all touch known_clients
+pthread_mutex_t clients_lock = PTHREAD_MUTEX_INITIALIZER;
 node_t node;
-id_cache cache;
+dedup_table dedup[MAX_RECV_SHARDS]; // One per receiver shard, see message_callback_t
 
 char local_ip[INET_ADDRSTRLEN];
 char broadcast_ip[INET_ADDRSTRLEN];
@@ -51,19 +67,36 @@ char broadcast_ip[INET_ADDRSTRLEN];
 #define PRUNE_STALE_CLIENT_DELAY 120
 
 #define DEST_PORT 6969
+// Socket receive buffer, room for a few thousand fragments of a file transfer burst
+#define RECV_BUFFER_SIZE (8 * 1024 * 1024)
 
-// This function runs on the GTK main thread to update the chat window
+// This function runs on the GTK main thread to update the chat window, data is a line from chat_line
 gboolean show_incoming_message(gpointer data) {
 	const char* msg = (const char*)data;
+	if (!msg) return FALSE;
 	GtkTextBuffer* buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(text_view));
 	GtkTextIter end;
 	gtk_text_buffer_get_end_iter(buffer, &end);
 	gtk_text_buffer_insert(buffer, &end, msg, -1);
 	gtk_text_buffer_insert(buffer, &end, "\n", -1);
-	g_free(data);
+	buf_pool_put(data);
 	return FALSE; // only run once
 }
 
+// Formats a line for show_incoming_message into a buf_pool buffer, the workers print one per chat message
+static char* chat_line(const char* fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	int n = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	char* line = n >= 0 ? buf_pool_get(n + 1) : NULL;
+	if (!line) return NULL;
+	va_start(ap, fmt);
+	vsnprintf(line, n + 1, fmt, ap);
+	va_end(ap);
+	return line;
+}
+
 gboolean update_user_list(gpointer unused) {
 	GList *children, *iter;
 
@@ -74,6 +107,7 @@ gboolean update_user_list(gpointer unused) {
 	g_list_free(children);
 
 	// Now add the users
+	pthread_mutex_lock(&clients_lock);
 	struct client* curr = known_clients.head;
 	while (curr) {
 		GtkWidget* row = gtk_label_new(curr->name);
@@ -81,195 +115,809 @@ gboolean update_user_list(gpointer unused) {
 		gtk_list_box_insert(GTK_LIST_BOX(user_list), row, -1);
 		curr = curr->next;
 	}
+	pthread_mutex_unlock(&clients_lock);
 	gtk_widget_show_all(user_list);
 	return FALSE;
 }
 
+// Key block, see build_key_block:
 // [iv]
-// [name_len:uint8_t][name][uint16_t:uid][encrytpted_len:uint16_t][encrypted_key].
-// ...
-// [ciphertext_len:uint32_t][ciphertext].
-unsigned char* decrypt_incoming_message(const char* buffer, const int cipher_len, const char name[NAME_LEN],
-	const uint8_t numkeys, EVP_PKEY* keypair, int* plaintextlen) {
-	int pos = 0;
-	unsigned char aes_iv[AES_IVLEN];
-	memcpy(aes_iv, buffer, AES_IVLEN * sizeof(unsigned char));
-	pos += AES_IVLEN * sizeof(unsigned char);
-
-	unsigned char decrypted_key[AES_KEYLEN];
-	bool found = false;
-	for (int i = 0; i < numkeys; ++i) {
-		uint8_t name_len;
-		memcpy(&name_len, buffer + pos, sizeof(uint8_t));
-		pos += sizeof(uint8_t);
-
-		unsigned char* key_name = (unsigned char*)malloc((name_len + 1) * sizeof(unsigned char));
-		memcpy(key_name, buffer + pos, name_len * sizeof(unsigned char));
-		key_name[name_len] = '\0';
-		pos += sizeof(unsigned char) * name_len;
-
-		char uid[UID_LEN];
-		memcpy(uid, buffer + pos, UID_LEN);
-		pos += UID_LEN;
-
-		// Compare key_name and name
-		uint16_t encrypted_len;
-
-		memcpy(&encrypted_len, buffer + pos, sizeof(uint16_t));
-		pos += sizeof(uint16_t);
-
-		unsigned char* encrypted_key = (unsigned char*)malloc(encrypted_len * sizeof(unsigned char));
-		memcpy(encrypted_key, buffer + pos, encrypted_len * sizeof(unsigned char));
-		pos += encrypted_len * sizeof(unsigned char);
-		if (strcmp((const char*)key_name, name) == 0 && memcmp(node.uid, uid, UID_LEN) == 0) {
-			// This is our key, decrypt it
-			found = true;
-
-			int keylen = decrypt_key_with_rsa(keypair, encrypted_key, encrypted_len, decrypted_key);
-			if (keylen < 0) {
-				fprintf(stderr, "failed to decrypt the keypair!\n");
-				free(key_name);
-				free(encrypted_key);
-				return NULL;
-			}
+// [ciphertext_len:uint32_t][data_off:uint32_t]
+// [uid_hash:uint32_t][entry_off:uint32_t] * numkeys, sorted by uid_hash, see key_slot_hash
+// [name_len:uint8_t][name][char[UID_LEN]:uid][encrytpted_len:uint16_t][encrypted_key] * numkeys
+// [ciphertext], data_off and entry_off count from the iv
+// Receivers binary search the index for the hash of their uid and only read the entries it points them at.
+#define KEY_BLOCK_FIXED (AES_IVLEN + 2 * sizeof(uint32_t))
+#define KEY_SLOT_LEN (2 * sizeof(uint32_t))
+
+// FNV-1a, uids are random already
+static uint32_t key_slot_hash(const char uid[UID_LEN]) {
+	uint32_t h = 2166136261u;
+	for (int i = 0; i < UID_LEN; ++i)
+		h = (h ^ (unsigned char)uid[i]) * 16777619u;
+	return h;
+}
+
+// First index slot with hash, numkeys if none. -1 if the index runs past len.
+static int key_slot_find(const unsigned char* buffer, size_t len, uint8_t numkeys, uint32_t hash) {
+	if (len < KEY_BLOCK_FIXED + numkeys * KEY_SLOT_LEN) return -1;
+	int lo = 0, hi = numkeys;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		uint32_t h;
+		memcpy(&h, buffer + KEY_BLOCK_FIXED + mid * KEY_SLOT_LEN, sizeof(h));
+		if (h < hash) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
 		}
-		free(encrypted_key);
-		free(key_name);
 	}
+	return lo;
+}
 
-	if (!found) return NULL;
+// Whether the entry of slot, which has our hash, is really for name/uid. Returns 1 with the wrapped key, 0 if it is
+// someone else's or points outside the key block, -1 if it runs past len.
+static int key_slot_match(const unsigned char* buffer, size_t len, int slot, const char name[NAME_LEN],
+	const char uid[UID_LEN], const unsigned char** wrapped, uint16_t* wrapped_len) {
+	uint32_t data_off, off;
+	memcpy(&data_off, buffer + AES_IVLEN + sizeof(uint32_t), sizeof(data_off));
+	memcpy(&off, buffer + KEY_BLOCK_FIXED + slot * KEY_SLOT_LEN + sizeof(uint32_t), sizeof(off));
+	if (off >= data_off) return 0;
+	if (off + sizeof(uint8_t) > len) return -1;
+	uint8_t name_len = buffer[off];
+	size_t pos = off + sizeof(uint8_t);
+	if (pos + name_len + UID_LEN + sizeof(uint16_t) > len) return -1;
+	if (name_len != strnlen(name, NAME_LEN) || memcmp(buffer + pos, name, name_len)
+		|| memcmp(buffer + pos + name_len, uid, UID_LEN)) {
+		return 0;
+	}
+	pos += name_len + UID_LEN;
+	memcpy(wrapped_len, buffer + pos, sizeof(uint16_t));
+	pos += sizeof(uint16_t);
+	if (pos + *wrapped_len > data_off) return 0;
+	if (pos + *wrapped_len > len) return -1;
+	*wrapped = buffer + pos;
+	return 1;
+}
 
-	// Now we are at the ciphertext part
+// Finds the key wrapped for name/our uid in the first len bytes of an encrypted payload. Returns 1 with the AES
+// key, the iv and where the ciphertext starts, 0 if there is no key for us, -1 if the key block runs past len.
+static int parse_key_block(const unsigned char* buffer, size_t len, const char name[NAME_LEN], uint8_t numkeys,
+	EVP_PKEY* keypair, unsigned char key[AES_KEYLEN], unsigned char iv[AES_IVLEN], size_t* data_off,
+	uint32_t* ciphertext_len) {
+	if (len < KEY_BLOCK_FIXED) return -1;
+	uint32_t off;
+	memcpy(iv, buffer, AES_IVLEN);
+	memcpy(ciphertext_len, buffer + AES_IVLEN, sizeof(uint32_t));
+	memcpy(&off, buffer + AES_IVLEN + sizeof(uint32_t), sizeof(off));
+	if (off > len) return -1;
+	if (off < KEY_BLOCK_FIXED + numkeys * KEY_SLOT_LEN) return 0;
+	*data_off = off;
+
+	uint32_t hash = key_slot_hash(node.uid);
+	for (int slot = key_slot_find(buffer, len, numkeys, hash); slot < numkeys; ++slot) {
+		uint32_t h;
+		memcpy(&h, buffer + KEY_BLOCK_FIXED + slot * KEY_SLOT_LEN, sizeof(h));
+		if (h != hash) break;
+		const unsigned char* wrapped;
+		uint16_t wrapped_len;
+		if (key_slot_match(buffer, len, slot, name, node.uid, &wrapped, &wrapped_len) != 1) continue;
+		// This is our key, decrypt it
+		if (decrypt_key_with_rsa(keypair, wrapped, wrapped_len, key) < 0) {
+			fprintf(stderr, "failed to decrypt the keypair!\n");
+			return 0;
+		}
+		return 1;
+	}
+	return 0;
+}
+
+// Decrypts the ciphertext after the key block in place. Returns the plaintext length with plaintext pointing into
+// buffer, -1 if there is no key for us or the ciphertext doesn't decrypt.
+static int decrypt_incoming_message(unsigned char* buffer, size_t len, const char name[NAME_LEN], uint8_t numkeys,
+	EVP_PKEY* keypair, unsigned char** plaintext) {
+	unsigned char key[AES_KEYLEN];
+	unsigned char iv[AES_IVLEN];
+	size_t pos;
 	uint32_t ciphertext_len;
-	memcpy(&ciphertext_len, buffer + pos, sizeof(uint32_t));
-	pos += sizeof(uint32_t);
+	if (parse_key_block(buffer, len, name, numkeys, keypair, key, iv, &pos, &ciphertext_len) <= 0) return -1;
+	if (pos + ciphertext_len > len) {
+		OPENSSL_cleanse(key, sizeof(key));
+		return -1;
+	}
 
-	unsigned char* ciphertext = malloc(ciphertext_len * sizeof(unsigned char));
-	memcpy(ciphertext, buffer + pos, ciphertext_len * sizeof(unsigned char));
-	pos += ciphertext_len * sizeof(unsigned char);
+	*plaintext = buffer + pos;
+	int plaintext_len = decrypt_aes(buffer + pos, ciphertext_len, key, iv, buffer + pos);
+	OPENSSL_cleanse(key, sizeof(key));
+	return plaintext_len;
+}
 
-	unsigned char* plaintext = malloc(ciphertext_len * sizeof(unsigned char));
-	*plaintextlen = decrypt_aes(ciphertext, ciphertext_len, decrypted_key, aes_iv, plaintext);
+// Files are written to the working directory under the sender's base name, never a path from the network.
+// Returns false if nothing usable is left.
+static bool safe_filename(const char filename[FILENAME_LEN], char out[FILENAME_LEN + 1]) {
+	char name[FILENAME_LEN + 1];
+	memcpy(name, filename, FILENAME_LEN);
+	name[FILENAME_LEN] = '\0';
+	const char* base = strrchr(name, '/');
+	base = base ? base + 1 : name;
+	if (!*base || !strcmp(base, ".") || !strcmp(base, "..")) return false;
+	strcpy(out, base);
+	return true;
+}
 
-	free(ciphertext);
+// Whether the key block at the start of payload has a key for name/uid, see parse_key_block. Only the index and the
+// entries with the hash of uid are read. A key block longer than len can't rule us out, that counts as ours.
+bool is_receiver_from_payload(
+	const char* payload, size_t len, uint8_t numkeys, const char name[NAME_LEN], const char uid[UID_LEN]) {
+	const unsigned char* buffer = (const unsigned char*)payload;
+	uint32_t hash = key_slot_hash(uid);
+	int slot = key_slot_find(buffer, len, numkeys, hash);
+	if (slot < 0) return true;
+	for (; slot < numkeys; ++slot) {
+		uint32_t h;
+		memcpy(&h, buffer + KEY_BLOCK_FIXED + slot * KEY_SLOT_LEN, sizeof(h));
+		if (h != hash) break;
+		const unsigned char* wrapped;
+		uint16_t wrapped_len;
+		if (key_slot_match(buffer, len, slot, name, uid, &wrapped, &wrapped_len) != 0) return true;
+	}
+	return false;
+}
 
-	return plaintext;
+reasm_table reasm[MAX_RECV_SHARDS]; // One per receiver shard, like dedup
+fec_table fec[MAX_RECV_SHARDS];
+int fec_data = 0; // --fec N:K, data and parity fragments per block of what we send, 0 sends no parity
+int fec_parity = 0;
+
+// Work handed from the receiver shards to the worker pool
+#define RX_RELAY 0x1 // Forward data as a single fragment
+#define RX_DELIVER 0x2 // data is a complete message for us
+#define RX_STREAM 0x4 // Catch up decrypting stream, a file being written to disk
+#define RX_KEYS 0x8 // data is the key block of sealed stream
+#define RX_SEALED 0x10 // data is one sealed fragment of stream
+#define RX_NACK 0x20 // data is a NACK for one of our packets
+
+typedef struct {
+	header_t header;
+	int kind;
+	size_t len;
+	unsigned char* data; // Owned by the job, from buf_pool_get
+	file_stream* stream; // The job holds a reference
+} rx_job;
+
+work_pool rx_pool;
+int rx_workers = 0; // 0 picks one per online CPU, see --workers
+recv_engine_e recv_engine = RECV_BLOCKING; // --engine uring|blocking
+// Room for a few file transfer bursts of fragments before the receivers start doing the work themselves
+#define RX_QUEUE_SIZE 4096
+
+// Finished jobs are kept for the next packets, a miss allocates a new one
+static mpmc_ring rx_job_ring;
+
+static rx_job* rx_job_get(void) {
+	rx_job* job = rx_job_ring.cells ? mpmc_pop(&rx_job_ring) : NULL;
+	return job ? job : malloc(sizeof(rx_job));
 }
 
-// [iv] 16 byte
-// [name_len:uint8_t][name][uint16_t:uid][encrytpted_len:uint16_t][encrypted_key].
-// ...
-// [ciphertext_len:uint32_t][ciphertext].
-bool is_receiver_from_payload(const char* payload, const char name[NAME_LEN], const char uid[UID_LEN]) {
+static void rx_job_put(rx_job* job) {
+	if (!rx_job_ring.cells || mpmc_push(&rx_job_ring, job) < 0) free(job);
+}
 
-	int pos = AES_IVLEN; // Skip the iv
-	uint8_t name_len;
-	memcpy(&name_len, payload + pos, sizeof(uint8_t));
-	pos += sizeof(uint8_t);
+static void submit_rx_job(const header_t* header, int kind, unsigned char* data, size_t len) {
+	rx_job* job = rx_job_get();
+	if (!job) {
+		buf_pool_put(data);
+		return;
+	}
+	job->header = *header;
+	job->kind = kind;
+	job->data = data;
+	job->len = len;
+	job->stream = NULL;
+	// A sender's messages are shown in the order they came in, see work_pool_submit
+	work_pool_submit(&rx_pool, key_slot_hash(header->uid), job);
+}
 
-	char recv_name[NAME_LEN];
-	memcpy(recv_name, payload + pos, name_len * sizeof(char));
-	pos += name_len * sizeof(char);
+// Checks a NACK payload and copies it out, bits past nbits are left clear
+static bool parse_nack(const char* message, size_t message_len, nack_t* nack) {
+	if (message_len < NACK_HEADER_LEN) return false;
+	memset(nack, 0, sizeof(nack_t));
+	memcpy(nack, message, message_len < sizeof(nack_t) ? message_len : sizeof(nack_t));
+	return nack->nbits <= NACK_MAX_BITS && message_len >= NACK_HEADER_LEN + (nack->nbits + 7) / 8;
+}
 
-	char recv_uid[UID_LEN];
-	memcpy(recv_uid, payload + pos, UID_LEN * sizeof(char));
+static void answer_nack(const nack_t* nack);
 
-	if (!strcmp(recv_name, name) && !memcmp(recv_uid, uid, UID_LEN * sizeof(char))) {
-		return true;
+// The job takes over the stream reference and data, if any
+static void submit_stream_job(const header_t* header, int kind, file_stream* stream, unsigned char* data, size_t len) {
+	rx_job* job = rx_job_get();
+	if (!job) {
+		if (kind == RX_SEALED) atomic_fetch_sub(&stream->pending_bytes, len);
+		buf_pool_put(data);
+		file_stream_put(stream);
+		return;
 	}
-	return false;
+	job->header = *header;
+	job->kind = kind;
+	job->data = data;
+	job->len = len;
+	job->stream = stream;
+	// Sealed fragments can be opened in any order and spread over the workers, the rest keeps the sender's order
+	uint32_t key = key_slot_hash(header->uid);
+	work_pool_submit(&rx_pool, kind == RX_SEALED ? key + header->frag_num : key, job);
 }
 
-fragments fragments_cache;
+// Takes one data fragment we are a receiver of through reassembly, whether it came in or was rebuilt from parity
+static void accept_fragment(int shard, const header_t* header, const char* message, size_t message_len) {
+	if (header->total_fragments == 1) {
+		unsigned char* copy = buf_pool_get(message_len);
+		if (!copy) return;
+		memcpy(copy, message, message_len);
+		submit_rx_job(header, RX_DELIVER, copy, message_len);
+		return;
+	}
 
-// GTK thread-safe message post
-void gui_message_callback(const header_t* header, const char* message, size_t message_len) {
+	// A file whose key block has no key for us leaves nothing on disk, its other fragments are ignored from now on
+	if (header->cl_flags & CL_FILE && header->cl_flags & CL_ENCRYPTED && header->frag_num == 0
+		&& !is_receiver_from_payload(message, message_len, header->num_key, node.name, node.uid)) {
+		reasm_drop(&reasm[shard], header->uid, header->id, time(NULL));
+		return;
+	}
+
+	// Sealed files: once the key block is in, every fragment is opened by whichever worker picks it up
+	if (header->cl_flags & CL_FILE && header->cl_flags & CL_AEAD) {
+		char path[FILENAME_LEN + 1];
+		file_stream* stream;
+		unsigned char* key_block;
+		if (!safe_filename(header->filename, path)) return;
+		if (reasm_add_sealed(&reasm[shard], header->uid, header->id, header->frag_num, header->total_fragments,
+				header->frag_size, header->key_frags, (const unsigned char*)message, message_len, time(NULL),
+				header->stamp, path, &stream, &key_block)
+			<= 0)
+			return;
+
+		if (key_block) {
+			submit_stream_job(header, RX_KEYS, stream, key_block, (size_t)header->key_frags * header->frag_size);
+		} else if (header->frag_num >= header->key_frags) {
+			unsigned char* copy = buf_pool_get(message_len);
+			if (copy) memcpy(copy, message, message_len);
+			if (!copy) atomic_store(&stream->aborted, true); // This fragment is gone for good
+			submit_stream_job(header, RX_SEALED, stream, copy, message_len);
+		} else {
+			file_stream_put(stream);
+		}
+		return;
+	}
+
+	// Files encrypted as one CBC blob go to disk fragment by fragment and are decrypted in place once the
+	// prefix is contiguous, memory doesn't grow with their size
+	if (header->cl_flags & CL_FILE && header->cl_flags & CL_ENCRYPTED) {
+		char path[FILENAME_LEN + 1];
+		file_stream* stream;
+		if (!safe_filename(header->filename, path)) return;
+		reasm_add_stream(&reasm[shard], header->uid, header->id, header->frag_num, header->total_fragments,
+			header->frag_size, (const unsigned char*)message, message_len, time(NULL), header->stamp, path, &stream);
+		if (stream) submit_stream_job(header, RX_STREAM, stream, NULL, 0);
+		return;
+	}
+
+	unsigned char* packet;
+	size_t packet_len;
+	if (reasm_add(&reasm[shard], header->uid, header->id, header->frag_num, header->total_fragments,
+			header->frag_size, (const unsigned char*)message, message_len, time(NULL), header->stamp, &packet,
+			&packet_len)
+		== 1) {
+		submit_rx_job(header, RX_DELIVER, packet, packet_len);
+	}
+}
+
+// Runs on the receiver shard threads, only dedups and reassembles, everything slow goes to the workers
+void gui_message_callback(int shard, const header_t* header, const char* message, size_t message_len) {
 
 	// Drop any packet that orignated from us
 	if (!strcmp(header->name, node.name) && !memcmp(header->uid, node.uid, UID_LEN)) {
 		return;
 	}
 
-	// Combine the id and frag_num in cache
-	if (cache_search(&cache, ((uint32_t)header->id << 16) | header->frag_num)) {
+	// Every gateway relays every fragment, keep only the first copy of each resend round
+	if (dedup_check(&dedup[shard], header->uid, header->id, header->frag_num, header->resend, time(NULL))) {
 		return;
 	}
-	cache_add(&cache, ((uint32_t)header->id << 16) | header->frag_num);
-
-	const char* payload;
 
-    // If we are not the receiver node of a private message, just relay it
-	if (header->cl_flags & CL_PRIV && !is_receiver_from_payload(message, node.name, node.uid)) {
-        printf("    relaying a private message\n");
-		payload = message;
-		goto relay;
+	// The receive buffer is reused by the next recvmmsg, jobs get their own copy
+	bool relay = node.type == N_GATEWAY;
+	// Only the first fragment carries the key block
+	bool deliver = !(header->cl_flags & CL_PRIV) || header->frag_num != 0
+		|| is_receiver_from_payload(message, message_len, header->num_key, node.name, node.uid);
+
+	if (header->cl_flags & CL_NACK) {
+		nack_t nack;
+		if (!parse_nack(message, message_len, &nack)) return;
+		bool ours = !memcmp(nack.uid, node.uid, UID_LEN);
+		// Someone else lacks the same packet, the resend they get reaches us as well
+		if (!ours) reasm_overheard_nack(&reasm[shard], nack.uid, nack.id, monotonic_ms());
+		if (!relay && !ours) return;
+		unsigned char* copy = buf_pool_get(message_len);
+		if (!copy) return;
+		memcpy(copy, message, message_len);
+		submit_rx_job(header, (relay ? RX_RELAY : 0) | (ours ? RX_NACK : 0), copy, message_len);
+		return;
 	}
 
-	if (header->total_fragments > 1) {
-		fragment* frag = new_fragment(
-			&fragments_cache, (unsigned char*)message, header->id, header->frag_num, header->total_fragments, header->size);
-		if (frag) {
-			payload = (char*)frag->head;
-			message_len = frag->size;
-			printf("Assembled all the fragments\n");
-		} else {
+	if (header->total_fragments > 1 || header->fec_data) {
+		// Relay every fragment as it arrives, parity included, reassembly only matters for our own use of the message
+		if (relay) {
+			unsigned char* copy = buf_pool_get(message_len);
+			if (copy) {
+				memcpy(copy, message, message_len);
+				submit_rx_job(header, RX_RELAY, copy, message_len);
+			}
+		}
+		// If we are not the receiver node of a private message, it has already been relayed
+		if (!deliver) return;
+		if (!header->fec_data) {
+			accept_fragment(shard, header, message, message_len);
 			return;
 		}
+
+		// FEC: every fragment is kept with its block until the block is whole or what it lacks can be rebuilt
+		sealed_frag* rebuilt = fec_add(&fec[shard], header, (const unsigned char*)message, message_len, time(NULL));
+		if (header->fec_index < header->fec_data) accept_fragment(shard, header, message, message_len);
+		while (rebuilt) {
+			sealed_frag* next = rebuilt->next;
+			// Counts as seen, the original showing up late is a duplicate
+			if (!dedup_check(&dedup[shard], rebuilt->header.uid, rebuilt->header.id, rebuilt->header.frag_num,
+					rebuilt->header.resend, time(NULL))) {
+				accept_fragment(shard, &rebuilt->header, (const char*)rebuilt->data, rebuilt->len);
+			}
+			buf_pool_put(rebuilt->data);
+			free(rebuilt);
+			rebuilt = next;
+		}
+	} else if (relay || deliver) {
+		unsigned char* copy = buf_pool_get(message_len);
+		if (!copy) return;
+		memcpy(copy, message, message_len);
+		submit_rx_job(header, (relay ? RX_RELAY : 0) | (deliver ? RX_DELIVER : 0), copy, message_len);
+	}
+}
+
+static void relay_fragment(const header_t* header, const unsigned char* data, size_t len) {
+	if (header->node_type == N_GATEWAY && header->cl_flags & CL_RELAYED) { // Only broadcast to subnet if coming from relay
+		udp_relay(&node.tx, (const char*)data, len, header, broadcast_ip, DEST_PORT, header->cl_flags ^ CL_RELAYED);
+	}
+	udp_relay_peers(&node.tx, (const char*)data, len, header);
+}
+
+// --- Sender keys ---
+// Chat messages go to everyone, so each node seals them under a chain key of its own that its peers already hold
+// instead of wrapping a fresh key for every recipient per message. The chain key is handed out RSA wrapped once per
+// peer and epoch: to a peer when we learn of it, and to everyone when a new epoch starts. A new epoch starts with the
+// first message after someone left, so they can't read what follows, and every SENDER_KEY_MESSAGES messages. A peer
+// that joins once something was sealed under the current epoch gets a new one right away, handed to everyone, so it
+// can't read what came before it.
+//
+// CL_SENDER_KEY: [kind:uint8_t][epoch:uint32_t][owner:char[UID_LEN]], a SENDER_KEY_OFFER goes on with a key block,
+// see build_key_block, wrapping the owner's chain key. A SENDER_KEY_REQUEST asks the owner for theirs.
+// CL_ENCRYPTED | CL_GROUP: [epoch:uint32_t][counter:uint32_t][ciphertext][tag], see sender_key_derive
+//
+// Group messages and sealed files use AES-256-GCM, or ChaCha20-Poly1305 with CL_CHACHA once anyone in the group
+// lacks AES instructions. Nodes say so with CL_CHACHA on CL_CONNECTED and CL_ALIVE.
+
+#define SENDER_KEY_MESSAGES 10000 // Messages sealed under one epoch
+#define SENDER_KEY_RETRY 2 // in second, between requests for the key of a peer, and between answers to a peer
+#define SENDER_KEY_PARKED 16 // Group messages held until the key of their sender arrives
+#define SENDER_KEY_PARK_TIMEOUT 10 // in second
+#define SENDER_KEY_HDR (sizeof(uint8_t) + sizeof(uint32_t) + UID_LEN)
+#define GROUP_HDR (2 * sizeof(uint32_t))
+
+enum { SENDER_KEY_OFFER, SENDER_KEY_REQUEST };
+
+// Our own chain key
+static struct {
+	pthread_mutex_t lock;
+	uint32_t epoch;
+	unsigned char chain[AES_KEYLEN];
+	uint32_t counter; // Last message counter used
+	bool stale; // Someone left or joined, the epoch isn't handed out any more
+} my_key = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+typedef struct {
+	header_t header;
+	unsigned char* data; // NULL for a free slot
+	size_t len;
+	time_t parked;
+} parked_msg;
+
+// Group messages that arrived ahead of the key of their sender
+static parked_msg parked[SENDER_KEY_PARKED];
+static pthread_mutex_t parked_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void sender_key_send(const char uid[UID_LEN]);
+static void sender_key_request(const char owner[UID_LEN], uint32_t epoch);
+
+// CL_CHACHA if we ask for ChaCha20-Poly1305 on CL_CONNECTED and CL_ALIVE
+static enum cl_e suite_flag(void) { return aead_local_suite() == AEAD_CHACHA20_POLY1305 ? CL_CHACHA : 0; }
+
+// What we seal with now, ChaCha20-Poly1305 if we or any peer lack AES instructions
+static aead_suite_e group_suite(void) {
+	if (aead_local_suite() == AEAD_CHACHA20_POLY1305) return AEAD_CHACHA20_POLY1305;
+	aead_suite_e suite = AEAD_AES_GCM;
+	pthread_mutex_lock(&clients_lock);
+	for (client* c = known_clients.head; c; c = c->next) {
+		if (c->chacha) suite = AEAD_CHACHA20_POLY1305;
+	}
+	pthread_mutex_unlock(&clients_lock);
+	return suite;
+}
+
+static aead_suite_e header_suite(const header_t* header) {
+	return header->cl_flags & CL_CHACHA ? AEAD_CHACHA20_POLY1305 : AEAD_AES_GCM;
+}
+
+// Starts a new epoch under a fresh chain key, my_key.lock held
+static bool sender_key_new(void) {
+	if (!RAND_bytes(my_key.chain, AES_KEYLEN)) {
+		fprintf(stderr, "Failed to generate a sender key\n");
+		return false;
+	}
+	my_key.epoch++;
+	my_key.counter = 0;
+	my_key.stale = false;
+	return true;
+}
+
+// Peers that left must not read what we send next
+static void sender_key_retire(void) {
+	pthread_mutex_lock(&my_key.lock);
+	my_key.stale = true;
+	pthread_mutex_unlock(&my_key.lock);
+}
+
+// A peer we just learnt of must not read what we sent before, it gets the current epoch only if that is still unused
+static void sender_key_join(const char uid[UID_LEN]) {
+	pthread_mutex_lock(&my_key.lock);
+	if (my_key.counter) my_key.stale = true;
+	pthread_mutex_unlock(&my_key.lock);
+	sender_key_send(uid);
+}
+
+// Keeps the chain key a peer handed us next to the one before it. Returns false if we already have it, or don't know
+// the peer.
+static bool sender_key_store(const header_t* header, uint32_t epoch, const unsigned char chain[AES_KEYLEN]) {
+	bool stored = false;
+	pthread_mutex_lock(&clients_lock);
+	client* c = find_client(&known_clients, header->name, header->uid);
+	if (c && !(c->keys[0].valid && c->keys[0].epoch == epoch) && !(c->keys[1].valid && c->keys[1].epoch == epoch)) {
+		sender_key* sk = &c->keys[1];
+		if (!c->keys[0].valid || epoch > c->keys[0].epoch) {
+			c->keys[1] = c->keys[0];
+			sk = &c->keys[0];
+		}
+		// An offer of an epoch older than both is late, drop it
+		if (sk == &c->keys[0] || !sk->valid || epoch > sk->epoch) {
+			*sk = (sender_key){.valid = true, .epoch = epoch};
+			memcpy(sk->chain, chain, AES_KEYLEN);
+			stored = true;
+		}
+	}
+	pthread_mutex_unlock(&clients_lock);
+	return stored;
+}
+
+// Holds a group message until the key of its sender arrives, the oldest one makes room
+static void sender_key_park(const header_t* header, const unsigned char* payload, size_t len) {
+	unsigned char* copy = malloc(len);
+	if (!copy) return;
+	memcpy(copy, payload, len);
+	pthread_mutex_lock(&parked_lock);
+	int slot = 0;
+	for (int i = 0; i < SENDER_KEY_PARKED; ++i) {
+		if (!parked[i].data) {
+			slot = i;
+			break;
+		}
+		if (parked[i].parked < parked[slot].parked) slot = i;
+	}
+	free(parked[slot].data);
+	parked[slot] = (parked_msg){.header = *header, .data = copy, .len = len, .parked = time(NULL)};
+	pthread_mutex_unlock(&parked_lock);
+}
+
+static void sender_key_unpark_all(void) {
+	pthread_mutex_lock(&parked_lock);
+	for (int i = 0; i < SENDER_KEY_PARKED; ++i) {
+		free(parked[i].data);
+		parked[i].data = NULL;
+	}
+	pthread_mutex_unlock(&parked_lock);
+}
+
+// Opens a group message in place and shows it. Parks it and asks the sender for their key if we lack it.
+static void group_message(const header_t* header, unsigned char* payload, size_t len) {
+	if (len < GROUP_HDR + AEAD_TAGLEN) return;
+	uint32_t fields[2];
+	memcpy(fields, payload, sizeof(fields));
+	uint32_t epoch = ntohl(fields[0]), counter = ntohl(fields[1]);
+	size_t plain_len = len - GROUP_HDR - AEAD_TAGLEN;
+	unsigned char* plain = payload + GROUP_HDR;
+	unsigned char aad[SENDER_KEY_AADLEN];
+	memcpy(aad, header->uid, UID_LEN);
+	memcpy(aad + UID_LEN, payload, GROUP_HDR);
+
+	time_t now = time(NULL);
+	bool sealed = false, fresh = false, missing = false, request = false;
+	pthread_mutex_lock(&clients_lock);
+	client* c = find_client(&known_clients, header->name, header->uid);
+	sender_key* sk = NULL;
+	for (int i = 0; c && i < 2; ++i) {
+		if (c->keys[i].valid && c->keys[i].epoch == epoch) sk = &c->keys[i];
+	}
+	if (sk) {
+		unsigned char key[AES_KEYLEN], nonce[AEAD_NONCELEN];
+		sealed = sender_key_derive(sk->chain, epoch, counter, key, nonce) == 0
+			&& aead_open(header_suite(header), key, nonce, aad, sizeof(aad), plain, len - GROUP_HDR, plain) >= 0;
+		// Only an authentic counter may move the replay window
+		fresh = sealed && sender_key_accept(sk, counter);
+		OPENSSL_cleanse(key, sizeof(key));
 	} else {
-		payload = message;
+		missing = true;
+		if (c && now - c->key_requested >= SENDER_KEY_RETRY) {
+			c->key_requested = now;
+			request = true;
+		}
+	}
+	pthread_mutex_unlock(&clients_lock);
+
+	if (fresh) {
+		g_idle_add(show_incoming_message, chat_line("%s: %.*s", header->name, (int)plain_len, plain));
+	} else if (missing) {
+		sender_key_park(header, payload, len);
+		if (request) sender_key_request(header->uid, epoch);
+	} else if (!sealed) {
+		fprintf(stderr, "Failed to decrypt!\n");
+	} // else a replay
+	if (sealed) OPENSSL_cleanse(plain, plain_len);
+}
+
+// Opens what was parked for the sender with uid, and drops what waited too long
+static void sender_key_unpark(const char uid[UID_LEN]) {
+	parked_msg ready[SENDER_KEY_PARKED];
+	int n = 0;
+	time_t now = time(NULL);
+	pthread_mutex_lock(&parked_lock);
+	for (int i = 0; i < SENDER_KEY_PARKED; ++i) {
+		if (!parked[i].data) continue;
+		if (now - parked[i].parked > SENDER_KEY_PARK_TIMEOUT) {
+			free(parked[i].data);
+			parked[i].data = NULL;
+		} else if (!memcmp(parked[i].header.uid, uid, UID_LEN)) {
+			ready[n++] = parked[i];
+			parked[i].data = NULL;
+		}
+	}
+	pthread_mutex_unlock(&parked_lock);
+	for (int i = 0; i < n; ++i) {
+		group_message(&ready[i].header, ready[i].data, ready[i].len);
+		free(ready[i].data);
+	}
+}
+
+// CL_SENDER_KEY from a peer
+static void sender_key_message(const header_t* header, const unsigned char* payload, size_t len) {
+	if (len < SENDER_KEY_HDR) return;
+	uint8_t kind = payload[0];
+	uint32_t epoch;
+	memcpy(&epoch, payload + sizeof(uint8_t), sizeof(epoch));
+	epoch = ntohl(epoch);
+	const unsigned char* owner = payload + sizeof(uint8_t) + sizeof(uint32_t);
+
+	if (kind == SENDER_KEY_REQUEST) {
+		if (memcmp(owner, node.uid, UID_LEN)) return; // Someone else's key
+		// Everyone missing our key asks at once after a rekey, the answer to one of them is wrapped for that one only
+		time_t now = time(NULL);
+		bool answer = false;
+		pthread_mutex_lock(&clients_lock);
+		client* c = find_client(&known_clients, header->name, header->uid);
+		if (c && now - c->key_answered >= SENDER_KEY_RETRY) {
+			c->key_answered = now;
+			answer = true;
+		}
+		pthread_mutex_unlock(&clients_lock);
+		if (answer) sender_key_send(header->uid);
+		return;
+	}
+	if (kind != SENDER_KEY_OFFER || memcmp(owner, header->uid, UID_LEN)) return;
+
+	unsigned char chain[AES_KEYLEN];
+	unsigned char iv[AES_IVLEN];
+	size_t data_off;
+	uint32_t unused;
+	if (parse_key_block(payload + SENDER_KEY_HDR, len - SENDER_KEY_HDR, node.name, header->num_key, node.keypair, chain,
+			iv, &data_off, &unused)
+			== 1
+		&& sender_key_store(header, epoch, chain)) {
+		sender_key_unpark(header->uid);
+	}
+	OPENSSL_cleanse(chain, sizeof(chain));
+}
+
+// --- ### ---
+
+// --- Public keys ---
+// Heartbeats carry only a fingerprint of the sender's public key, the PEM itself goes out with CL_CONNECTED and when
+// asked for. Whoever hears a CL_ALIVE from a peer it doesn't know notes the fingerprint and asks the owner for the key,
+// and the owner answers everyone with one broadcast. An offer is taken only if it hashes to the fingerprint noted for
+// its owner. Once we have a peer's key it stays pinned for as long as the peer is known, heartbeats with another
+// fingerprint are ignored.
+//
+// CL_ALIVE: [fingerprint:unsigned char[KEY_FPR_LEN]], see key_fingerprint
+// CL_KEY: [kind:uint8_t][owner:char[UID_LEN]], a KEY_OFFER goes on with the owner's PEM, NUL included
+
+#define KEY_HDR (sizeof(uint8_t) + UID_LEN)
+#define KEY_OFFER_INTERVAL 1 // in second, between answers to requests for our key
+#define KEY_HEARD 32 // Fingerprints of unknown peers we wait for the key of
+
+enum { KEY_OFFER, KEY_REQUEST };
+
+static atomic_long key_offered; // When we last handed our key out
+
+// Guarded by clients_lock, the oldest entry makes room for a new one
+static struct {
+	char uid[UID_LEN];
+	unsigned char fingerprint[KEY_FPR_LEN];
+	bool valid;
+} key_heard[KEY_HEARD];
+static int key_heard_next;
+
+// Notes the fingerprint an unknown peer announced. Called with clients_lock held.
+static void key_heard_note(const char uid[UID_LEN], const unsigned char fingerprint[KEY_FPR_LEN]) {
+	int slot = key_heard_next;
+	for (int i = 0; i < KEY_HEARD; ++i) {
+		if (key_heard[i].valid && !memcmp(key_heard[i].uid, uid, UID_LEN)) {
+			slot = i;
+			break;
+		}
+	}
+	if (slot == key_heard_next) key_heard_next = (key_heard_next + 1) % KEY_HEARD;
+	memcpy(key_heard[slot].uid, uid, UID_LEN);
+	memcpy(key_heard[slot].fingerprint, fingerprint, KEY_FPR_LEN);
+	key_heard[slot].valid = true;
+}
+
+// Whether pem is the key uid announced, the entry is used up if so. Called with clients_lock held.
+static bool key_heard_match(const char uid[UID_LEN], const char* pem) {
+	int slot = -1;
+	for (int i = 0; i < KEY_HEARD && slot < 0; ++i) {
+		if (key_heard[i].valid && !memcmp(key_heard[i].uid, uid, UID_LEN)) slot = i;
+	}
+	if (slot < 0) return false;
+	EVP_PKEY* key = peer_pubkey_from_pem(pem);
+	unsigned char fpr[KEY_FPR_LEN];
+	bool match = key && key_fingerprint(key, fpr) && !memcmp(fpr, key_heard[slot].fingerprint, KEY_FPR_LEN);
+	EVP_PKEY_free(key);
+	if (match) key_heard[slot].valid = false;
+	return match;
+}
+
+static void key_offer(void);
+static void key_request(const char owner[UID_LEN]);
+
+// CL_KEY from a peer
+static void key_message(const header_t* header, const unsigned char* payload, size_t len) {
+	if (len < KEY_HDR) return;
+	const unsigned char* owner = payload + sizeof(uint8_t);
+
+	if (payload[0] == KEY_REQUEST) {
+		if (memcmp(owner, node.uid, UID_LEN)) return; // Someone else's key
+		// Everyone who heard the same heartbeat asks at once
+		long now = time(NULL);
+		long last = atomic_load(&key_offered);
+		if (now - last >= KEY_OFFER_INTERVAL && atomic_compare_exchange_strong(&key_offered, &last, now)) key_offer();
+		return;
+	}
+	if (payload[0] != KEY_OFFER || memcmp(owner, header->uid, UID_LEN) || len == KEY_HDR || payload[len - 1]) return;
+
+	const char* pem = (const char*)payload + KEY_HDR;
+	bool learnt = false;
+	pthread_mutex_lock(&clients_lock);
+	// Known peers keep the key they have, an offer nobody asked for or that doesn't match the heartbeat is dropped
+	if (!find_client(&known_clients, header->name, header->uid) && key_heard_match(header->uid, pem)) {
+		add_new_client(&known_clients, header->name, header->uid, header->node_type, pem);
+		client* c = find_client(&known_clients, header->name, header->uid);
+		if (c) {
+			c->chacha = header->cl_flags & CL_CHACHA;
+			learnt = true;
+		}
+	}
+	pthread_mutex_unlock(&clients_lock);
+	if (learnt) {
+		g_idle_add((GSourceFunc)update_user_list, NULL);
+		sender_key_join(header->uid);
+		sender_key_request(header->uid, 0);
 	}
+}
+
+// --- ### ---
 
+// Runs on the worker pool, may block on RSA, AES and file output. payload belongs to the job and is decrypted in place.
+static void deliver_message(const header_t* header, unsigned char* payload, size_t message_len) {
 	char* msg_str = NULL;
+	bool added = false;
 
+	if (header->cl_flags & CL_SENDER_KEY) {
+		sender_key_message(header, payload, message_len);
+		return;
+	}
+	if (header->cl_flags & CL_KEY) {
+		key_message(header, payload, message_len);
+		return;
+	}
+	bool fetch_key = false;
+
+	pthread_mutex_lock(&clients_lock);
 	if (header->cl_flags & CL_CONNECTED) {
 		// Save username to known connections
-		if (!has_client(&known_clients, header->name, header->uid)) {
+		if (!has_client(&known_clients, header->name, header->uid) && message_len && !payload[message_len - 1]) {
 			// message is public key PEM string
-			add_new_client(&known_clients, header->name, header->uid, header->node_type, payload);
+			add_new_client(&known_clients, header->name, header->uid, header->node_type, (const char*)payload);
 			g_idle_add((GSourceFunc)update_user_list, NULL);
+			added = true;
 		}
-		msg_str = g_strdup_printf("%s: %s", header->name, "New connection");
+		client* c = find_client(&known_clients, header->name, header->uid);
+		if (c) c->chacha = header->cl_flags & CL_CHACHA;
+		msg_str = chat_line("%s: %s", header->name, "New connection");
 	} else if (header->cl_flags & CL_DISCONNECTED && strcmp(header->name, node.name)) {
 		// Remove username from known conenctions
 		remove_client(&known_clients, header->name, header->uid);
 		g_idle_add((GSourceFunc)update_user_list, NULL);
-		msg_str = g_strdup_printf("%s: %s", header->name, "Disconnected");
-	} else if (header->cl_flags & CL_ALIVE) {
+		msg_str = chat_line("%s: %s", header->name, "Disconnected");
+		sender_key_retire();
+	} else if (header->cl_flags & CL_ALIVE && message_len == KEY_FPR_LEN) {
 		client* c = find_client(&known_clients, header->name, header->uid);
-		if (c) { // We already know about this client
+		if (!c) { // We don't know about this client yet
+			key_heard_note(header->uid, payload);
+			fetch_key = true;
+		} else if (!memcmp(c->fingerprint, payload, KEY_FPR_LEN)) {
 			c->last_seen = time(NULL);
-		} else { // We don't know about this client yet
-			add_new_client(&known_clients, header->name, header->uid, header->node_type, payload);
-			g_idle_add((GSourceFunc)update_user_list, NULL);
+			c->chacha = header->cl_flags & CL_CHACHA;
+		} else { // Someone else claims its uid, or it changed keys without reconnecting; it keeps the key we pinned
+			fprintf(stderr, "Ignoring a heartbeat from %s with another key\n", header->name);
 		}
 	}
+	pthread_mutex_unlock(&clients_lock);
+	if (fetch_key) key_request(header->uid);
+	if (added) { // Swap sender keys, whoever of us learnt of the other first has its offer dropped
+		sender_key_join(header->uid);
+		sender_key_request(header->uid, 0);
+	}
 
 	// Message is encrypted
-	if (header->cl_flags & CL_ENCRYPTED) {
-		int msg_len = 0;
+	if (header->cl_flags & CL_ENCRYPTED && header->cl_flags & CL_GROUP) {
+		group_message(header, payload, message_len);
+	} else if (header->cl_flags & CL_ENCRYPTED) {
+		unsigned char* dec_msg;
 		// Try to decrypt the message
-		unsigned char* dec_msg
-			= decrypt_incoming_message(payload, message_len, node.name, header->num_key, node.keypair, &msg_len);
-		if (dec_msg && msg_len > 0) {
+		int msg_len
+			= decrypt_incoming_message(payload, message_len, node.name, header->num_key, node.keypair, &dec_msg);
+		if (msg_len > 0) {
+			char path[FILENAME_LEN + 1];
 			if (header->cl_flags & CL_FILE) {
-				FILE* fp = fopen(header->filename, "wb");
+				FILE* fp = safe_filename(header->filename, path) ? fopen(path, "wb") : NULL;
 				printf("    filename is '%s'\n", header->filename);
 				if (!fp) {
 					fprintf(stderr, "Failed to open file for writing\n");
-					free(dec_msg);
 					return;
 				}
 				if (fwrite(dec_msg, 1, msg_len, fp) <= 0) {
 					fprintf(stderr, "Failed to write to file\n");
-					free(dec_msg);
 					fclose(fp);
 					return;
 				}
 				fclose(fp);
 			} else {
-				msg_str = g_strdup_printf("%s: %.*s", header->name, msg_len, dec_msg);
+				msg_str = chat_line("%s: %.*s", header->name, msg_len, dec_msg);
 			}
-			free(dec_msg);
 		} else {
 			fprintf(stderr, "Failed to decrypt!\n");
 			// Failed to decrypt a message
@@ -279,46 +927,276 @@ void gui_message_callback(const header_t* header, const char* message, size_t me
 	if (msg_str) {
 		g_idle_add(show_incoming_message, msg_str);
 	}
+}
 
-relay:
-	// Relay any incoming message
-	if (node.type == N_GATEWAY) {
-		if (header->node_type == N_GATEWAY && header->cl_flags & CL_RELAYED) { // Only broadcast to subnet if coming from relay
-			udp_relay(payload, message_len, header, broadcast_ip, DEST_PORT, header->cl_flags ^ CL_RELAYED);
+// The key block of a streamed file is read back from disk, this bounds how far we look for it
+#define KEY_BLOCK_MAX (256 * 1024)
+
+// Reads len bytes at off from the stream's file, returns false on a short read.
+static bool stream_read(file_stream* stream, unsigned char* buf, size_t len, off_t off) {
+	while (len > 0) {
+		ssize_t n = pread(stream->fd, buf, len, off);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return false;
+		buf += n;
+		len -= n;
+		off += n;
+	}
+	return true;
+}
+
+static bool stream_write(file_stream* stream, const unsigned char* buf, size_t len, off_t off) {
+	while (len > 0) {
+		ssize_t n = pwrite(stream->fd, buf, len, off);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return false;
+		buf += n;
+		len -= n;
+		off += n;
+	}
+	return true;
+}
+
+// Unwraps our key from the start of the file once enough of it is on disk. Returns 1 once the cipher is set up,
+// 0 to wait for more fragments, -1 if the file isn't for us.
+static int stream_open_cipher(const header_t* header, file_stream* stream, size_t avail, bool complete) {
+	size_t n = avail < KEY_BLOCK_MAX ? avail : KEY_BLOCK_MAX;
+	unsigned char* block = arena_alloc(thread_arena(), n);
+	if (!block || !stream_read(stream, block, n, 0)) return -1;
+
+	unsigned char key[AES_KEYLEN];
+	unsigned char iv[AES_IVLEN];
+	size_t data_off;
+	uint32_t ciphertext_len;
+	int found = parse_key_block(block, n, node.name, header->num_key, node.keypair, key, iv, &data_off, &ciphertext_len);
+	if (found < 0 && !complete && n < KEY_BLOCK_MAX) return 0;
+	if (found <= 0) return -1;
+
+	stream->cipher = EVP_CIPHER_CTX_new();
+	if (!stream->cipher || EVP_DecryptInit_ex(stream->cipher, EVP_aes_256_cbc(), NULL, key, iv) <= 0) {
+		OPENSSL_cleanse(key, sizeof(key));
+		return -1;
+	}
+	OPENSSL_cleanse(key, sizeof(key));
+	stream->in_off = data_off;
+	stream->out_off = 0;
+	stream->end = data_off + ciphertext_len;
+	return 1;
+}
+
+// Decrypts whatever contiguous part of a streamed file is on disk, in place. The plaintext is written
+// data_off bytes ahead of the ciphertext it came from, so only one STREAM_CHUNK bounce buffer is in memory.
+// Runs on the workers, the stream lock keeps the CBC chain in order.
+static void advance_stream(const header_t* header, file_stream* stream) {
+	pthread_mutex_lock(&stream->lock);
+	if (stream->done || atomic_load(&stream->aborted)) {
+		pthread_mutex_unlock(&stream->lock);
+		return;
+	}
+
+	size_t length = atomic_load(&stream->length);
+	size_t avail = length ? length : (size_t)atomic_load(&stream->contiguous) * stream->frag_size;
+	unsigned char* in = NULL;
+	unsigned char* out = NULL;
+
+	if (!stream->cipher) {
+		int ret = stream_open_cipher(header, stream, avail, length != 0);
+		if (ret == 0) goto out;
+		if (ret < 0 || (length && stream->end > length)) {
+			fprintf(stderr, "File '%s' is not for us or is malformed, dropping it\n", stream->path);
+			atomic_store(&stream->aborted, true);
+			goto out;
 		}
-		for (int i = 0; i < num_gw_ips; ++i) {
-			udp_relay(payload, message_len, header, gateway_ips[i], DEST_PORT, header->cl_flags ^ CL_RELAYED);
+	}
+
+	// Scratch for this job only, see thread_arena
+	in = arena_alloc(thread_arena(), STREAM_CHUNK);
+	out = arena_alloc(thread_arena(), STREAM_CHUNK + AES_BLOCK_SIZE);
+	if (!in || !out) goto out;
+
+	size_t limit = avail < stream->end ? avail : stream->end;
+	while (stream->in_off < limit) {
+		size_t n = limit - stream->in_off;
+		if (n > STREAM_CHUNK) n = STREAM_CHUNK;
+		int outl = 0;
+		if (!stream_read(stream, in, n, stream->in_off)
+			|| EVP_DecryptUpdate(stream->cipher, out, &outl, in, n) <= 0
+			|| !stream_write(stream, out, outl, stream->out_off)) {
+			fprintf(stderr, "Failed to decrypt '%s'\n", stream->path);
+			atomic_store(&stream->aborted, true);
+			goto out;
 		}
+		stream->in_off += n;
+		stream->out_off += outl;
 	}
+
+	if (stream->in_off == stream->end) {
+		int outl = 0;
+		if (EVP_DecryptFinal_ex(stream->cipher, out, &outl) <= 0 || !stream_write(stream, out, outl, stream->out_off)) {
+			fprintf(stderr, "Failed to decrypt '%s'\n", stream->path);
+			atomic_store(&stream->aborted, true);
+			goto out;
+		}
+		if (file_stream_finish(stream, stream->out_off + outl) < 0) {
+			atomic_store(&stream->aborted, true);
+			goto out;
+		}
+		printf("Received file '%s', %zu bytes\n", stream->path, stream->out_off + outl);
+		g_idle_add(show_incoming_message, chat_line("%s: sent file %s", header->name, stream->path));
+	}
+
+out:
+	pthread_mutex_unlock(&stream->lock);
 }
 
+// Opens one sealed fragment in place and writes it to its spot in the file, fragments can come in any order and
+// on any worker. Whoever writes the last one finishes the file. Call once the stream is keyed.
+static void open_sealed(const header_t* header, file_stream* stream, unsigned char* data, size_t len) {
+	if (atomic_load(&stream->aborted)) return;
+
+	unsigned char nonce[AEAD_NONCELEN];
+	unsigned char aad[AEAD_AADLEN];
+	aead_nonce(nonce, stream->iv, header->id, header->frag_num);
+	aead_aad(aad, header->uid, header->id, header->frag_num, header->total_fragments, header->frag_size,
+		header->key_frags);
+	int n = aead_open(header_suite(header), stream->key, nonce, aad, sizeof(aad), data, len, data);
+	if (n < 0) {
+		// Nothing of it reaches the file, and with the fragment rejected the file can't be completed
+		fprintf(stderr, "Fragment %u of '%s' from %s failed authentication, dropping the file\n", header->frag_num,
+			stream->path, header->name);
+		atomic_store(&stream->aborted, true);
+		return;
+	}
+
+	off_t off = (off_t)(header->frag_num - header->key_frags) * (header->frag_size - AEAD_TAGLEN);
+	if (!stream_write(stream, data, n, off)) {
+		atomic_store(&stream->aborted, true);
+		return;
+	}
+	if (header->frag_num == header->total_fragments - 1) atomic_store(&stream->length, off + n);
+
+	if (atomic_fetch_add(&stream->opened, 1) + 1 == (unsigned)(header->total_fragments - header->key_frags)) {
+		pthread_mutex_lock(&stream->lock);
+		if (!atomic_load(&stream->aborted) && file_stream_finish(stream, atomic_load(&stream->length)) == 0) {
+			g_idle_add(show_incoming_message, chat_line("%s: sent file %s", header->name, stream->path));
+		}
+		pthread_mutex_unlock(&stream->lock);
+	}
+}
+
+// A sealed fragment that beat the key block is parked on the stream, reasm_add_sealed keeps what is parked or
+// queued within STREAM_PENDING_MAX. data is NULL if the receiver couldn't copy the fragment.
+static void sealed_fragment(const header_t* header, file_stream* stream, unsigned char* data, size_t len) {
+	pthread_mutex_lock(&stream->lock);
+	if (data && !atomic_load(&stream->keyed) && !atomic_load(&stream->aborted)) {
+		sealed_frag* f = malloc(sizeof(sealed_frag));
+		if (f) {
+			f->header = *header;
+			f->data = data;
+			f->len = len;
+			f->next = stream->pending;
+			stream->pending = f;
+			pthread_mutex_unlock(&stream->lock);
+			return;
+		}
+		atomic_store(&stream->aborted, true); // This fragment is gone for good
+	}
+	pthread_mutex_unlock(&stream->lock);
+
+	if (data && atomic_load(&stream->keyed)) open_sealed(header, stream, data, len);
+	atomic_fetch_sub(&stream->pending_bytes, len);
+	buf_pool_put(data);
+}
+
+// Unwraps the key of a sealed stream and opens whatever was parked waiting for it
+static void sealed_keys(const header_t* header, file_stream* stream, const unsigned char* block, size_t len) {
+	unsigned char key[AES_KEYLEN];
+	unsigned char iv[AES_IVLEN];
+	size_t data_off;
+	uint32_t plain_len;
+	int ret = parse_key_block(block, len, node.name, header->num_key, node.keypair, key, iv, &data_off, &plain_len);
+
+	pthread_mutex_lock(&stream->lock);
+	// The file is created only now that it is known to be for us
+	if (ret == 1 && (atomic_load(&stream->aborted) || file_stream_create(stream) < 0)) ret = 0;
+	if (ret == 1) {
+		memcpy(stream->key, key, AES_KEYLEN);
+		memcpy(stream->iv, iv, AES_IVLEN);
+		atomic_store(&stream->keyed, true);
+	} else {
+		if (ret < 0) fprintf(stderr, "File '%s' has a malformed key block, dropping it\n", stream->path);
+		atomic_store(&stream->aborted, true); // Not for us, or unreadable
+	}
+	sealed_frag* pending = stream->pending;
+	stream->pending = NULL;
+	pthread_mutex_unlock(&stream->lock);
+	OPENSSL_cleanse(key, sizeof(key));
+
+	while (pending) {
+		sealed_frag* next = pending->next;
+		if (ret == 1) open_sealed(&pending->header, stream, pending->data, pending->len);
+		atomic_fetch_sub(&stream->pending_bytes, pending->len);
+		buf_pool_put(pending->data);
+		free(pending);
+		pending = next;
+	}
+}
+
+void rx_job_handler(void* arg) {
+	rx_job* job = (rx_job*)arg;
+	if (job->kind & (RX_STREAM | RX_KEYS | RX_SEALED)) {
+		if (job->kind & RX_STREAM) advance_stream(&job->header, job->stream);
+		if (job->kind & RX_KEYS) sealed_keys(&job->header, job->stream, job->data, job->len);
+		if (job->kind & RX_SEALED) {
+			sealed_fragment(&job->header, job->stream, job->data, job->len);
+			job->data = NULL; // Freed or parked by sealed_fragment
+		}
+		buf_pool_put(job->data);
+		file_stream_put(job->stream);
+		rx_job_put(job);
+		return;
+	}
+	if (job->kind & RX_RELAY) relay_fragment(&job->header, job->data, job->len);
+	if (job->kind & RX_DELIVER) deliver_message(&job->header, job->data, job->len);
+	if (job->kind & RX_NACK) {
+		nack_t nack;
+		if (parse_nack((const char*)job->data, job->len, &nack)) answer_nack(&nack);
+	}
+	buf_pool_put(job->data);
+	rx_job_put(job);
+}
+
+// Replaces the stored identity, peers see the new key from the next connect on
 void generate_keys() {
-	GtkWidget* dialog
-		= gtk_message_dialog_new(NULL, GTK_DIALOG_MODAL, GTK_MESSAGE_INFO, GTK_BUTTONS_OK, "Key pair generated (dummy action).");
+	EVP_PKEY* key = keygen_pool_take();
+	bool saved = key && !ephemeral_identity && identity_save(key, identity_file) == 0;
+	EVP_PKEY_free(key);
+	GtkWidget* dialog = gtk_message_dialog_new(NULL, GTK_DIALOG_MODAL, GTK_MESSAGE_INFO, GTK_BUTTONS_OK,
+		saved ? "New key pair saved, it is used from the next connect on." : "Failed to save a new key pair.");
 	gtk_dialog_run(GTK_DIALOG(dialog));
 	gtk_widget_destroy(dialog);
 }
 
-timer_event* awake_event;
+// Runs on receiver shard 0, the heartbeats are queued so receiving doesn't wait for the scheduler
 void* timer_awake(void* arg) {
 	node_t* node = (node_t*)arg;
+	send_ctx_refresh_pmtu(&node->tx); // Pick up path MTU changes towards the gateways
 	int id = atomic_fetch_add(&node->id, 1);
-	udp_send(node->pubkey_pem, strlen(node->pubkey_pem), node->name, node->uid, node->type, id, 0, broadcast_ip, DEST_PORT,
-		CL_ALIVE, NULL);
+	udp_queue(&node->tx, (const char*)node->fingerprint, KEY_FPR_LEN, node->name, node->uid, node->type, id, 0,
+		broadcast_ip, DEST_PORT, CL_ALIVE | suite_flag(), NULL);
 
 	if (node->type == N_GATEWAY) {
 		for (int i = 0; i < num_gw_ips; ++i) {
-			udp_send(node->pubkey_pem, strlen(node->pubkey_pem), node->name, node->uid, node->type, id, known_clients.size,
-				gateway_ips[i], DEST_PORT, CL_RELAYED | CL_ALIVE, NULL);
+			udp_queue(&node->tx, (const char*)node->fingerprint, KEY_FPR_LEN, node->name, node->uid, node->type, id,
+				known_clients.size, gateway_ips[i], DEST_PORT, CL_RELAYED | CL_ALIVE | suite_flag(), NULL);
 		}
 	}
 	return NULL;
 }
 
-// TODO: add thread safety for known_clients!! Race condition may occur!
-timer_event* prune_event;
 void* prune_stale_clients(void* arg) {
 	time_t now = time(NULL);
+	pthread_mutex_lock(&clients_lock);
 	struct client* curr = known_clients.head;
 	int updated = 0;
 	while (curr) {
@@ -330,10 +1208,279 @@ void* prune_stale_clients(void* arg) {
 		}
 		curr = next;
 	}
-	if (updated) g_idle_add((GSourceFunc)update_user_list, NULL); // Thread-safe GUI update
+	pthread_mutex_unlock(&clients_lock);
+	if (updated) {
+		g_idle_add((GSourceFunc)update_user_list, NULL); // Thread-safe GUI update
+		sender_key_retire();
+	}
 	return NULL;
 }
 
+// --- Retransmission ---
+// Packets we originate are kept for REASM_TIMEOUT so receivers that lost fragments can NACK them. Chat messages keep
+// their payload, files keep their mapping and seal the fragments asked for again. Every resend round carries a new
+// header.resend, so it gets past dedup and the gateways relay it once more. After UINT8_MAX rounds a packet isn't
+// resent any more, a round number used again would be taken for a duplicate.
+
+#define TX_HISTORY 64 // Packets NACKs can be answered for
+#define NACK_HOLDOFF 100 // in millisecond, NACKs repeating the latest round within this crossed the resend on the way
+
+typedef struct {
+	char* d_ip;
+	enum cl_e flags;
+} send_dest;
+
+typedef struct file_send file_send;
+
+typedef struct {
+	header_t tmpl; // Sent to every destination with its flags, frag_size is the smallest of them all
+	send_dest* dests;
+	int num_dests;
+	size_t size; // Bytes of the packet
+	int total_fragments;
+	unsigned char* data; // Payload of a chat message
+	file_send* fs; // Files seal their fragments again, see file_send_seal. Freed with the record.
+	atomic_int refs;
+	time_t created;
+	uint8_t round; // Latest resend round
+	uint64_t round_ms; // monotonic_ms() of the latest round
+	nack_t last; // What the latest round was asked for
+} tx_record;
+
+static tx_record* tx_history[TX_HISTORY];
+static int tx_history_next;
+// Guards tx_history and the round state of the records in it
+static pthread_mutex_t tx_history_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void file_send_free(file_send* fs);
+static int file_send_seal(const file_send* fs, int f, unsigned char* out);
+
+// A record for a new packet from us to the usual destinations, with one reference for the caller. The caller fills
+// in the rest of tmpl, size, total_fragments and data or fs.
+static tx_record* tx_record_new(enum cl_e flags) {
+	tx_record* rec = calloc(1, sizeof(tx_record));
+	if (!rec) return NULL;
+	// Same destinations as udp_send callers use, gateways don't spoof towards other gateways
+	int gws = node.type == N_GATEWAY ? num_gw_ips : 0;
+	rec->dests = calloc(gws + 1, sizeof(send_dest));
+	if (!rec->dests) {
+		free(rec);
+		return NULL;
+	}
+	rec->num_dests = gws + 1;
+	rec->tmpl.frag_size = MAX_FRAGMENT;
+	for (int i = 0; i <= gws; ++i) {
+		send_dest* d = &rec->dests[i];
+		d->d_ip = i < gws ? gateway_ips[i] : broadcast_ip;
+		d->flags = flags | (i < gws ? CL_RELAYED : 0);
+		uint16_t frag_size = send_ctx_frag_size(&node.tx, d->d_ip, DEST_PORT);
+		if (frag_size < rec->tmpl.frag_size) rec->tmpl.frag_size = frag_size;
+	}
+
+	memcpy(rec->tmpl.name, node.name, NAME_LEN);
+	memcpy(rec->tmpl.uid, node.uid, UID_LEN);
+	rec->tmpl.node_type = node.type;
+	rec->tmpl.id = atomic_fetch_add(&node.id, 1);
+	rec->tmpl.fec_data = fec_data;
+	rec->tmpl.fec_parity = fec_parity;
+	atomic_init(&rec->refs, 1);
+	rec->created = time(NULL);
+	return rec;
+}
+
+static void tx_record_put(tx_record* rec) {
+	if (!rec || atomic_fetch_sub(&rec->refs, 1) != 1) return;
+	if (rec->fs) file_send_free(rec->fs);
+	free(rec->data);
+	free(rec->dests);
+	free(rec);
+}
+
+// Sends fragments [first_frag, first_frag + count) to every destination, msg points at fragment first_frag
+static void tx_send(const tx_record* rec, const unsigned char* msg, int first_frag, int count, uint8_t round) {
+	header_t tmpl = rec->tmpl;
+	tmpl.resend = round;
+	for (int i = 0; i < rec->num_dests; ++i) {
+		tmpl.cl_flags = rec->dests[i].flags;
+		udp_send_frags(&node.tx, (const char*)msg, rec->size, &tmpl, first_frag, count, rec->dests[i].d_ip, DEST_PORT);
+	}
+}
+
+// tx_send for resends, the fragments are copied to the scheduler and the caller goes on without waiting for pacing
+static void tx_resend(const tx_record* rec, const unsigned char* msg, int first_frag, int count, uint8_t round) {
+	header_t tmpl = rec->tmpl;
+	tmpl.resend = round;
+	for (int i = 0; i < rec->num_dests; ++i) {
+		tmpl.cl_flags = rec->dests[i].flags;
+		udp_queue_frags(&node.tx, (const char*)msg, rec->size, &tmpl, first_frag, count, rec->dests[i].d_ip, DEST_PORT);
+	}
+}
+
+// The history takes a reference of its own, the oldest packet makes room
+static void tx_history_add(tx_record* rec) {
+	atomic_fetch_add(&rec->refs, 1);
+	pthread_mutex_lock(&tx_history_lock);
+	tx_record* old = tx_history[tx_history_next];
+	tx_history[tx_history_next] = rec;
+	tx_history_next = (tx_history_next + 1) % TX_HISTORY;
+	pthread_mutex_unlock(&tx_history_lock);
+	tx_record_put(old);
+}
+
+// Sends buf to the usual destinations as a new packet and keeps it for NACKs, the record owns buf from here on
+static void tx_send_packet(enum cl_e flags, unsigned char* buf, size_t len, uint8_t num_keys) {
+	tx_record* rec = tx_record_new(flags);
+	if (!rec) {
+		free(buf);
+		return;
+	}
+	rec->tmpl.num_key = num_keys;
+	rec->data = buf;
+	rec->size = len;
+	rec->total_fragments = (len + rec->tmpl.frag_size - 1) / rec->tmpl.frag_size;
+	tx_send(rec, buf, 0, rec->total_fragments, 0);
+	tx_history_add(rec);
+	tx_record_put(rec);
+}
+
+static void tx_history_clear(void) {
+	tx_record* old[TX_HISTORY];
+	pthread_mutex_lock(&tx_history_lock);
+	memcpy(old, tx_history, sizeof(old));
+	memset(tx_history, 0, sizeof(tx_history));
+	pthread_mutex_unlock(&tx_history_lock);
+	for (int i = 0; i < TX_HISTORY; ++i)
+		tx_record_put(old[i]);
+}
+
+static bool nack_bit(const nack_t* nack, int f) {
+	int i = f - nack->first;
+	return i >= 0 && i < nack->nbits && nack->bitmap[i / 8] & (1 << (i % 8));
+}
+
+// Runs on the workers for NACKs of our own packets. The fragments asked for are queued to every destination of the
+// packet again, the worker doesn't wait for them to go out. Everyone on a subnet that lost the same fragments NACKs
+// them around the same time, what the latest round already covers is not sent twice. The loss NACKs of files report
+// feeds the rate control that paced them.
+static void answer_nack(const nack_t* nack) {
+	uint64_t now = monotonic_ms();
+	time_t t = time(NULL);
+	nack_t want = *nack;
+	tx_record* rec = NULL;
+	uint8_t round = 0;
+	int count = 0;
+	bool paced = false;
+
+	pthread_mutex_lock(&tx_history_lock);
+	for (int i = 0; i < TX_HISTORY && !rec; ++i) {
+		tx_record* r = tx_history[i];
+		if (r && r->tmpl.id == nack->id && t - r->created <= REASM_TIMEOUT) rec = r;
+	}
+	if (rec) {
+		paced = rec->fs != NULL;
+		bool holdoff = now - rec->round_ms < NACK_HOLDOFF;
+		for (int f = want.first; f < want.first + want.nbits; ++f) {
+			if (!nack_bit(&want, f)) continue;
+			if (f < rec->total_fragments && !(holdoff && nack_bit(&rec->last, f))) {
+				count++;
+			} else {
+				int i = f - want.first;
+				want.bitmap[i / 8] &= ~(1 << (i % 8));
+			}
+		}
+		if (count && rec->round < UINT8_MAX) { // 0 is the first copy
+			round = ++rec->round;
+			rec->round_ms = now;
+			rec->last = *nack;
+			atomic_fetch_add(&rec->refs, 1);
+		} else {
+			rec = NULL;
+		}
+	}
+	pthread_mutex_unlock(&tx_history_lock);
+	if (paced && nack->fresh) rate_ctl_report(&node.tx.rate, nack->fresh, nack->lost, nack->echo);
+	if (!rec) { // Gone from the history, out of rounds, or nothing the latest round didn't cover
+		atomic_fetch_add(&nacks_ignored, 1);
+		return;
+	}
+
+	unsigned char frag[MAX_FRAGMENT];
+	for (int f = want.first; f < want.first + want.nbits; ++f) {
+		if (!nack_bit(&want, f)) continue;
+		if (rec->fs) {
+			if (file_send_seal(rec->fs, f, frag) >= 0) tx_resend(rec, frag, f, 1, round);
+			continue;
+		}
+		int run = 1;
+		while (nack_bit(&want, f + run))
+			run++;
+		tx_resend(rec, rec->data + (size_t)f * rec->tmpl.frag_size, f, run, round);
+		f += run - 1;
+	}
+	atomic_fetch_add(&nacks_answered, 1);
+	atomic_fetch_add(&frags_resent, count);
+	tx_record_put(rec);
+}
+
+// --- ### ---
+
+// Called from the receiver shards, queued like the heartbeats
+static void send_nack(const nack_t* nack, size_t len, void* arg) {
+	int id = atomic_fetch_add(&node.id, 1);
+	udp_queue(&node.tx, (const char*)nack, len, node.name, node.uid, node.type, id, 0, broadcast_ip, DEST_PORT, CL_NACK,
+		NULL);
+	if (node.type == N_GATEWAY) {
+		for (int i = 0; i < num_gw_ips; ++i) {
+			udp_queue(&node.tx, (const char*)nack, len, node.name, node.uid, node.type, id, 0, gateway_ips[i], DEST_PORT,
+				CL_RELAYED | CL_NACK, NULL);
+		}
+	}
+	atomic_fetch_add(&nacks_sent, 1);
+}
+
+// Runs on every receiver shard, each asks for the packets stuck in its own reassembly table and drops the
+// stalled ones, so they give the budget back even when no new packet comes in
+void* nack_tick(void* arg) {
+	recv_shard_t* shard = (recv_shard_t*)arg;
+	reasm_expire(&reasm[shard->index], time(NULL));
+	reasm_collect_nacks(&reasm[shard->index], monotonic_ms(), send_nack, NULL);
+	return NULL;
+}
+
+// Frees the per shard tables, whatever was still in flight is dropped
+static void recv_tables_free(void) {
+	for (int i = 0; i < MAX_RECV_SHARDS; ++i) {
+		dedup_free(&dedup[i]);
+		reasm_free(&reasm[i]);
+		fec_table_free(&fec[i]);
+	}
+}
+
+// Allocates the tables of the first shards receivers only, a client runs one and the others stay empty
+static int recv_tables_init(int shards) {
+	recv_tables_free();
+	for (int i = 0; i < shards; ++i) {
+		if (dedup_init(&dedup[i], DEDUP_BITS, DEDUP_TTL) < 0 || reasm_init(&reasm[i], REASM_MEMORY, REASM_TIMEOUT) < 0
+			|| fec_table_init(&fec[i], FEC_MEMORY, FEC_TIMEOUT) < 0) {
+			recv_tables_free();
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Our keypair for this connection: the stored identity, or one from the pool with --ephemeral. The first connect
+// stores the keypair it got from the pool as the identity.
+static bool node_identity(void) {
+	int loaded = ephemeral_identity ? 0 : identity_load(&node, identity_file);
+	if (loaded == 1) return true;
+	EVP_PKEY* key = keygen_pool_take();
+	if (!key || !node_set_keypair(&node, key)) return false;
+	// An unusable identity file is left for the user to look at, this connection is ephemeral
+	if (!ephemeral_identity && loaded == 0) identity_save(node.keypair, identity_file);
+	return true;
+}
+
 void connect_to_network(GtkWindow* parent) {
 	if (connected) {
 		GtkWidget* dialog
@@ -355,41 +1502,94 @@ void connect_to_network(GtkWindow* parent) {
 		const gchar* nick = gtk_entry_get_text(GTK_ENTRY(entry_nick));
 		if (nick && strlen(nick) > 0) {
 			strncpy(nickname, nick, sizeof(nickname) - 1);
-			connected = TRUE;
-			char status[128];
-			snprintf(status, sizeof(status), "Connected as %s. Mode: %s", nickname, node_mode);
-			gtk_statusbar_push(GTK_STATUSBAR(statusbar), context_id, status);
-
 			strncpy(node.name, nickname, NAME_LEN);
 			node.name[NAME_LEN - 1] = '\0';
 
-			// Set the node id and generate keypair
+			// Set the node id and load or take the keypair, keygen would keep the window frozen for a while
 			srand(time(NULL));
 			atomic_store(&node.id, rand() % UINT16_MAX);
 
+			const char* failure = NULL;
 			if (!RAND_bytes((unsigned char*)node.uid, UID_LEN)) {
-				fprintf(stderr, "Failed to generate a random UID\n");
-				exit(1);
+				failure = "Failed to generate a random UID";
+			}
+			// Gateways carry the whole subnet plus inter-gateway traffic, give them a receiver per core
+			node.num_shards = 1;
+			if (node.type == N_GATEWAY) node.num_shards = sysconf(_SC_NPROCESSORS_ONLN);
+			if (node.num_shards > MAX_RECV_SHARDS) node.num_shards = MAX_RECV_SHARDS;
+			if (!failure && recv_tables_init(node.num_shards) < 0) {
+				failure = "Failed to allocate the receive tables";
+			}
+			if (!failure && !node_identity()) {
+				failure = "Failed to set up the RSA keypair";
+			}
+			if (!failure) {
+				pthread_mutex_lock(&my_key.lock);
+				my_key.epoch = 0;
+				sender_key_new();
+				pthread_mutex_unlock(&my_key.lock);
 			}
 
-			if (node.keypair) EVP_PKEY_free(node.keypair);
-			if (node.pubkey_pem) free(node.pubkey_pem);
-			node.keypair = NULL;
-			node.pubkey_pem = NULL;
-			if (!node_generate_rsa_keypair(&node)) {
-				fprintf(stderr, "Failed to generate RSA keypair");
+			// send_ctx_open cleans up after itself when it fails
+			bool tx_open = !failure
+				&& send_ctx_open(&node.tx, get_host_mtu(local_ip), gateway_ips, num_gw_ips, DEST_PORT) == 0;
+			if (!failure && !tx_open) {
+				failure = "Failed to open the send sockets";
+			}
+			if (tx_open && tx_sched_start(&node.sched, &node.tx) < 0) {
+				fprintf(stderr, "Failed to start the transmit scheduler, sending from the callers\n");
+			}
+
+			node.rcvbuf = RECV_BUFFER_SIZE;
+			node.engine = recv_engine;
+			// Heartbeat and prune run inside the receiver loop of shard 0, their sends don't block it
+			node.num_timers = 0;
+			node_add_timer(&node, NOTIFY_EVENT_TIMER, timer_awake, &node);
+			node_add_timer(&node, PRUNE_EVENT_TIMER, prune_stale_clients, NULL);
+			node_add_shard_timer(&node, NACK_INTERVAL, nack_tick);
+			// Workers must be up before the receivers start handing them packets
+			int workers = rx_workers > 0 ? rx_workers : sysconf(_SC_NPROCESSORS_ONLN);
+			if (!failure && !rx_job_ring.cells && mpmc_init(&rx_job_ring, RX_QUEUE_SIZE) < 0) {
+				fprintf(stderr, "Failed to allocate the job cache, allocating per packet\n");
+			}
+			if (!failure && work_pool_start(&rx_pool, workers, RX_QUEUE_SIZE, rx_job_handler) < 0) {
+				failure = "Failed to start the receive workers";
+			} else if (!failure && start_udp_receiver(&node, DEST_PORT, gui_message_callback) < 0) {
+				failure = "Failed to start the receivers";
+				work_pool_stop(&rx_pool); // Nothing feeds the workers
 			}
 
-			cache_clear(&cache); // Reset the id cache
-			if (start_udp_receiver(&node, DEST_PORT, gui_message_callback) == 0) {
-				// Send a CL_CONNECTED message
-				awake_event = new_timer_event(NOTIFY_EVENT_TIMER, 0, timer_awake, &node);
-				prune_event = new_timer_event(PRUNE_EVENT_TIMER, 0, prune_stale_clients, NULL);
-				fragments_cache.size = 0;
-				usleep(100);
-				udp_send(node.pubkey_pem, strlen(node.pubkey_pem), node.name, node.uid, node.type, atomic_fetch_add(&node.id, 1),
-					0, broadcast_ip, DEST_PORT, CL_CONNECTED, NULL);
+			if (failure) {
+				// Undo whatever did start, a failed start_udp_receiver stopped its own shards
+				fprintf(stderr, "%s\n", failure);
+				tx_sched_stop(&node.sched);
+				if (tx_open) send_ctx_close(&node.tx);
+				recv_tables_free();
+				pthread_mutex_lock(&my_key.lock);
+				OPENSSL_cleanse(my_key.chain, sizeof(my_key.chain));
+				pthread_mutex_unlock(&my_key.lock);
+				if (node.keypair) EVP_PKEY_free(node.keypair);
+				if (node.pubkey_pem) free(node.pubkey_pem);
+				node.keypair = NULL;
+				node.pubkey_pem = NULL;
+
+				GtkWidget* error = gtk_message_dialog_new(
+					parent, GTK_DIALOG_MODAL, GTK_MESSAGE_ERROR, GTK_BUTTONS_OK, "%s, not connected.", failure);
+				gtk_dialog_run(GTK_DIALOG(error));
+				gtk_widget_destroy(error);
+				gtk_widget_destroy(dialog);
+				return;
 			}
+
+			// Only now that everything runs, so a failure above leaves the node and the statusbar disconnected
+			connected = TRUE;
+			char status[128];
+			snprintf(status, sizeof(status), "Connected as %s. Mode: %s", nickname, node_mode);
+			gtk_statusbar_push(GTK_STATUSBAR(statusbar), context_id, status);
+
+			// Send a CL_CONNECTED message, the sockets are bound once start_udp_receiver returns
+			udp_send(&node.tx, node.pubkey_pem, strlen(node.pubkey_pem) + 1, node.name, node.uid, node.type,
+				atomic_fetch_add(&node.id, 1), 0, broadcast_ip, DEST_PORT, CL_CONNECTED | suite_flag(), NULL);
 		}
 	}
 	gtk_widget_destroy(dialog);
@@ -404,20 +1604,77 @@ void disconnect_from_network(GtkWindow* parent) {
 	}
 	connected = FALSE;
 	gtk_statusbar_push(GTK_STATUSBAR(statusbar), context_id, "Disconnected.");
+	// File senders use the send sockets, stop them at their next chunk
+	atomic_store(&file_sends_cancel, true);
+	pthread_mutex_lock(&file_sends_lock);
+	while (file_sends > 0)
+		pthread_cond_wait(&file_sends_done, &file_sends_lock);
+	pthread_mutex_unlock(&file_sends_lock);
+	atomic_store(&file_sends_cancel, false);
+	// Tell the subnet before the sockets go away, peers drop us from their lists right away
+	udp_send(&node.tx, node.name, strlen(node.name), node.name, node.uid, node.type, atomic_fetch_add(&node.id, 1), 0,
+		broadcast_ip, DEST_PORT, CL_DISCONNECTED, NULL);
 	stop_udp_receiver(&node);
+	// Drain what the receivers queued while the send sockets are still open for relaying
+	work_pool_stop(&rx_pool);
+	printf("rx workers: %lu jobs, %lu waited for a full queue, queue high water %lu\n",
+		atomic_load(&rx_pool.submitted), atomic_load(&rx_pool.stalls), atomic_load(&rx_pool.high_water));
+	unsigned long dup_hits = 0, dup_misses = 0, dup_evictions = 0;
+	for (int i = 0; i < MAX_RECV_SHARDS; ++i) {
+		dup_hits += dedup[i].hits;
+		dup_misses += dedup[i].misses;
+		dup_evictions += dedup[i].evictions;
+	}
+	printf("duplicates: %lu dropped, %lu new, %lu evicted early\n", dup_hits, dup_misses, dup_evictions);
+	unsigned long completed = 0, timeouts = 0, evictions = 0, rejected = 0;
+	for (int i = 0; i < MAX_RECV_SHARDS; ++i) {
+		completed += reasm[i].completed;
+		timeouts += reasm[i].timeouts;
+		evictions += reasm[i].evictions;
+		rejected += reasm[i].rejected;
+	}
+	printf("reassembly: %lu packets, %lu timed out, %lu evicted, %lu bad fragments\n", completed, timeouts, evictions,
+		rejected);
+	unsigned long fec_rebuilt = 0, fec_lost = 0;
+	for (int i = 0; i < MAX_RECV_SHARDS; ++i) {
+		fec_rebuilt += fec[i].rebuilt;
+		fec_lost += fec[i].lost;
+	}
+	printf("FEC (%s): %lu fragments rebuilt, %lu blocks short of parity\n", fec_kernel(), fec_rebuilt, fec_lost);
+	printf("NACKs: %lu sent, %lu answered with %lu fragments, %lu ignored\n", atomic_load(&nacks_sent),
+		atomic_load(&nacks_answered), atomic_load(&frags_resent), atomic_load(&nacks_ignored));
+	double rate, loss, srtt;
+	unsigned long cuts;
+	rate_ctl_stats(&node.tx.rate, &rate, &loss, &srtt, &cuts);
+	printf("rate control: %.1f MB/s, %.2f%% loss, %.1f ms RTT, cut %lu times\n", rate / (1024 * 1024), loss * 100, srtt,
+		cuts);
+	tx_sched_stop(&node.sched);
+	tx_queue_t tx_stats[TX_CLASSES];
+	tx_sched_stats(&node.sched, tx_stats);
+	for (int i = 0; i < TX_CLASSES; ++i) {
+		tx_queue_t* q = &tx_stats[i];
+		printf("tx %s: %lu packets, %lu fragments, %lu dropped, queue high water %d, wait %.2f ms avg %.2f ms max\n",
+			tx_class_name(i), q->packets, q->fragments, q->dropped, q->max_depth,
+			q->packets ? q->wait_ms / q->packets : 0, q->max_wait_ms);
+	}
+	tx_history_clear();
+	sender_key_unpark_all();
+	pthread_mutex_lock(&my_key.lock);
+	OPENSSL_cleanse(my_key.chain, sizeof(my_key.chain));
+	pthread_mutex_unlock(&my_key.lock);
 
-	timer_event_stop(awake_event);
-	timer_event_stop(prune_event);
-	awake_event = NULL;
-	prune_event = NULL;
+	send_ctx_close(&node.tx);
 
 	if (node.keypair) EVP_PKEY_free(node.keypair);
 	if (node.pubkey_pem) free(node.pubkey_pem);
 	node.keypair = NULL;
 	node.pubkey_pem = NULL;
 
+	pthread_mutex_lock(&clients_lock);
 	clear_clients(&known_clients);
+	pthread_mutex_unlock(&clients_lock);
 	g_idle_add((GSourceFunc)update_user_list, NULL);
+	recv_tables_free();
 }
 
 void app_on_exit(GtkWidget* widget, gpointer data) { gtk_main_quit(); }
@@ -429,103 +1686,169 @@ void show_about(GtkWindow* parent) {
 	gtk_widget_destroy(dialog);
 }
 
-/*
-   [header]
-   [iv]
-   [name_len:uint8_t][name][char[UID_LEN]:uid][encrytpted_len:uint16_t][encrypted_key]
-   ...
-   [ciphertext_len:uint32_t][ciphertext]
-*/
-unsigned char* encrypt_outgoing_message(const char* msg, size_t msg_len, size_t* out_len) {
-	// Generate AES key, encrypt message, encrypt AES key for each client
-	unsigned char aes_key[AES_KEYLEN];
-	unsigned char aes_iv[AES_IVLEN];
-
-	if (!RAND_bytes(aes_key, sizeof(aes_key)) || !RAND_bytes(aes_iv, sizeof(aes_iv))) {
-		fprintf(stderr, "Failed to generate secure random AES key!\n");
-		return NULL;
-	}
-
-	int total_size = 0; // Total buffer size
-	total_size += AES_IVLEN;
-	total_size += sizeof(uint8_t) * known_clients.size; // name_len field
-	total_size += UID_LEN; // UID field
-	total_size += sizeof(uint16_t) * known_clients.size; // encrypted_len field
-	total_size += sizeof(uint32_t); // ciphertext_len field
-
-	// Needs to be dynamicly sized!
-	int ciphertext_len;
-	unsigned char* ciphertext = encrypt_aes((unsigned char*)msg, msg_len, aes_key, aes_iv, &ciphertext_len);
-	total_size += ciphertext_len;
-
-	if (!ciphertext || ciphertext_len <= 0) {
-		fprintf(stderr, "Failed to encrypt message\n");
-		return NULL;
-	}
+// Wraps key for every known client, or only the one with uid if it isn't NULL, and returns everything in front of the
+// ciphertext, with its length in block_len. num_keys receives the number of recipients the key was wrapped for. See
+// parse_key_block for the layout.
+static unsigned char* build_key_block(const unsigned char key[AES_KEYLEN], const unsigned char iv[AES_IVLEN],
+	uint32_t ciphertext_len, size_t* block_len, uint8_t* num_keys, const char uid[UID_LEN]) {
+	// The recipient list must not change between sizing and filling the buffer
+	pthread_mutex_lock(&clients_lock);
 
-	unsigned char* encrypted_keys[known_clients.size];
-	int encrypted_key_lens[known_clients.size];
-	char* client_names[known_clients.size];
-	char* client_uids[known_clients.size];
+	int n = known_clients.size;
+	unsigned char* encrypted_keys[n];
+	int encrypted_key_lens[n];
+	client* clients[n];
 
-	client* cur = known_clients.head;
+	size_t entries_size = 0;
 	int idx = 0;
-	while (cur) {
-		client_names[idx] = cur->name; // Shouldn't we use strcpy?
-		total_size += strlen(cur->name);
-		client_uids[idx] = cur->uid;
+	for (client* cur = known_clients.head; cur && idx < n; cur = cur->next) {
+		if (uid && memcmp(cur->uid, uid, UID_LEN)) continue;
 		encrypted_keys[idx] = malloc(EVP_PKEY_size(cur->pubkey));
-		int elen = encrypt_key_with_rsa(cur->pubkey, aes_key, AES_KEYLEN, encrypted_keys[idx]);
+		int elen = encrypted_keys[idx] ? encrypt_key_with_rsa(cur->pubkey, key, AES_KEYLEN, encrypted_keys[idx]) : -1;
 		if (elen <= 0) {
-			fprintf(stderr, "Failed to encrypt AES keys using RSA of '%s'\n", cur->name), free(encrypted_keys[idx]);
+			fprintf(stderr, "Failed to encrypt AES keys using RSA of '%s'\n", cur->name);
+			free(encrypted_keys[idx]);
+			continue; // Skipped, they won't be able to read this one
 		}
-		total_size += elen;
-
+		clients[idx] = cur;
 		encrypted_key_lens[idx] = elen;
-		cur = cur->next;
+		entries_size += sizeof(uint8_t) + strlen(cur->name) + UID_LEN + sizeof(uint16_t) + elen;
 		idx++;
 	}
+	n = idx;
+
+	uint32_t data_off = KEY_BLOCK_FIXED + n * KEY_SLOT_LEN + entries_size;
+	unsigned char* buf = malloc(data_off);
+	if (buf) {
+		memcpy(buf, iv, AES_IVLEN);
+		memcpy(buf + AES_IVLEN, &ciphertext_len, sizeof(ciphertext_len));
+		memcpy(buf + AES_IVLEN + sizeof(uint32_t), &data_off, sizeof(data_off));
+
+		// Entries go in client order, the index sorted by hash points at them
+		uint32_t slots[n + 1][2]; // n may be 0
+		size_t pos = KEY_BLOCK_FIXED + n * KEY_SLOT_LEN;
+		for (int i = 0; i < n; ++i) {
+			uint32_t slot[2] = {key_slot_hash(clients[i]->uid), pos};
+			int j = i;
+			for (; j > 0 && slots[j - 1][0] > slot[0]; --j)
+				memcpy(slots[j], slots[j - 1], KEY_SLOT_LEN);
+			memcpy(slots[j], slot, KEY_SLOT_LEN);
+
+			uint8_t name_len = strlen(clients[i]->name);
+			memcpy(buf + pos, &name_len, sizeof(name_len));
+			pos += sizeof(name_len);
+			memcpy(buf + pos, clients[i]->name, name_len);
+			pos += name_len;
+			memcpy(buf + pos, clients[i]->uid, UID_LEN);
+			pos += UID_LEN;
+
+			uint16_t eklen = encrypted_key_lens[i];
+			memcpy(buf + pos, &eklen, sizeof(eklen));
+			pos += sizeof(eklen);
+			memcpy(buf + pos, encrypted_keys[i], eklen);
+			pos += eklen;
+		}
+		if (n) memcpy(buf + KEY_BLOCK_FIXED, slots, n * KEY_SLOT_LEN);
+		*block_len = data_off;
+		*num_keys = n;
+	}
+	pthread_mutex_unlock(&clients_lock);
 
-	unsigned char* buf = malloc(total_size * sizeof(unsigned char));
-	int pos = 0;
-
-	memcpy(buf + pos, aes_iv, AES_IVLEN);
-	pos += AES_IVLEN;
-
-	for (int i = 0; i < known_clients.size; ++i) {
-		uint8_t name_len = strlen(client_names[i]);
-		memcpy(buf + pos, &name_len, sizeof(name_len));
-		pos += sizeof(name_len);
-		memcpy(buf + pos, client_names[i], name_len);
-		pos += name_len;
-		memcpy(buf + pos, client_uids[i], UID_LEN);
-		pos += UID_LEN;
+	for (int i = 0; i < n; ++i)
+		free(encrypted_keys[i]);
+	return buf;
+}
 
-		uint16_t eklen = encrypted_key_lens[i];
-		memcpy(buf + pos, &eklen, sizeof(eklen));
-		pos += sizeof(eklen);
-		memcpy(buf + pos, encrypted_keys[i], eklen);
-		pos += eklen;
+// Hands our chain key to the peer with uid, or to every peer if uid is NULL. A stale epoch is replaced first, the new
+// one goes to everyone.
+static void sender_key_send(const char uid[UID_LEN]) {
+	unsigned char chain[AES_KEYLEN];
+	unsigned char iv[AES_IVLEN] = {0}; // Part of the key block, nothing is encrypted under it
+	pthread_mutex_lock(&my_key.lock);
+	if (my_key.stale && sender_key_new()) uid = NULL;
+	uint32_t epoch = htonl(my_key.epoch);
+	memcpy(chain, my_key.chain, AES_KEYLEN);
+	pthread_mutex_unlock(&my_key.lock);
+
+	size_t block_len;
+	uint8_t num_keys = 0;
+	unsigned char* block = build_key_block(chain, iv, 0, &block_len, &num_keys, uid);
+	OPENSSL_cleanse(chain, sizeof(chain));
+	unsigned char* buf = block && num_keys ? malloc(SENDER_KEY_HDR + block_len) : NULL;
+	if (!buf) {
+		free(block);
+		return;
 	}
+	buf[0] = SENDER_KEY_OFFER;
+	memcpy(buf + sizeof(uint8_t), &epoch, sizeof(epoch));
+	memcpy(buf + sizeof(uint8_t) + sizeof(epoch), node.uid, UID_LEN);
+	memcpy(buf + SENDER_KEY_HDR, block, block_len);
+	free(block);
+	tx_send_packet(CL_SENDER_KEY, buf, SENDER_KEY_HDR + block_len, num_keys);
+}
 
-	uint32_t clen = ciphertext_len;
-	memcpy(buf + pos, &clen, sizeof(clen));
-	pos += sizeof(clen);
-	memcpy(buf + pos, ciphertext, clen);
-	pos += clen;
+static void sender_key_request(const char owner[UID_LEN], uint32_t epoch) {
+	unsigned char* buf = malloc(SENDER_KEY_HDR);
+	if (!buf) return;
+	epoch = htonl(epoch);
+	buf[0] = SENDER_KEY_REQUEST;
+	memcpy(buf + sizeof(uint8_t), &epoch, sizeof(epoch));
+	memcpy(buf + sizeof(uint8_t) + sizeof(epoch), owner, UID_LEN);
+	tx_send_packet(CL_SENDER_KEY, buf, SENDER_KEY_HDR, 0);
+}
 
-	free(ciphertext);
-	for (int i = 0; i < known_clients.size; ++i)
-		free(encrypted_keys[i]);
+static void key_offer(void) {
+	size_t pem_len = strlen(node.pubkey_pem) + 1;
+	unsigned char* buf = malloc(KEY_HDR + pem_len);
+	if (!buf) return;
+	buf[0] = KEY_OFFER;
+	memcpy(buf + sizeof(uint8_t), node.uid, UID_LEN);
+	memcpy(buf + KEY_HDR, node.pubkey_pem, pem_len);
+	tx_send_packet(CL_KEY | suite_flag(), buf, KEY_HDR + pem_len, 0);
+}
+
+static void key_request(const char owner[UID_LEN]) {
+	unsigned char* buf = malloc(KEY_HDR);
+	if (!buf) return;
+	buf[0] = KEY_REQUEST;
+	memcpy(buf + sizeof(uint8_t), owner, UID_LEN);
+	tx_send_packet(CL_KEY, buf, KEY_HDR, 0);
+}
 
-	*out_len = pos;
+// Seals msg under our chain key, starting and handing out a new epoch first when one is due. suite receives the AEAD
+// it was sealed with.
+static unsigned char* encrypt_group_message(const char* msg, size_t msg_len, size_t* out_len, aead_suite_e* suite) {
+	unsigned char* buf = malloc(GROUP_HDR + msg_len + AEAD_TAGLEN);
+	if (!buf) return NULL;
+	unsigned char key[AES_KEYLEN], nonce[AEAD_NONCELEN], aad[SENDER_KEY_AADLEN];
+
+	pthread_mutex_lock(&my_key.lock);
+	bool rekeyed = (my_key.stale || my_key.counter >= SENDER_KEY_MESSAGES) && sender_key_new();
+	uint32_t fields[2] = {htonl(my_key.epoch), htonl(++my_key.counter)};
+	int ret = sender_key_derive(my_key.chain, my_key.epoch, my_key.counter, key, nonce);
+	pthread_mutex_unlock(&my_key.lock);
+	// Goes out ahead of the message, receivers park the message if it overtakes the key
+	if (rekeyed) sender_key_send(NULL);
+
+	memcpy(buf, fields, GROUP_HDR);
+	memcpy(aad, node.uid, UID_LEN);
+	memcpy(aad + UID_LEN, fields, GROUP_HDR);
+	*suite = group_suite();
+	if (ret < 0
+		|| aead_seal(*suite, key, nonce, aad, sizeof(aad), (const unsigned char*)msg, msg_len, buf + GROUP_HDR) < 0) {
+		fprintf(stderr, "Failed to encrypt message\n");
+		free(buf);
+		buf = NULL;
+	}
+	OPENSSL_cleanse(key, sizeof(key));
+	*out_len = GROUP_HDR + msg_len + AEAD_TAGLEN;
 	return buf;
 }
 
 // Send button callback
 void send_message(GtkWidget* widget, gpointer data) {
 	const gchar* msg = gtk_entry_get_text(GTK_ENTRY(entry));
-	char* msg_str = g_strdup_printf("You: %s", msg);
+	char* msg_str = chat_line("You: %s", msg);
 	g_idle_add(show_incoming_message, msg_str);
 	if (msg && strlen(msg) > 0) {
 		if (!connected) {
@@ -537,32 +1860,291 @@ void send_message(GtkWidget* widget, gpointer data) {
 		}
 
 		size_t total_len = 0;
-		unsigned char* buf = encrypt_outgoing_message(msg, strlen(msg), &total_len);
-		if (!buf || total_len <= 0) {
+		aead_suite_e suite;
+		unsigned char* buf = encrypt_group_message(msg, strlen(msg), &total_len, &suite);
+		if (!buf) {
 			fprintf(stderr, "Failed to encrypt outgoing message");
 			return;
 		}
 
-		// If gateway, send the message to the other gateways on the gateway_ips.txt list.
-		// Don't spoof the ip source when sending to other gateways
-		if (node.type == N_GATEWAY) {
-			uint16_t id = atomic_fetch_add(&node.id, 1);
-			for (int i = 0; i < num_gw_ips; ++i) {
-				udp_send((const char*)buf, total_len, node.name, node.uid, node.type, id, known_clients.size, gateway_ips[i],
-					DEST_PORT, CL_RELAYED | CL_ENCRYPTED, NULL);
-			}
-			udp_send((const char*)buf, total_len, node.name, node.uid, node.type, id, known_clients.size, broadcast_ip, DEST_PORT,
-				CL_ENCRYPTED, NULL);
+		// If gateway, the message also goes to the other gateways on the gateway_ips.txt list, see tx_record_new
+		// TODO: Use spoofed ip
+		tx_send_packet(CL_ENCRYPTED | CL_GROUP | (suite == AEAD_CHACHA20_POLY1305 ? CL_CHACHA : 0), buf, total_len, 0);
+
+		gtk_entry_set_text(GTK_ENTRY(entry), "");
+	}
+}
+
+// --- File sender ---
+// send_file_dialog only picks the file. A sender thread maps it and wraps a fresh key, then an encrypt thread seals
+// it fragment by fragment into SEND_CHUNK runs while the sender thread transmits the previous ones. The first
+// fragments leave as soon as the key block is ready and memory stays at SEND_SLOTS chunks for any file.
+//
+// Files go out CL_AEAD framed, every fragment is a record receivers can open on its own:
+// [key block, see build_key_block, zero padded to key_frags fragments]
+// [record: frag_size - AEAD_TAGLEN bytes of the file][tag]
+// ...
+// [record: the rest of the file][tag]
+
+#define SEND_CHUNK (1024 * 1024) // Sealed bytes per step, rounded down to whole fragments
+#define SEND_SLOTS 4 // Chunks between the encrypt and the sender thread
+#define SEND_PROGRESS_INTERVAL 200 // in millisecond
+
+typedef struct {
+	unsigned char* data;
+	int first_frag; // Fragments [first_frag, first_frag + count) of the packet
+	int count;
+} send_chunk;
+
+struct file_send {
+	char* path; // From the file chooser, g_free'd
+	char filename[FILENAME_LEN];
+	const unsigned char* map;
+	size_t filesize;
+	unsigned char key[AES_KEYLEN];
+	unsigned char iv[AES_IVLEN];
+	unsigned char* key_block;
+	size_t key_block_len;
+	uint16_t frag_size; // Smallest of all destinations, they all get the same sealed fragments
+	uint8_t key_frags;
+	int total_fragments;
+	size_t payload_len;
+	uint16_t id;
+	uint8_t num_keys;
+	aead_suite_e suite;
+
+	int chunk_frags; // Fragments per chunk, whole FEC blocks
+	send_chunk slots[SEND_SLOTS];
+	sem_t free_slots;
+	sem_t full_slots;
+	atomic_bool abort; // Set by the sender thread, the encrypt thread stops at the next chunk
+	atomic_bool failed; // Set by the encrypt thread on its last chunk
+
+	tx_record* rec; // Destinations and header, owns the file_send once set
+};
+
+gboolean show_send_progress(gpointer data) {
+	gtk_statusbar_pop(GTK_STATUSBAR(statusbar), transfer_context_id);
+	gtk_statusbar_push(GTK_STATUSBAR(statusbar), transfer_context_id, (const char*)data);
+	g_free(data);
+	return FALSE;
+}
+
+// Seals fragment f of the file into out, frag_size bytes. Returns its length, -1 on failure.
+static int file_send_seal(const file_send* fs, int f, unsigned char* out) {
+	if (f < fs->key_frags) { // Key block, zero padded
+		size_t off = (size_t)f * fs->frag_size;
+		size_t len = fs->key_block_len > off ? fs->key_block_len - off : 0;
+		memset(out, 0, fs->frag_size);
+		memcpy(out, fs->key_block + off, len < fs->frag_size ? len : fs->frag_size);
+		return fs->frag_size;
+	}
+	size_t record = fs->frag_size - AEAD_TAGLEN;
+	size_t off = (size_t)(f - fs->key_frags) * record;
+	size_t len = fs->filesize - off < record ? fs->filesize - off : record;
+	unsigned char nonce[AEAD_NONCELEN];
+	unsigned char aad[AEAD_AADLEN];
+	aead_nonce(nonce, fs->iv, fs->id, f);
+	aead_aad(aad, node.uid, fs->id, f, fs->total_fragments, fs->frag_size, fs->key_frags);
+	return aead_seal(fs->suite, fs->key, nonce, aad, sizeof(aad), fs->map + off, len, out);
+}
+
+static void* file_encrypt_thread(void* arg) {
+	file_send* fs = (file_send*)arg;
+	int block = fs->rec->tmpl.fec_data ? fs->rec->tmpl.fec_data : 1;
+
+	for (int frag = 0, i = 0; frag < fs->total_fragments; i = (i + 1) % SEND_SLOTS) {
+		sem_wait(&fs->free_slots);
+		send_chunk* c = &fs->slots[i];
+		c->first_frag = frag;
+		c->count = 0;
+		if (atomic_load(&fs->abort)) goto fail;
+
+		// Chunks end on FEC block boundaries, so every block goes out with its parity
+		int end = frag == 0 ? (fs->key_frags + block - 1) / block * block : frag + fs->chunk_frags;
+		if (end > fs->total_fragments) end = fs->total_fragments;
+		if (frag == 0) { // The key block goes first, only followed by what completes its block
+			memset(c->data, 0, (size_t)fs->key_frags * fs->frag_size);
+			memcpy(c->data, fs->key_block, fs->key_block_len);
+			c->count = fs->key_frags;
+		}
+		for (; frag + c->count < end; c->count++) {
+			if (file_send_seal(fs, frag + c->count, c->data + (size_t)c->count * fs->frag_size) < 0) goto fail;
+		}
+		frag += c->count;
+		sem_post(&fs->full_slots);
+	}
+	return NULL;
+
+fail:
+	atomic_store(&fs->failed, true);
+	sem_post(&fs->full_slots);
+	return NULL;
+}
+
+// Maps the file, wraps a fresh key and works out the fragment layout. Returns an error message for the user,
+// NULL on success.
+static const char* file_send_prepare(file_send* fs) {
+	fs->suite = group_suite();
+	tx_record* rec = tx_record_new(
+		CL_ENCRYPTED | CL_FILE | CL_AEAD | (fs->suite == AEAD_CHACHA20_POLY1305 ? CL_CHACHA : 0));
+	if (!rec) return "out of memory";
+	rec->fs = fs;
+	fs->rec = rec;
+	fs->id = rec->tmpl.id;
+	fs->frag_size = rec->tmpl.frag_size; // They all get the same sealed fragments
+
+	int fd = open(fs->path, O_RDONLY);
+	if (fd < 0) return strerror(errno);
+	struct stat st;
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return "not a regular file";
+	}
+	fs->filesize = st.st_size;
+	if (fs->filesize > 0) {
+		void* map = mmap(NULL, fs->filesize, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (map == MAP_FAILED) return strerror(errno);
+		madvise(map, fs->filesize, MADV_SEQUENTIAL);
+		fs->map = map;
+	} else {
+		close(fd);
+	}
+
+	size_t record = fs->frag_size - AEAD_TAGLEN;
+	size_t records = fs->filesize ? (fs->filesize + record - 1) / record : 1; // An empty file is one empty record
+	if (fs->filesize > UINT32_MAX) return "file too large";
+	if (!RAND_bytes(fs->key, sizeof(fs->key)) || !RAND_bytes(fs->iv, sizeof(fs->iv))) return "no randomness";
+	fs->key_block = build_key_block(fs->key, fs->iv, fs->filesize, &fs->key_block_len, &fs->num_keys, NULL);
+	if (!fs->key_block) return "can't encrypt";
+	size_t key_frags = (fs->key_block_len + fs->frag_size - 1) / fs->frag_size;
+	if (key_frags > UINT8_MAX) return "too many recipients";
+	if (key_frags + records > UINT16_MAX) return "file too large";
+	fs->key_frags = key_frags;
+	fs->total_fragments = key_frags + records;
+	fs->payload_len = key_frags * fs->frag_size + fs->filesize + records * AEAD_TAGLEN;
+	memcpy(rec->tmpl.filename, fs->filename, FILENAME_LEN);
+	rec->tmpl.num_key = fs->num_keys;
+	rec->tmpl.key_frags = fs->key_frags;
+	rec->size = fs->payload_len;
+	rec->total_fragments = fs->total_fragments;
+
+	// Parity fragments are numbered after the data, a file too large for both goes without
+	int block = rec->tmpl.fec_data;
+	if (block && fs->total_fragments + (fs->total_fragments + block - 1) / block * rec->tmpl.fec_parity > UINT16_MAX) {
+		rec->tmpl.fec_data = 0;
+		rec->tmpl.fec_parity = 0;
+	}
+	block = rec->tmpl.fec_data ? rec->tmpl.fec_data : 1;
+	fs->chunk_frags = SEND_CHUNK / fs->frag_size / block * block;
+	if (fs->chunk_frags < block) fs->chunk_frags = block;
+	int first_frags = (key_frags + block - 1) / block * block;
+	int slot_frags = fs->chunk_frags > first_frags ? fs->chunk_frags : first_frags;
+	for (int i = 0; i < SEND_SLOTS; ++i) {
+		fs->slots[i].data = malloc((size_t)slot_frags * fs->frag_size);
+		if (!fs->slots[i].data) return "out of memory";
+	}
+	return NULL;
+}
+
+static void file_send_free(file_send* fs) {
+	for (int i = 0; i < SEND_SLOTS; ++i)
+		free(fs->slots[i].data);
+	free(fs->key_block);
+	OPENSSL_cleanse(fs->key, sizeof(fs->key));
+	if (fs->map) munmap((void*)fs->map, fs->filesize);
+	g_free(fs->path);
+	free(fs);
+}
+
+// Counts file sender threads in and out, the last one out wakes disconnect_from_network
+static void file_sends_add(int n) {
+	pthread_mutex_lock(&file_sends_lock);
+	file_sends += n;
+	if (file_sends == 0) pthread_cond_broadcast(&file_sends_done);
+	pthread_mutex_unlock(&file_sends_lock);
+}
+
+static void* file_send_thread(void* arg) {
+	file_send* fs = (file_send*)arg;
+	struct timespec start, now;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	double last_report = 0;
+
+	const char* err = file_send_prepare(fs);
+	pthread_t encryptor;
+	if (!err) {
+		sem_init(&fs->free_slots, 0, SEND_SLOTS);
+		sem_init(&fs->full_slots, 0, 0);
+		if (pthread_create(&encryptor, NULL, file_encrypt_thread, fs) != 0) err = "can't start the encrypt thread";
+	}
+	if (err) {
+		g_idle_add(show_incoming_message, chat_line("Failed to send %s: %s", fs->filename, err));
+		if (fs->rec) {
+			tx_record_put(fs->rec);
 		} else {
-			// TODO: Use spoofed ip
-			udp_send((const char*)buf, total_len, node.name, node.uid, node.type, atomic_fetch_add(&node.id, 1),
-				known_clients.size, broadcast_ip, DEST_PORT, CL_ENCRYPTED, NULL);
+			file_send_free(fs);
+		}
+		file_sends_add(-1);
+		return NULL;
+	}
+	// NACKs for the first fragments can come in while the rest is still being sent
+	tx_history_add(fs->rec);
+
+	int sent = 0;
+	for (int i = 0;; i = (i + 1) % SEND_SLOTS) {
+		sem_wait(&fs->full_slots);
+		send_chunk* c = &fs->slots[i];
+		if (atomic_load(&fs->failed)) break;
+		if (atomic_load(&file_sends_cancel)) atomic_store(&fs->abort, true); // Drain until the encryptor stops
+		if (!atomic_load(&fs->abort)) {
+			tx_send(fs->rec, c->data, c->first_frag, c->count, 0);
+		}
+		sent = c->first_frag + c->count;
+		sem_post(&fs->free_slots);
+		if (sent == fs->total_fragments) break;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		double elapsed = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+		if ((elapsed - last_report) * 1000 >= SEND_PROGRESS_INTERVAL) {
+			last_report = elapsed;
+			int percent = 100.0 * sent / fs->total_fragments;
+			double rate = (double)sent * fs->frag_size / elapsed / (1024 * 1024);
+			double limit, loss, srtt;
+			rate_ctl_stats(&node.tx.rate, &limit, &loss, &srtt, NULL);
+			g_idle_add(show_send_progress, g_strdup_printf("Sending %s: %d%% (%.1f MB/s, paced at %.1f MB/s, %.1f%% loss)",
+				fs->filename, percent, rate, limit / (1024 * 1024), loss * 100));
 		}
+	}
+	pthread_join(encryptor, NULL);
 
-		gtk_entry_set_text(GTK_ENTRY(entry), "");
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double elapsed = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+	if (atomic_load(&fs->failed) || atomic_load(&fs->abort) || sent != fs->total_fragments) {
+		g_idle_add(show_send_progress, g_strdup_printf("Sending %s stopped", fs->filename));
+	} else {
+		double mb = fs->payload_len / (1024.0 * 1024);
+		g_idle_add(show_send_progress, g_strdup_printf("Sent %s: %.1f MB in %.2f s (%.1f MB/s)", fs->filename, mb,
+			elapsed, elapsed > 0 ? mb / elapsed : 0));
+		g_idle_add(show_incoming_message, chat_line("You: sent file %s", fs->filename));
 	}
+	printf("total len of file: %zu, %zu bytes on the wire per destination\n", fs->filesize, fs->payload_len);
+
+	sem_destroy(&fs->free_slots);
+	sem_destroy(&fs->full_slots);
+	// The file stays mapped in the history for NACKs, the chunks are done with
+	for (int i = 0; i < SEND_SLOTS; ++i) {
+		free(fs->slots[i].data);
+		fs->slots[i].data = NULL;
+	}
+	tx_record_put(fs->rec);
+	file_sends_add(-1);
+	return NULL;
 }
 
+// --- ### ---
+
 void send_file_dialog(GtkWidget* widget, gpointer data) {
 	if (!connected) {
 		GtkWidget* dialog = gtk_message_dialog_new(
@@ -577,60 +2159,26 @@ void send_file_dialog(GtkWidget* widget, gpointer data) {
 		GTK_RESPONSE_CANCEL, "_Open", GTK_RESPONSE_ACCEPT, NULL);
 
 	if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
-		char* filepath;
 		GtkFileChooser* chooser = GTK_FILE_CHOOSER(dialog);
-		filepath = gtk_file_chooser_get_filename(chooser);
-
-		// Read and send file
-		FILE* fp = fopen(filepath, "rb");
-		if (!fp) {
-			fprintf(stderr, "Failed to open file - %s\n", strerror(errno));
-			return;
-		}
-
-		fseek(fp, 0, SEEK_END);
-		size_t filesize = ftell(fp);
-		rewind(fp);
-
-		unsigned char* filebuf = malloc(filesize);
-		if (!filebuf) {
-			fprintf(stderr, "Failed to allocate file buffer\n");
-			fclose(fp);
-			return;
-		}
-		fread(filebuf, 1, filesize, fp);
-		fclose(fp);
-
-		printf("total len of file: %zu\n", filesize);
-
-		const char* filename = strrchr(filepath, '/');
-		filename = filename ? filename + 1 : filepath;
-
-		size_t total_len = 0;
-		unsigned char* buf = encrypt_outgoing_message((char*)filebuf, filesize, &total_len);
-		if (!buf || total_len <= 0) {
-			fprintf(stderr, "Failed to encryprt file\n");
-			g_free(filepath);
-			return;
-		}
-
-		// If gateway, send the message to the other gateways on the gateway_ips.txt list.
-		// Don't spoof the ip source when sending to other gateways
-		if (node.type == N_GATEWAY) {
-			uint16_t id = atomic_fetch_add(&node.id, 1);
-			for (int i = 0; i < num_gw_ips; ++i) {
-				udp_send((const char*)buf, total_len, node.name, node.uid, node.type, id, known_clients.size, gateway_ips[i],
-					DEST_PORT, CL_RELAYED | CL_ENCRYPTED | CL_FILE, filename);
+		file_send* fs = calloc(1, sizeof(file_send));
+		if (fs) {
+			fs->path = gtk_file_chooser_get_filename(chooser);
+			const char* filename = strrchr(fs->path, '/');
+			filename = filename ? filename + 1 : fs->path;
+			strncpy(fs->filename, filename, FILENAME_LEN - 1);
+
+			// Reading, encrypting and sending all happen on the sender thread, the window stays responsive
+			pthread_t thread;
+			file_sends_add(1);
+			if (pthread_create(&thread, NULL, file_send_thread, fs) != 0) {
+				perror("pthread_create");
+				file_sends_add(-1);
+				g_free(fs->path);
+				free(fs);
+			} else {
+				pthread_detach(thread);
 			}
-			udp_send((const char*)buf, total_len, node.name, node.uid, node.type, id, known_clients.size, broadcast_ip, DEST_PORT,
-				CL_ENCRYPTED | CL_FILE, filename);
-		} else {
-			// TODO: Use spoofed ip
-			udp_send((const char*)buf, total_len, node.name, node.uid, node.type, atomic_fetch_add(&node.id, 1),
-				known_clients.size, broadcast_ip, DEST_PORT, CL_ENCRYPTED | CL_FILE, filename);
 		}
-
-		g_free(filepath);
 	}
 	gtk_widget_destroy(dialog);
 }
@@ -697,8 +2245,42 @@ void read_gateway_ips(char* filename) {
 }
 
 int main(int argc, char* argv[]) {
+	// Transport benchmark without the GUI: cylock --bench-send [ip]
+	if (argc > 1 && !strcmp(argv[1], "--bench-send")) {
+		return udp_send_benchmark(argc > 2 ? argv[2] : "127.0.0.1", DEST_PORT + 1, 10 * 1024 * 1024, 3) < 0;
+	}
+	// FEC kernel benchmark: cylock --bench-fec
+	if (argc > 1 && !strcmp(argv[1], "--bench-fec")) return fec_benchmark() < 0;
+	// Cipher and context pool benchmark: cylock --bench-crypto
+	if (argc > 1 && !strcmp(argv[1], "--bench-crypto")) return crypto_benchmark() < 0;
+
 	gtk_init(&argc, &argv);
 
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "--workers") && i + 1 < argc) rx_workers = atoi(argv[++i]);
+		if (!strcmp(argv[i], "--ephemeral")) ephemeral_identity = true;
+		if (!strcmp(argv[i], "--engine") && i + 1 < argc) {
+			recv_engine = strcmp(argv[++i], "uring") ? RECV_BLOCKING : RECV_URING;
+		}
+		if (!strcmp(argv[i], "--fec") && i + 1 < argc) {
+			if (sscanf(argv[++i], "%d:%d", &fec_data, &fec_parity) != 2 || fec_data < 1 || fec_data > FEC_MAX_DATA
+				|| fec_parity < 1 || fec_parity > FEC_MAX_PARITY) {
+				fprintf(stderr, "--fec takes N:K, 1 to %d data and 1 to %d parity fragments per block\n", FEC_MAX_DATA,
+					FEC_MAX_PARITY);
+				return 1;
+			}
+		}
+	}
+
+	if (!ephemeral_identity && identity_path(identity_file) < 0) {
+		fprintf(stderr, "No config directory to keep the identity in, using a new keypair on every connect\n");
+		ephemeral_identity = true;
+	}
+	// Keypairs for --ephemeral connects, or the first one, are generated while the user picks a nickname
+	if ((ephemeral_identity || access(identity_file, F_OK)) && keygen_pool_start() < 0) {
+		fprintf(stderr, "Failed to start the key pool, generating keys on connect\n");
+	}
+
 	// Read known gateway ips from gw_ips.txt
 	read_gateway_ips("gw_ips.txt");
 	if (!get_host_ip_and_broadcast(local_ip, sizeof(local_ip), broadcast_ip, sizeof(broadcast_ip))) {
@@ -812,6 +2394,7 @@ int main(int argc, char* argv[]) {
 	// Statusbar
 	statusbar = gtk_statusbar_new();
 	context_id = gtk_statusbar_get_context_id(GTK_STATUSBAR(statusbar), "status");
+	transfer_context_id = gtk_statusbar_get_context_id(GTK_STATUSBAR(statusbar), "transfer");
 	gtk_statusbar_push(GTK_STATUSBAR(statusbar), context_id, "Disconnected. Mode: Client");
 	gtk_box_pack_start(GTK_BOX(vbox), statusbar, FALSE, FALSE, 0);
 
@@ -819,6 +2402,7 @@ int main(int argc, char* argv[]) {
 	g_idle_add((GSourceFunc)update_user_list, NULL);
 
 	gtk_main();
+	keygen_pool_stop();
 
 	return 0;
 }
@@ -1,39 +1,95 @@
+#define _GNU_SOURCE // fallocate
 #include "utils.h"
+#include "fec.h"
 #include "libspoof.h"
 #include <bits/types.h>
 
 #include <openssl/aes.h>
 #include <openssl/bio.h>
 #include <openssl/evp.h>
+#include <openssl/hmac.h>
 #include <openssl/pem.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#if defined(__aarch64__)
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
 
-// --- ID Cache ---
+// --- Duplicate suppression ---
 
-void cache_add(id_cache* cache, uint32_t e) {
-	if (cache->i >= CACHE_SIZE - 1) // rewind back
-		cache->i = 0;
+int dedup_init(dedup_table* table, int bits, uint32_t ttl) {
+	table->slots = calloc((size_t)1 << bits, sizeof(dedup_entry));
+	if (!table->slots) return -1;
+	table->mask = (1u << bits) - 1;
+	table->ttl = ttl;
+	table->hits = 0;
+	table->misses = 0;
+	table->evictions = 0;
+	return 0;
+}
+
+void dedup_free(dedup_table* table) {
+	free(table->slots);
+	table->slots = NULL;
+}
 
-	cache->cache[cache->i++] = e;
+static uint32_t dedup_hash(const char uid[UID_LEN], uint16_t id, uint16_t frag_num, uint8_t resend) {
+	uint64_t h;
+	memcpy(&h, uid, sizeof(h));
+	h ^= ((uint64_t)resend << 32 | (uint64_t)id << 16 | frag_num) * 0x9E3779B97F4A7C15ull;
+	// splitmix64 finalizer, uids are random but ids and fragment numbers are sequential
+	h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ull;
+	h = (h ^ (h >> 27)) * 0x94D049BB133111EBull;
+	return (uint32_t)(h ^ (h >> 31));
 }
 
-int cache_search(const id_cache* cache, uint32_t e) {
-	for (int i = 0; i < CACHE_SIZE; ++i) {
-		if (cache->cache[i] == e) {
+// Returns 1 if the fragment was seen within ttl, otherwise records it and returns 0. Every resend round of a
+// fragment counts as a new one, so relays pass retransmissions on once more.
+int dedup_check(
+	dedup_table* table, const char uid[UID_LEN], uint16_t id, uint16_t frag_num, uint8_t resend, time_t now) {
+	uint32_t ts = (uint32_t)now;
+	uint32_t pos = dedup_hash(uid, id, frag_num, resend);
+	dedup_entry* free_slot = NULL; // First empty or expired slot
+	dedup_entry* oldest = NULL;
+
+	for (int i = 0; i < DEDUP_MAX_PROBE; ++i) {
+		dedup_entry* e = &table->slots[(pos + i) & table->mask];
+		int live = e->seen && ts - e->seen <= table->ttl;
+		if (live && e->id == id && e->frag_num == frag_num && e->resend == resend && !memcmp(e->uid, uid, UID_LEN)) {
+			e->seen = ts;
+			table->hits++;
 			return 1;
 		}
+		if (!live) {
+			if (!free_slot) free_slot = e;
+			if (!e->seen) break; // Inserts take the first free slot, nothing lives past an empty one
+		} else if (!oldest || e->seen < oldest->seen) {
+			oldest = e;
+		}
 	}
-	return 0;
-}
 
-void cache_clear(id_cache* cache) {
-	memset(cache->cache, 0, CACHE_SIZE * sizeof(uint32_t));
-	cache->i = 0;
+	dedup_entry* victim = free_slot;
+	if (!victim) {
+		victim = oldest;
+		table->evictions++;
+	}
+	memcpy(victim->uid, uid, UID_LEN);
+	victim->id = id;
+	victim->frag_num = frag_num;
+	victim->resend = resend;
+	victim->seen = ts ? ts : 1;
+	table->misses++;
+	return 0;
 }
 
 // --- ### ---
@@ -57,27 +113,19 @@ void add_new_client(
 		// Do not add duplicates
 		return;
 	}
-	struct client* new = (struct client*)malloc(sizeof(struct client));
+	struct client* new = (struct client*)calloc(1, sizeof(struct client));
 	memcpy(new->name, name, NAME_LEN * sizeof(char));
 	memcpy(new->uid, uid, UID_LEN);
 	new->type = type;
 	new->next = NULL;
 	new->prev = NULL;
 	new->last_seen = time(NULL);
-	new->pubkey_pem = pubkey_pem ? strdup(pubkey_pem) : NULL;
+	new->pubkey_pem = NULL;
 	new->pubkey = NULL;
 
-	if (pubkey_pem) {
-		BIO* mem = BIO_new_mem_buf(pubkey_pem, -1);
-		if (mem) {
-			new->pubkey = PEM_read_bio_PUBKEY(mem, NULL, NULL, NULL);
-			BIO_free(mem);
-		}
-		if (!new->pubkey) {
-			free(new->pubkey_pem);
-			free(new);
-			return;
-		}
+	if (pubkey_pem && !client_set_key(new, pubkey_pem)) {
+		free(new);
+		return;
 	}
 
 	clients->size++;
@@ -102,6 +150,24 @@ client* find_client(ll_clients* clients, const char name[NAME_LEN], const char u
 	return NULL;
 }
 
+// Sets the public key of c and its fingerprint. Returns 0 and keeps the old key if pubkey_pem doesn't parse.
+int client_set_key(client* c, const char* pubkey_pem) {
+	char* pem = strdup(pubkey_pem);
+	EVP_PKEY* pubkey = pem ? peer_pubkey_from_pem(pem) : NULL;
+	unsigned char fpr[KEY_FPR_LEN];
+	if (!pubkey || !key_fingerprint(pubkey, fpr)) {
+		EVP_PKEY_free(pubkey);
+		free(pem);
+		return 0;
+	}
+	if (c->pubkey) EVP_PKEY_free(c->pubkey);
+	free(c->pubkey_pem);
+	c->pubkey = pubkey;
+	c->pubkey_pem = pem;
+	memcpy(c->fingerprint, fpr, KEY_FPR_LEN);
+	return 1;
+}
+
 void remove_client(ll_clients* clients, const char name[NAME_LEN], const char uid[UID_LEN]) {
 	struct client* head = clients->head;
 	while (head) {
@@ -119,6 +185,7 @@ void remove_client(ll_clients* clients, const char name[NAME_LEN], const char ui
 
 			if (head->pubkey) EVP_PKEY_free(head->pubkey);
 			if (head->pubkey_pem) free(head->pubkey_pem);
+			OPENSSL_cleanse(head->keys, sizeof(head->keys));
 			free(head);
 
 			clients->size--;
@@ -136,6 +203,7 @@ void clear_clients(ll_clients* clients) {
 
 		if (curr->pubkey) EVP_PKEY_free(curr->pubkey);
 		if (curr->pubkey_pem) free(curr->pubkey_pem);
+		OPENSSL_cleanse(curr->keys, sizeof(curr->keys));
 		free(curr);
 
 		curr = next;
@@ -147,248 +215,1364 @@ void clear_clients(ll_clients* clients) {
 
 // --- ### ---
 
-// --- Timer events ---
+// --- Work queue ---
+
+int mpmc_init(mpmc_ring* ring, size_t capacity) {
+	if (capacity < 2 || (capacity & (capacity - 1))) return -1;
+	ring->cells = malloc(capacity * sizeof(mpmc_cell));
+	if (!ring->cells) return -1;
+	for (size_t i = 0; i < capacity; ++i) {
+		atomic_init(&ring->cells[i].seq, i);
+	}
+	ring->mask = capacity - 1;
+	atomic_init(&ring->enqueue_pos, 0);
+	atomic_init(&ring->dequeue_pos, 0);
+	return 0;
+}
+
+void mpmc_free(mpmc_ring* ring) {
+	free(ring->cells);
+	ring->cells = NULL;
+}
+
+// Returns -1 if the ring is full
+int mpmc_push(mpmc_ring* ring, void* data) {
+	size_t pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+	for (;;) {
+		mpmc_cell* cell = &ring->cells[pos & ring->mask];
+		size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+		intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+		if (dif == 0) {
+			if (atomic_compare_exchange_weak_explicit(
+					&ring->enqueue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+				cell->data = data;
+				atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+				return 0;
+			}
+		} else if (dif < 0) {
+			return -1; // The consumer hasn't freed this cell yet
+		} else {
+			pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+		}
+	}
+}
+
+// Returns NULL if the ring is empty
+void* mpmc_pop(mpmc_ring* ring) {
+	size_t pos = atomic_load_explicit(&ring->dequeue_pos, memory_order_relaxed);
+	for (;;) {
+		mpmc_cell* cell = &ring->cells[pos & ring->mask];
+		size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+		intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+		if (dif == 0) {
+			if (atomic_compare_exchange_weak_explicit(
+					&ring->dequeue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+				void* data = cell->data;
+				atomic_store_explicit(&cell->seq, pos + ring->mask + 1, memory_order_release);
+				return data;
+			}
+		} else if (dif < 0) {
+			return NULL;
+		} else {
+			pos = atomic_load_explicit(&ring->dequeue_pos, memory_order_relaxed);
+		}
+	}
+}
+
+static void* work_pool_thread(void* arg) {
+	work_lane* lane = (work_lane*)arg;
+	work_pool* pool = lane->pool;
+	for (;;) {
+		if (sem_wait(&lane->pending) < 0) continue; // EINTR
+		void* job;
+		// Every post while running has a job behind it, an empty pop only means its push is still being published
+		while (!(job = mpmc_pop(&lane->ring))) {
+			if (!atomic_load(&pool->running)) return NULL;
+			sched_yield();
+		}
+		pool->handler(job);
+		thread_arena_reset();
+		atomic_fetch_add(&pool->completed, 1);
+	}
+}
+
+// Drains what is left in the lanes of the first n workers, joined already, and frees them
+static void work_pool_free(work_pool* pool, int n) {
+	for (int i = 0; i < n; ++i) {
+		work_lane* lane = &pool->lanes[i];
+		void* job;
+		while ((job = mpmc_pop(&lane->ring))) { // Workers only exit on an empty lane, this is just a safety net
+			pool->handler(job);
+			atomic_fetch_add(&pool->completed, 1);
+		}
+		sem_destroy(&lane->pending);
+		mpmc_free(&lane->ring);
+	}
+	free(pool->lanes);
+	pool->lanes = NULL;
+	pool->num_workers = 0;
+}
+
+// capacity is shared out among the lanes
+int work_pool_start(work_pool* pool, int num_workers, size_t capacity, void (*handler)(void*)) {
+	if (num_workers < 1) num_workers = 1;
+	size_t lane_capacity = 64;
+	while (lane_capacity * num_workers < capacity)
+		lane_capacity *= 2;
+	pool->lanes = calloc(num_workers, sizeof(work_lane));
+	if (!pool->lanes) return -1;
+	pool->handler = handler;
+	atomic_store(&pool->running, true);
+	atomic_store(&pool->submitted, 0);
+	atomic_store(&pool->completed, 0);
+	atomic_store(&pool->stalls, 0);
+	atomic_store(&pool->high_water, 0);
+
+	pool->num_workers = 0;
+	for (int i = 0; i < num_workers; ++i) {
+		work_lane* lane = &pool->lanes[i];
+		lane->pool = pool;
+		if (mpmc_init(&lane->ring, lane_capacity) < 0) break;
+		if (sem_init(&lane->pending, 0, 0) < 0) {
+			mpmc_free(&lane->ring);
+			break;
+		}
+		if (pthread_create(&lane->thread, NULL, work_pool_thread, lane) != 0) {
+			perror("pthread_create");
+			sem_destroy(&lane->pending);
+			mpmc_free(&lane->ring);
+			break;
+		}
+		pool->num_workers++;
+	}
+	if (pool->num_workers == 0) {
+		work_pool_free(pool, 0);
+		return -1;
+	}
+	return 0;
+}
+
+// Jobs with the same key run one after the other, in the order submitted. When the lane is full the caller waits
+// for its worker, so the kernel socket buffer absorbs the burst; running the job itself would overtake the queue.
+void work_pool_submit(work_pool* pool, uint32_t key, void* job) {
+	work_lane* lane = &pool->lanes[key % pool->num_workers];
+	atomic_fetch_add(&pool->submitted, 1);
+	if (mpmc_push(&lane->ring, job) < 0) {
+		atomic_fetch_add(&pool->stalls, 1);
+		while (mpmc_push(&lane->ring, job) < 0)
+			sched_yield();
+	}
+	sem_post(&lane->pending);
+
+	size_t depth = atomic_load_explicit(&lane->ring.enqueue_pos, memory_order_relaxed)
+		- atomic_load_explicit(&lane->ring.dequeue_pos, memory_order_relaxed);
+	unsigned long hw = atomic_load_explicit(&pool->high_water, memory_order_relaxed);
+	while (depth > hw && !atomic_compare_exchange_weak(&pool->high_water, &hw, depth)) {
+	}
+}
+
+// Producers must be stopped first, queued jobs are drained before the workers exit
+void work_pool_stop(work_pool* pool) {
+	if (!pool->lanes) return;
+	atomic_store(&pool->running, false);
+	for (int i = 0; i < pool->num_workers; ++i) {
+		sem_post(&pool->lanes[i].pending);
+	}
+	for (int i = 0; i < pool->num_workers; ++i) {
+		pthread_join(pool->lanes[i].thread, NULL);
+	}
+	work_pool_free(pool, pool->num_workers);
+}
+
+// --- ### ---
+
+// --- Buffer pool ---
+
+#define POOL_CLASSES (POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+#define POOL_PREFIX 16 // Keeps the class in front of the buffer without breaking alignment
+
+typedef struct pool_buf {
+	struct pool_buf* next;
+} pool_buf;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pool_buf* pool_free[POOL_CLASSES];
+static size_t pool_cached;
+
+static int pool_class(size_t size) {
+	int c = 0;
+	while (c < POOL_CLASSES - 1 && ((size_t)1 << (POOL_MIN_SHIFT + c)) < size)
+		c++;
+	return ((size_t)1 << (POOL_MIN_SHIFT + c)) < size ? -1 : c;
+}
+
+// Returns a buffer of at least size bytes, NULL if size is beyond the largest class.
+void* buf_pool_get(size_t size) {
+	int c = pool_class(size);
+	if (c < 0) return NULL;
+
+	pthread_mutex_lock(&pool_lock);
+	pool_buf* buf = pool_free[c];
+	if (buf) {
+		pool_free[c] = buf->next;
+		pool_cached -= (size_t)1 << (POOL_MIN_SHIFT + c);
+	}
+	pthread_mutex_unlock(&pool_lock);
+
+	unsigned char* raw = (unsigned char*)buf;
+	if (!raw) {
+		raw = malloc(POOL_PREFIX + ((size_t)1 << (POOL_MIN_SHIFT + c)));
+		if (!raw) return NULL;
+		raw = raw + POOL_PREFIX;
+	}
+	raw[-1] = c;
+	return raw;
+}
+
+// Bytes buf_pool_get(size) really takes, 0 if size is beyond the largest class
+size_t buf_pool_size(size_t size) {
+	int c = pool_class(size);
+	return c < 0 ? 0 : (size_t)1 << (POOL_MIN_SHIFT + c);
+}
+
+void buf_pool_put(void* buf) {
+	if (!buf) return;
+	unsigned char* raw = buf;
+	int c = raw[-1];
+	size_t bytes = (size_t)1 << (POOL_MIN_SHIFT + c);
+
+	pthread_mutex_lock(&pool_lock);
+	if (pool_cached + bytes <= POOL_CACHE_BYTES) {
+		pool_buf* p = buf;
+		p->next = pool_free[c];
+		pool_free[c] = p;
+		pool_cached += bytes;
+		buf = NULL;
+	}
+	pthread_mutex_unlock(&pool_lock);
+
+	if (buf) free(raw - POOL_PREFIX);
+}
+
+// --- ### ---
+
+// --- Arena ---
 
-// Initiates and starts a new timer event.
-// TODO: Add cleanup functions.
-timer_event* new_timer_event(unsigned int u_delay, unsigned int count, void* (*handler)(void*), void* handler_arg) {
-	timer_event* event = (timer_event*)malloc(sizeof(timer_event));
-	event->u_delay = u_delay;
-	event->count = count;
-	event->handler = handler;
-	event->handler_arg = handler_arg;
+static pthread_key_t arena_key;
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
 
-	if (pthread_create(&event->thread, NULL, timer_thread, event) != 0) {
-		free(event);
+static void arena_destroy(void* arg) {
+	arena_t* arena = arg;
+	arena_reset(arena);
+	free(arena->base);
+	free(arena);
+}
+
+static void arena_key_init(void) { pthread_key_create(&arena_key, arena_destroy); }
+
+// The calling thread's arena, freed when the thread exits. NULL if it can't be allocated.
+arena_t* thread_arena(void) {
+	pthread_once(&arena_once, arena_key_init);
+	arena_t* arena = pthread_getspecific(arena_key);
+	if (arena) return arena;
+	arena = calloc(1, sizeof(arena_t));
+	if (!arena) return NULL;
+	arena->base = malloc(ARENA_SIZE);
+	if (!arena->base) {
+		free(arena);
 		return NULL;
 	}
+	arena->size = ARENA_SIZE;
+	pthread_setspecific(arena_key, arena);
+	return arena;
+}
+
+// ARENA_ALIGN aligned, NULL if arena is NULL or memory ran out
+void* arena_alloc(arena_t* arena, size_t size) {
+	if (!arena) return NULL;
+	size_t off = (arena->used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	if (off + size <= arena->size) {
+		arena->used = off + size;
+		if (arena->used > arena->high_water) arena->high_water = arena->used;
+		return arena->base + off;
+	}
+	unsigned char* buf = buf_pool_get(ARENA_ALIGN + size);
+	if (!buf) return NULL;
+	*(void**)buf = arena->spill;
+	arena->spill = buf;
+	arena->spills++;
+	return buf + ARENA_ALIGN;
+}
 
-	return event;
+void arena_reset(arena_t* arena) {
+	arena->used = 0;
+	while (arena->spill) {
+		void* next = *(void**)arena->spill;
+		buf_pool_put(arena->spill);
+		arena->spill = next;
+	}
 }
 
-void timer_event_stop(timer_event* event) {
-	pthread_cancel(event->thread);
-	pthread_join(event->thread, NULL);
-	free(event);
+// Only resets an arena the thread already has
+void thread_arena_reset(void) {
+	pthread_once(&arena_once, arena_key_init);
+	arena_t* arena = pthread_getspecific(arena_key);
+	if (arena) arena_reset(arena);
 }
 
-void* timer_thread(void* arg) {
-	timer_event* event = (timer_event*)arg;
-	if (event->count == 0) {
-		while (1) {
-			pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-			event->handler(event->handler_arg);
-			pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-			usleep(event->u_delay);
+// --- ### ---
+
+// --- File streams ---
+
+// A stream of total_fragments * frag_size bytes for path, see file_stream_create. Returns NULL without memory.
+file_stream* file_stream_open(const char* path, uint16_t total_fragments, uint16_t frag_size) {
+	file_stream* stream = calloc(1, sizeof(file_stream));
+	if (!stream) return NULL;
+	strncpy(stream->path, path, FILENAME_LEN);
+	snprintf(stream->part, sizeof(stream->part), "%.*s.part", FILENAME_LEN, path);
+
+	stream->fd = -1;
+	pthread_mutex_init(&stream->lock, NULL);
+	atomic_init(&stream->refs, 1);
+	stream->frag_size = frag_size;
+	stream->total_fragments = total_fragments;
+	return stream;
+}
+
+// Creates the .part file with room for the whole packet. An existing one is never truncated, it belongs to another
+// transfer of the same name, or this one came in again after it was done. Returns -1 if it can't be created.
+int file_stream_create(file_stream* stream) {
+	char name[FILENAME_LEN + 1];
+	snprintf(name, sizeof(name), "%.*s", FILENAME_LEN, stream->path);
+	for (int i = 1;; ++i) {
+		stream->fd = open(stream->part, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644);
+		if (stream->fd >= 0 || errno != EEXIST || i == STREAM_RENAMES) break;
+		snprintf(stream->part, sizeof(stream->part), "%s.%d.part", name, i);
+	}
+	if (stream->fd < 0) {
+		fprintf(stderr, "Failed to open '%s' for writing - %s\n", stream->part, strerror(errno));
+		return -1;
+	}
+	// Reserve the blocks up front so out of order writes don't fragment the file, it is trimmed once done.
+	// Filesystems without fallocate get a sparse file instead.
+	off_t cap = (off_t)stream->total_fragments * stream->frag_size;
+	if (fallocate(stream->fd, 0, 0, cap) < 0 && ftruncate(stream->fd, cap) < 0) {
+		fprintf(stderr, "Failed to size '%s' - %s\n", stream->part, strerror(errno));
+		close(stream->fd);
+		unlink(stream->part);
+		stream->fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+int file_stream_write(file_stream* stream, uint16_t frag_num, const unsigned char* data, size_t size) {
+	off_t off = (off_t)frag_num * stream->frag_size;
+	while (size > 0) {
+		ssize_t n = pwrite(stream->fd, data, size, off);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			perror("pwrite");
+			return -1;
 		}
-	} else {
-		while (event->count > 0) {
-			event->handler(event->handler_arg);
-			event->count--;
-			usleep(event->u_delay);
+		data += n;
+		size -= n;
+		off += n;
+	}
+	return 0;
+}
+
+// Trims the file to length and moves it to its final name. An existing file is never replaced, the name gets a
+// number instead and stream->path says which one. Call with the lock held.
+int file_stream_finish(file_stream* stream, size_t length) {
+	char name[FILENAME_LEN + 1];
+	snprintf(name, sizeof(name), "%.*s", FILENAME_LEN, stream->path);
+	int ret = ftruncate(stream->fd, length);
+	for (int i = 1; ret == 0; ++i) {
+		ret = renameat2(AT_FDCWD, stream->part, AT_FDCWD, stream->path, RENAME_NOREPLACE);
+		if (ret == 0 || errno != EEXIST || i == STREAM_RENAMES) break;
+		snprintf(stream->path, sizeof(stream->path), "%s.%d", name, i);
+		ret = 0;
+	}
+	if (ret < 0) {
+		fprintf(stderr, "Failed to finish '%s' - %s\n", stream->path, strerror(errno));
+		return -1;
+	}
+	stream->done = true;
+	return 0;
+}
+
+void file_stream_get(file_stream* stream) { atomic_fetch_add(&stream->refs, 1); }
+
+void file_stream_put(file_stream* stream) {
+	if (atomic_fetch_sub(&stream->refs, 1) != 1) return;
+
+	if (!stream->done && stream->fd >= 0) { // Never finished, don't leave half a file behind
+		fprintf(stderr, "Dropping incomplete transfer '%s'\n", stream->path);
+		unlink(stream->part);
+	}
+	while (stream->pending) {
+		sealed_frag* f = stream->pending;
+		stream->pending = f->next;
+		buf_pool_put(f->data);
+		free(f);
+	}
+	OPENSSL_cleanse(stream->key, sizeof(stream->key));
+	if (stream->cipher) EVP_CIPHER_CTX_free(stream->cipher);
+	if (stream->fd >= 0) close(stream->fd);
+	pthread_mutex_destroy(&stream->lock);
+	free(stream);
+}
+
+// --- ### ---
+
+// --- Fragment reassembly ---
+
+// Bytes reserved by every table together, the budget is global across shards
+static atomic_size_t reasm_total;
+
+int reasm_init(reasm_table* table, size_t budget, int timeout) {
+	memset(table, 0, sizeof(reasm_table));
+	table->entries = calloc(REASM_MAX_PACKETS, sizeof(reasm_entry));
+	if (!table->entries) return -1;
+	for (int i = 0; i < REASM_MAX_PACKETS; ++i) {
+		table->entries[i].hnext = table->free_list;
+		table->free_list = &table->entries[i];
+	}
+	table->lru.lru_next = &table->lru;
+	table->lru.lru_prev = &table->lru;
+	table->budget = budget;
+	table->timeout = timeout;
+	return 0;
+}
+
+static uint32_t reasm_bucket(const char uid[UID_LEN], uint16_t id) {
+	uint64_t h;
+	memcpy(&h, uid, sizeof(h));
+	h = (h ^ id) * 0x9E3779B97F4A7C15ull;
+	return (uint32_t)(h >> 32) % REASM_BUCKETS;
+}
+
+static void lru_unlink(reasm_entry* e) {
+	e->lru_prev->lru_next = e->lru_next;
+	e->lru_next->lru_prev = e->lru_prev;
+}
+
+static void lru_push_front(reasm_table* table, reasm_entry* e) {
+	e->lru_prev = &table->lru;
+	e->lru_next = table->lru.lru_next;
+	table->lru.lru_next->lru_prev = e;
+	table->lru.lru_next = e;
+}
+
+// Takes e out of the table. The buffer is returned to the pool, or the stream reference dropped, unless
+// keep is set.
+static void reasm_release(reasm_table* table, reasm_entry* e, int keep) {
+	reasm_entry** link = &table->buckets[reasm_bucket(e->uid, e->id)];
+	while (*link != e)
+		link = &(*link)->hnext;
+	*link = e->hnext;
+	lru_unlink(e);
+
+	if (e->stream && !keep) {
+		atomic_store(&e->stream->aborted, true);
+		file_stream_put(e->stream);
+	}
+	if (!keep) buf_pool_put(e->head);
+	free(e->bitmap);
+	table->in_use -= e->cap;
+	atomic_fetch_sub(&reasm_total, e->cap);
+	e->head = NULL;
+	e->stream = NULL;
+	e->bitmap = NULL;
+	e->hnext = table->free_list;
+	table->free_list = e;
+}
+
+void reasm_free(reasm_table* table) {
+	if (!table->entries) return;
+	while (table->lru.lru_prev != &table->lru) {
+		reasm_release(table, table->lru.lru_prev, 0);
+	}
+	free(table->entries);
+	table->entries = NULL;
+}
+
+// Fragments are variable sized, never trust the header to index our buffer. Only the last one may be short.
+static int reasm_valid(uint16_t frag_num, uint16_t total_fragments, uint16_t frag_size, size_t size) {
+	return frag_size > 0 && frag_size <= MAX_FRAGMENT && frag_num < total_fragments && size <= frag_size
+		&& (frag_num == total_fragments - 1 || size == frag_size);
+}
+
+// Remembers (uid, id) as complete until timeout, taking the oldest slot of its probe sequence
+static void reasm_bury(reasm_table* table, const char uid[UID_LEN], uint16_t id, time_t now) {
+	uint32_t pos = reasm_bucket(uid, id);
+	reasm_done_t* victim = NULL;
+	for (int i = 0; i < REASM_DONE_PROBE; ++i) {
+		reasm_done_t* d = &table->done[(pos + i) % REASM_DONE];
+		if (!victim || d->when < victim->when) victim = d;
+	}
+	memcpy(victim->uid, uid, UID_LEN);
+	victim->id = id;
+	victim->when = now ? now : 1;
+}
+
+static int reasm_is_done(reasm_table* table, const char uid[UID_LEN], uint16_t id, time_t now) {
+	uint32_t pos = reasm_bucket(uid, id);
+	for (int i = 0; i < REASM_DONE_PROBE; ++i) {
+		reasm_done_t* d = &table->done[(pos + i) % REASM_DONE];
+		if (d->when && now - d->when <= table->timeout && d->id == id && !memcmp(d->uid, uid, UID_LEN)) return 1;
+	}
+	return 0;
+}
+
+// Drops packets stalled longer than timeout, their missing fragments aren't coming any more. They sit at the
+// tail. Run it on the table's shard.
+void reasm_expire(reasm_table* table, time_t now) {
+	while (table->lru.lru_prev != &table->lru && now - table->lru.lru_prev->last_update > table->timeout) {
+		table->timeouts++;
+		reasm_release(table, table->lru.lru_prev, 0);
+	}
+}
+
+// Looks up (uid, id) after dropping stalled packets
+static reasm_entry* reasm_find(reasm_table* table, const char uid[UID_LEN], uint16_t id, time_t now) {
+	reasm_expire(table, now);
+
+	reasm_entry* e = table->buckets[reasm_bucket(uid, id)];
+	while (e && (e->id != id || memcmp(e->uid, uid, UID_LEN)))
+		e = e->hnext;
+	return e;
+}
+
+// Takes an entry for a new packet reserving cap bytes of the budget. Makes room by dropping the packets that
+// made the least progress lately. Only our own, other shards make room for themselves, and if what is left is
+// theirs the new packet has to go. Returns NULL then.
+static reasm_entry* reasm_insert(reasm_table* table, const char uid[UID_LEN], uint16_t id, uint16_t total_fragments,
+	uint16_t frag_size, size_t cap, time_t now) {
+	while (table->lru.lru_prev != &table->lru
+		&& (atomic_load(&reasm_total) + cap > table->budget || !table->free_list)) {
+		table->evictions++;
+		reasm_release(table, table->lru.lru_prev, 0);
+	}
+	if (atomic_load(&reasm_total) + cap > table->budget) return NULL;
+
+	uint64_t* bitmap = calloc((total_fragments + 63) / 64, sizeof(uint64_t));
+	if (!bitmap) return NULL;
+
+	reasm_entry* e = table->free_list;
+	table->free_list = e->hnext;
+	memcpy(e->uid, uid, UID_LEN);
+	e->id = id;
+	e->frag_size = frag_size;
+	e->total_fragments = total_fragments;
+	e->frag_received = 0;
+	e->size = 0;
+	e->cap = cap;
+	e->last_update = now;
+	e->last_ms = monotonic_ms();
+	e->nack_after = 0;
+	e->nacks = 0;
+	e->stamp = 0;
+	e->highest = 0;
+	e->reported = 0;
+	e->head = NULL;
+	e->stream = NULL;
+	e->bitmap = bitmap;
+
+	uint32_t bucket = reasm_bucket(uid, id);
+	e->hnext = table->buckets[bucket];
+	table->buckets[bucket] = e;
+	table->in_use += cap;
+	atomic_fetch_add(&reasm_total, cap);
+	lru_push_front(table, e);
+	return e;
+}
+
+// Checks a fragment against its packet and marks it received. Returns 1 if it is new, 0 for a duplicate
+// and -1 if it doesn't belong to the packet.
+static int reasm_mark(reasm_table* table, reasm_entry* e, uint16_t frag_num, uint16_t total_fragments,
+	uint16_t frag_size, size_t size, time_t now, uint32_t stamp) {
+	if (e->frag_size != frag_size || e->total_fragments != total_fragments) {
+		table->rejected++;
+		return -1;
+	}
+	if (e->bitmap[frag_num / 64] & (1ull << (frag_num % 64))) {
+		table->duplicates++;
+		return 0;
+	}
+	e->bitmap[frag_num / 64] |= 1ull << (frag_num % 64);
+	e->frag_received++;
+	e->size += size;
+	e->last_update = now;
+	e->last_ms = monotonic_ms();
+	e->stamp = stamp;
+	if (frag_num > e->highest) e->highest = frag_num;
+	lru_unlink(e);
+	lru_push_front(table, e);
+	return 1;
+}
+
+// Adds one fragment. Returns 1 once the packet is complete, *out then owns the assembled payload of *out_len
+// bytes and must go back through buf_pool_put. Returns 0 while fragments are missing or for a duplicate,
+// -1 if the fragment doesn't fit the packet or there is no memory for it.
+int reasm_add(reasm_table* table, const char uid[UID_LEN], uint16_t id, uint16_t frag_num, uint16_t total_fragments,
+	uint16_t frag_size, const unsigned char* data, size_t size, time_t now, uint32_t stamp, unsigned char** out,
+	size_t* out_len) {
+	if (!reasm_valid(frag_num, total_fragments, frag_size, size)) {
+		table->rejected++;
+		return -1;
+	}
+
+	reasm_entry* e = reasm_find(table, uid, id, now);
+	if (!e && reasm_is_done(table, uid, id, now)) { // Late, or resent for someone else
+		table->duplicates++;
+		return 0;
+	}
+	if (!e) {
+		size_t len = (size_t)total_fragments * frag_size;
+		size_t cap = buf_pool_size(len);
+		unsigned char* head = cap && cap <= table->budget ? buf_pool_get(len) : NULL;
+		if (!head || !(e = reasm_insert(table, uid, id, total_fragments, frag_size, cap, now))) {
+			buf_pool_put(head);
+			table->rejected++;
+			return -1;
 		}
+		e->head = head;
 	}
-	return NULL;
+
+	int ret = reasm_mark(table, e, frag_num, total_fragments, frag_size, size, now, stamp);
+	if (ret <= 0) return ret;
+	memcpy(e->head + (size_t)frag_size * frag_num, data, size); // Put new fragment to its place
+
+	if (e->frag_received < e->total_fragments) return 0;
+
+	*out = e->head;
+	*out_len = e->size;
+	table->completed++;
+	reasm_bury(table, e->uid, e->id, now);
+	reasm_release(table, e, 1);
+	return 1;
 }
 
-// --- Fragment Handling ---
+// Like reasm_add, but the packet is written to path as it arrives and only its bitmap is kept in memory,
+// nothing is charged to the budget. The file is created with fragment 0, see reasm_drop. Whenever the
+// contiguous prefix on disk grew by STREAM_CHUNK, or the packet is complete, *out is set to the stream
+// with a reference for the caller to process it. Returns 1 once the packet is complete.
+int reasm_add_stream(reasm_table* table, const char uid[UID_LEN], uint16_t id, uint16_t frag_num,
+	uint16_t total_fragments, uint16_t frag_size, const unsigned char* data, size_t size, time_t now, uint32_t stamp,
+	const char* path, file_stream** out) {
+	*out = NULL;
+	if (!reasm_valid(frag_num, total_fragments, frag_size, size)) {
+		table->rejected++;
+		return -1;
+	}
 
-fragment* new_fragment(
-	fragments* fragments, const unsigned char* frag_head, uint16_t id, int frag_num, int total_fragments, int size) {
-	// Search the fragments for id
-	fragment* frag = NULL;
-	for (int i = 0; i < fragments->size; ++i) {
-		if (fragments->fragments[i]->id == id) {
-			frag = fragments->fragments[i];
-			break;
+	reasm_entry* e = reasm_find(table, uid, id, now);
+	if (!e && reasm_is_done(table, uid, id, now)) { // Late, or resent for someone else
+		table->duplicates++;
+		return 0;
+	}
+	if (!e) {
+		file_stream* stream = file_stream_open(path, total_fragments, frag_size);
+		if (!stream) {
+			table->rejected++;
+			return -1;
+		}
+		if (!(e = reasm_insert(table, uid, id, total_fragments, frag_size, 0, now))) {
+			atomic_store(&stream->aborted, true);
+			file_stream_put(stream);
+			table->rejected++;
+			return -1;
 		}
+		e->stream = stream;
+	}
+	if (!e->stream) { // Same packet already reassembling in memory
+		table->rejected++;
+		return -1;
+	}
+	file_stream* stream = e->stream;
+	// The caller passes fragment 0 on only if its key block may be for us, the file is created for it. Fragments
+	// ahead of it are left for a NACK.
+	if (stream->fd < 0 && frag_num != 0) return 0;
+	if (stream->fd < 0 && (e->frag_size != frag_size || file_stream_create(stream) < 0)) {
+		reasm_release(table, e, 0);
+		table->rejected++;
+		return -1;
 	}
 
-	// initialize a new fragment
-	// TODO: What happens same fragment arrives multiple times???
-	if (!frag) {
-		frag = malloc(sizeof(fragment));
-		frag->id = id;
-		frag->frag_received = 0;
-		frag->size = 0;
-		frag->head = malloc(total_fragments * MAX_FRAGMENT); // max size of our assembled fragments
-		fragments->fragments[fragments->size++] = frag;
-		memset(frag->head, 0, total_fragments * MAX_FRAGMENT);
+	int ret = reasm_mark(table, e, frag_num, total_fragments, frag_size, size, now, stamp);
+	if (ret <= 0) return ret;
+	if (file_stream_write(stream, frag_num, data, size) < 0) {
+		reasm_release(table, e, 0);
+		return -1;
 	}
 
-    // We already placed this
-    if (!memcmp(frag->head+MAX_FRAGMENT*frag_num, frag_head, size)){
-        return NULL;
-    }
-    printf("new_fragment:\n");
-    printf("    frag: %d\n", frag_num);
+	unsigned int contiguous = atomic_load(&stream->contiguous);
+	while (contiguous < total_fragments && e->bitmap[contiguous / 64] & (1ull << (contiguous % 64)))
+		contiguous++;
+	atomic_store(&stream->contiguous, contiguous);
 
-	memcpy(frag->head + MAX_FRAGMENT * frag_num, frag_head, size); // Put new fragment to its place
-	frag->frag_received += 1;
-	frag->size += size;
-	// printf("    frag received: %d\n    total frag: %d\n", frag->frag_received, total_fragments);
-	if (frag->frag_received == total_fragments) { // We received all the fragments
-		unsigned char* head = frag->head;
-		fragments->size--;
-		return frag; // Caller should free the fragment and frag.head
+	if (e->frag_received == e->total_fragments) {
+		atomic_store(&stream->length, e->size);
+		*out = stream; // The table's reference goes to the caller
+		table->completed++;
+		reasm_bury(table, e->uid, e->id, now);
+		reasm_release(table, e, 1);
+		return 1;
 	}
+	if ((size_t)(contiguous - stream->kicked) * frag_size >= STREAM_CHUNK) {
+		stream->kicked = contiguous;
+		file_stream_get(stream);
+		*out = stream;
+	}
+	return 0;
+}
 
-	return NULL;
+// Like reasm_add_stream for sealed (CL_AEAD) packets. The key_frags fragments of key block are collected in
+// memory, the others are left to the caller, who can open each one on its own. Returns 1 for a new fragment with
+// *stream set to a reference for the caller. Once the last key fragment is in, *key_block is set to the assembled
+// key block of key_frags * frag_size bytes, which then belongs to the caller and goes back through buf_pool_put.
+// Returns 0 for a duplicate or a fragment left for later, -1 if the fragment doesn't fit the packet.
+int reasm_add_sealed(reasm_table* table, const char uid[UID_LEN], uint16_t id, uint16_t frag_num,
+	uint16_t total_fragments, uint16_t frag_size, uint8_t key_frags, const unsigned char* data, size_t size, time_t now,
+	uint32_t stamp, const char* path, file_stream** stream, unsigned char** key_block) {
+	*stream = NULL;
+	*key_block = NULL;
+	if (!reasm_valid(frag_num, total_fragments, frag_size, size) || key_frags == 0 || key_frags >= total_fragments
+		|| frag_size <= AEAD_TAGLEN) {
+		table->rejected++;
+		return -1;
+	}
+
+	reasm_entry* e = reasm_find(table, uid, id, now);
+	if (!e && reasm_is_done(table, uid, id, now)) { // Late, or resent for someone else
+		table->duplicates++;
+		return 0;
+	}
+	if (!e) {
+		size_t len = (size_t)key_frags * frag_size;
+		size_t cap = buf_pool_size(len);
+		unsigned char* head = cap && cap <= table->budget ? buf_pool_get(len) : NULL;
+		file_stream* s = head ? file_stream_open(path, total_fragments, frag_size) : NULL;
+		if (!s || !(e = reasm_insert(table, uid, id, total_fragments, frag_size, cap, now))) {
+			if (s) {
+				atomic_store(&s->aborted, true);
+				file_stream_put(s);
+			}
+			buf_pool_put(head);
+			table->rejected++;
+			return -1;
+		}
+		s->key_frags = key_frags;
+		e->head = head;
+		e->stream = s;
+	}
+	if (!e->stream || e->stream->key_frags != key_frags) { // Not a sealed packet, or it changed its mind
+		table->rejected++;
+		return -1;
+	}
+	// Until the key block is opened the workers can only park data fragments, what is beyond STREAM_PENDING_MAX
+	// is left unmarked for a NACK to bring back later
+	if (frag_num >= key_frags && !atomic_load(&e->stream->keyed)
+		&& atomic_load(&e->stream->pending_bytes) + size > STREAM_PENDING_MAX)
+		return 0;
+
+	int ret = reasm_mark(table, e, frag_num, total_fragments, frag_size, size, now, stamp);
+	if (ret <= 0) return ret;
+	if (frag_num >= key_frags) atomic_fetch_add(&e->stream->pending_bytes, size);
+
+	if (frag_num < key_frags) {
+		memcpy(e->head + (size_t)frag_num * frag_size, data, size);
+		int keys = 0;
+		for (int i = 0; i < key_frags; ++i)
+			keys += !!(e->bitmap[i / 64] & (1ull << (i % 64)));
+		if (keys == key_frags) {
+			*key_block = e->head;
+			e->head = NULL;
+		}
+	}
+	file_stream_get(e->stream);
+	*stream = e->stream;
+
+	if (e->frag_received == e->total_fragments) {
+		// Every fragment is with a worker now, which finishes the file, the table just lets go
+		file_stream* s = e->stream;
+		table->completed++;
+		reasm_bury(table, e->uid, e->id, now);
+		reasm_release(table, e, 1);
+		file_stream_put(s);
+	}
+	return 1;
+}
+
+// Forgets (uid, id) and ignores its fragments until timeout, for a file whose key block has no key for us
+void reasm_drop(reasm_table* table, const char uid[UID_LEN], uint16_t id, time_t now) {
+	reasm_entry* e = reasm_find(table, uid, id, now);
+	if (e) reasm_release(table, e, 0);
+	reasm_bury(table, uid, id, now);
+}
+
+// --- ### ---
+
+// --- FEC reassembly ---
+
+// Bytes of open blocks in every table together
+static atomic_size_t fec_total;
+
+int fec_table_init(fec_table* table, size_t budget, int timeout) {
+	memset(table, 0, sizeof(fec_table));
+	table->entries = calloc(FEC_MAX_BLOCKS, sizeof(fec_entry));
+	if (!table->entries) return -1;
+	for (int i = 0; i < FEC_MAX_BLOCKS; ++i) {
+		table->entries[i].hnext = table->free_list;
+		table->free_list = &table->entries[i];
+	}
+	table->lru.lru_next = &table->lru;
+	table->lru.lru_prev = &table->lru;
+	table->budget = budget;
+	table->timeout = timeout;
+	return 0;
+}
+
+static uint32_t fec_bucket(const char uid[UID_LEN], uint16_t id, uint16_t block) {
+	uint64_t h;
+	memcpy(&h, uid, sizeof(h));
+	h = (h ^ ((uint32_t)id << 16 | block)) * 0x9E3779B97F4A7C15ull;
+	return (uint32_t)(h >> 32) % FEC_BUCKETS;
+}
+
+static void fec_lru_unlink(fec_entry* e) {
+	e->lru_prev->lru_next = e->lru_next;
+	e->lru_next->lru_prev = e->lru_prev;
+}
+
+static void fec_lru_push_front(fec_table* table, fec_entry* e) {
+	e->lru_prev = &table->lru;
+	e->lru_next = table->lru.lru_next;
+	table->lru.lru_next->lru_prev = e;
+	table->lru.lru_next = e;
+}
+
+// The block is whole, rebuilt or given up on. Its buffer goes back, the entry stays.
+static void fec_done(fec_entry* e) {
+	buf_pool_put(e->buf);
+	atomic_fetch_sub(&fec_total, e->cap);
+	e->buf = NULL;
+	e->cap = 0;
+}
+
+static void fec_release(fec_table* table, fec_entry* e) {
+	fec_entry** link = &table->buckets[fec_bucket(e->uid, e->id, e->block)];
+	while (*link != e)
+		link = &(*link)->hnext;
+	*link = e->hnext;
+	fec_lru_unlink(e);
+	if (e->buf) table->lost++;
+	fec_done(e);
+	e->hnext = table->free_list;
+	table->free_list = e;
+}
+
+void fec_table_free(fec_table* table) {
+	if (!table->entries) return;
+	while (table->lru.lru_prev != &table->lru) {
+		fec_release(table, table->lru.lru_prev);
+	}
+	free(table->entries);
+	table->entries = NULL;
+}
+
+// Adds one fragment of an FEC coded packet, data or parity. Once the block can be rebuilt, returns the data
+// fragments that were missing from it as a list for the caller to take through reassembly like received ones.
+// Their data comes from buf_pool_get.
+sealed_frag* fec_add(fec_table* table, const header_t* header, const unsigned char* data, size_t size, time_t now) {
+	int n = header->fec_data;
+	int k = header->fec_parity;
+	int total = header->total_fragments;
+	int frag_size = header->frag_size;
+	int index = header->fec_index;
+	int first = header->fec_block * n; // First data fragment of the block
+	int m = total - first < n ? total - first : n;
+	bool parity = index >= n;
+
+	// Never trust the header to index our buffer
+	if (n < 1 || n > FEC_MAX_DATA || k < 1 || k > FEC_MAX_PARITY || frag_size < 1 || frag_size > (int)MAX_FRAGMENT
+		|| first >= total || index >= n + k || header->last_size < 1 || header->last_size > frag_size
+		|| (parity && (size != (size_t)frag_size || header->frag_num != total + header->fec_block * k + index - n))
+		|| (!parity
+			&& (index >= m || header->frag_num != first + index
+				|| size != (size_t)(header->frag_num == total - 1 ? header->last_size : frag_size)))) {
+		table->rejected++;
+		return NULL;
+	}
+
+	while (table->lru.lru_prev != &table->lru && now - table->lru.lru_prev->last_update > table->timeout) {
+		fec_release(table, table->lru.lru_prev);
+	}
+	fec_entry* e = table->buckets[fec_bucket(header->uid, header->id, header->fec_block)];
+	while (e && (e->id != header->id || e->block != header->fec_block || memcmp(e->uid, header->uid, UID_LEN)))
+		e = e->hnext;
+
+	if (!e) {
+		size_t cap = (size_t)(m + k) * frag_size;
+		while (table->lru.lru_prev != &table->lru
+			&& (atomic_load(&fec_total) + cap > table->budget || !table->free_list)) {
+			fec_release(table, table->lru.lru_prev);
+		}
+		if (atomic_load(&fec_total) + cap > table->budget) return NULL;
+		unsigned char* buf = buf_pool_get(cap);
+		if (!buf) return NULL;
+
+		e = table->free_list;
+		table->free_list = e->hnext;
+		memcpy(e->uid, header->uid, UID_LEN);
+		e->id = header->id;
+		e->block = header->fec_block;
+		e->data = m;
+		e->parity = k;
+		e->frag_size = frag_size;
+		e->have_data = 0;
+		e->have_parity = 0;
+		e->buf = buf;
+		e->cap = cap;
+		atomic_fetch_add(&fec_total, cap);
+		uint32_t bucket = fec_bucket(e->uid, e->id, e->block);
+		e->hnext = table->buckets[bucket];
+		table->buckets[bucket] = e;
+		fec_lru_push_front(table, e);
+	}
+	if (!e->buf) return NULL; // Done with this block already
+	if (e->data != m || e->parity != k || e->frag_size != frag_size) {
+		table->rejected++;
+		return NULL;
+	}
+
+	int slot = parity ? m + index - n : index;
+	if (parity ? e->have_parity & (1u << (index - n)) : e->have_data & (1ull << index)) return NULL;
+	unsigned char* dst = e->buf + (size_t)slot * frag_size;
+	memcpy(dst, data, size);
+	memset(dst + size, 0, frag_size - size); // The short last fragment was coded zero padded
+	if (parity) {
+		e->have_parity |= 1u << (index - n);
+	} else {
+		e->have_data |= 1ull << index;
+	}
+	e->last_update = now;
+	fec_lru_unlink(e);
+	fec_lru_push_front(table, e);
+
+	int have_data = __builtin_popcountll(e->have_data);
+	if (have_data == m) {
+		fec_done(e);
+		return NULL;
+	}
+	if (have_data + __builtin_popcount(e->have_parity) < m) return NULL;
+
+	unsigned char* frags[FEC_MAX_DATA + FEC_MAX_PARITY];
+	for (int i = 0; i < m + k; ++i)
+		frags[i] = e->buf + (size_t)i * frag_size;
+	uint64_t missing = ~e->have_data & (m == 64 ? ~0ull : (1ull << m) - 1);
+	if (fec_decode(frags, e->have_data, e->have_parity, m, k, frag_size) < 0) {
+		table->lost++;
+		fec_done(e);
+		return NULL;
+	}
+
+	sealed_frag* rebuilt = NULL;
+	for (int i = m - 1; i >= 0; --i) {
+		if (!(missing & (1ull << i))) continue;
+		uint16_t frag_num = first + i;
+		size_t len = frag_num == total - 1 ? header->last_size : (size_t)frag_size;
+		sealed_frag* f = malloc(sizeof(sealed_frag));
+		unsigned char* copy = f ? buf_pool_get(len) : NULL;
+		if (!copy) {
+			free(f);
+			continue; // NACKs get it later
+		}
+		memcpy(copy, frags[i], len);
+		f->header = *header;
+		f->header.frag_num = frag_num;
+		f->header.fec_index = i;
+		f->header.size = len;
+		f->data = copy;
+		f->len = len;
+		f->next = rebuilt;
+		rebuilt = f;
+		table->rebuilt++;
+	}
+	fec_done(e);
+	return rebuilt;
 }
 
+// --- ### ---
+
+// --- NACK ---
+
+uint64_t monotonic_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Calls send with a NACK for every packet of the table that has been quiet for NACK_DELAY with fragments
+// missing. Run it on the table's shard. Each packet is asked for at most NACK_MAX_ROUNDS times, with the wait
+// doubling and a random part so receivers missing the same fragments don't all ask at once.
+// Returns the number of NACKs sent.
+int reasm_collect_nacks(reasm_table* table, uint64_t now_ms, void (*send)(const nack_t* nack, size_t len, void* arg),
+	void* arg) {
+	int sent = 0;
+	for (reasm_entry* e = table->lru.lru_prev; e != &table->lru; e = e->lru_prev) {
+		int quiet = now_ms - e->last_ms >= NACK_DELAY;
+		if (now_ms < e->nack_after || (quiet && e->nacks >= NACK_MAX_ROUNDS)) continue;
+		if (e->stream && atomic_load(&e->stream->aborted)) continue; // Not for us after all, or broken
+		// Fragments behind the highest one may still be on their way, or about to be rebuilt from parity
+		int end = quiet ? e->total_fragments : e->highest + 1 - NACK_REORDER;
+		if (end <= 0) continue;
+
+		nack_t nack;
+		memset(&nack, 0, sizeof(nack));
+		memcpy(nack.uid, e->uid, UID_LEN);
+		nack.id = e->id;
+		int first = -1, lost = 0;
+		for (int f = 0; f < end; ++f) {
+			if (e->bitmap[f / 64] & (1ull << (f % 64))) continue;
+			if (f >= e->reported) lost++;
+			if (first >= 0 && f - first >= NACK_MAX_BITS) continue;
+			if (first < 0) first = f;
+			nack.bitmap[(f - first) / 8] |= 1 << ((f - first) % 8);
+			nack.nbits = f - first + 1;
+		}
+		if (first < 0) continue; // Complete, the worker finishing it just hasn't caught up
+		nack.first = first;
+		if (end > e->reported) {
+			nack.fresh = end - e->reported;
+			nack.lost = lost;
+			e->reported = end;
+		}
+		if (e->stamp) nack.echo = e->stamp + (uint32_t)(now_ms - e->last_ms);
+
+		send(&nack, NACK_HEADER_LEN + (nack.nbits + 7) / 8, arg);
+		if (quiet) {
+			e->nacks++;
+			e->nack_after = now_ms + ((uint64_t)NACK_DELAY << e->nacks) + random() % NACK_DELAY;
+		} else {
+			e->nack_after = now_ms + NACK_DELAY + random() % NACK_DELAY;
+		}
+		sent++;
+	}
+	return sent;
+}
+
+// Someone else on the subnet asked for (uid, id), the resend will reach us too. Only sees packets in this
+// table, so with several shards the NACK has to land on the one reassembling the packet.
+void reasm_overheard_nack(reasm_table* table, const char uid[UID_LEN], uint16_t id, uint64_t now_ms) {
+	reasm_entry* e = table->buckets[reasm_bucket(uid, id)];
+	while (e && (e->id != id || memcmp(e->uid, uid, UID_LEN)))
+		e = e->hnext;
+	if (e && e->nack_after < now_ms + NACK_DELAY) e->nack_after = now_ms + NACK_DELAY + random() % NACK_DELAY;
+}
+
+// --- ### ---
+
 // --- Crypto ---
 
+// The packet key is used for this packet only, so (id, frag_num) on top of the random iv never repeats under it
+void aead_nonce(unsigned char nonce[AEAD_NONCELEN], const unsigned char iv[AES_IVLEN], uint16_t id, uint16_t frag_num) {
+	memcpy(nonce, iv, AEAD_NONCELEN);
+	nonce[6] ^= id >> 8;
+	nonce[7] ^= id;
+	nonce[10] ^= frag_num >> 8;
+	nonce[11] ^= frag_num;
+}
+
+// Binds a sealed fragment to its place in its packet. cl_flags is left out, relays flip CL_RELAYED.
+void aead_aad(unsigned char aad[AEAD_AADLEN], const char uid[UID_LEN], uint16_t id, uint16_t frag_num,
+	uint16_t total_fragments, uint16_t frag_size, uint8_t key_frags) {
+	uint16_t fields[4] = {htons(id), htons(frag_num), htons(total_fragments), htons(frag_size)};
+	memcpy(aad, uid, UID_LEN);
+	memcpy(aad + UID_LEN, fields, sizeof(fields));
+	aad[UID_LEN + sizeof(fields)] = key_frags;
+}
+
+// Every thread keeps a context per cipher and direction, and the RSA contexts of the keys it used last, for as long
+// as it runs. Ciphers are fetched once, a context is only keyed again for each message.
+
+enum { CIPHER_CBC, CIPHER_GCM, CIPHER_CHACHA, CIPHERS };
+#define RSA_CTX_CACHE 32 // Keys a thread keeps an RSA context for, build_key_block goes through every peer's
+
+static const char* cipher_names[CIPHERS] = {"AES-256-CBC", "AES-256-GCM", "ChaCha20-Poly1305"};
+static EVP_CIPHER* ciphers[CIPHERS];
+static aead_suite_e local_suite;
+
+typedef struct {
+	EVP_CIPHER_CTX* cipher[CIPHERS][2]; // Decrypt, encrypt
+	EVP_PKEY_CTX* rsa[RSA_CTX_CACHE]; // Each holds a reference to its key, a new key can't show up at the same address
+	EVP_PKEY* rsa_key[RSA_CTX_CACHE];
+	bool rsa_encrypt[RSA_CTX_CACHE];
+	int rsa_next; // Replaced next
+} crypto_ctxs;
+
+static pthread_key_t crypto_key;
+static pthread_once_t crypto_once = PTHREAD_ONCE_INIT;
+
+static void crypto_ctxs_free(void* arg) {
+	crypto_ctxs* t = arg;
+	for (int c = 0; c < CIPHERS; ++c) {
+		EVP_CIPHER_CTX_free(t->cipher[c][0]);
+		EVP_CIPHER_CTX_free(t->cipher[c][1]);
+	}
+	for (int i = 0; i < RSA_CTX_CACHE; ++i)
+		EVP_PKEY_CTX_free(t->rsa[i]);
+	free(t);
+}
+
+static void crypto_setup(void) {
+	for (int c = 0; c < CIPHERS; ++c) {
+		ciphers[c] = EVP_CIPHER_fetch(NULL, cipher_names[c], NULL);
+		if (!ciphers[c]) fprintf(stderr, "%s is not available\n", cipher_names[c]);
+	}
+	pthread_key_create(&crypto_key, crypto_ctxs_free);
+
+	// GCM wants AES rounds and carry-less multiply in hardware, ChaCha20-Poly1305 is faster in plain software
+	local_suite = AEAD_CHACHA20_POLY1305;
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul")) local_suite = AEAD_AES_GCM;
+#elif defined(__aarch64__)
+	unsigned long hwcap = getauxval(AT_HWCAP);
+	if (hwcap & HWCAP_AES && hwcap & HWCAP_PMULL) local_suite = AEAD_AES_GCM;
+#endif
+	if (!ciphers[CIPHER_GCM]) local_suite = AEAD_CHACHA20_POLY1305;
+	if (!ciphers[CIPHER_CHACHA]) local_suite = AEAD_AES_GCM;
+}
+
+static crypto_ctxs* crypto_thread(void) {
+	pthread_once(&crypto_once, crypto_setup);
+	crypto_ctxs* t = pthread_getspecific(crypto_key);
+	if (!t && (t = calloc(1, sizeof(crypto_ctxs)))) pthread_setspecific(crypto_key, t);
+	return t;
+}
+
+// The calling thread's context for cipher, keyed with key and iv. NULL on failure.
+static EVP_CIPHER_CTX* cipher_ctx(int cipher, int enc, const unsigned char* key, const unsigned char* iv) {
+	crypto_ctxs* t = crypto_thread();
+	if (!t || !ciphers[cipher]) return NULL;
+	EVP_CIPHER_CTX** ctx = &t->cipher[cipher][enc];
+	if (!*ctx) {
+		*ctx = EVP_CIPHER_CTX_new();
+		if (!*ctx || EVP_CipherInit_ex(*ctx, ciphers[cipher], NULL, NULL, NULL, enc) <= 0
+			|| (cipher != CIPHER_CBC && EVP_CIPHER_CTX_ctrl(*ctx, EVP_CTRL_AEAD_SET_IVLEN, AEAD_NONCELEN, NULL) <= 0)) {
+			EVP_CIPHER_CTX_free(*ctx);
+			*ctx = NULL;
+			return NULL;
+		}
+	}
+	return EVP_CipherInit_ex(*ctx, NULL, NULL, key, iv, enc) > 0 ? *ctx : NULL;
+}
+
+// The calling thread's OAEP context for key, NULL on failure
+static EVP_PKEY_CTX* rsa_ctx(EVP_PKEY* key, bool encrypt) {
+	crypto_ctxs* t = crypto_thread();
+	if (!t) return NULL;
+	for (int i = 0; i < RSA_CTX_CACHE; ++i) {
+		if (t->rsa[i] && t->rsa_key[i] == key && t->rsa_encrypt[i] == encrypt) return t->rsa[i];
+	}
+	EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new(key, NULL);
+	if (!ctx || (encrypt ? EVP_PKEY_encrypt_init(ctx) : EVP_PKEY_decrypt_init(ctx)) <= 0
+		|| EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_PKCS1_OAEP_PADDING) <= 0) {
+		EVP_PKEY_CTX_free(ctx);
+		return NULL;
+	}
+	int i = t->rsa_next;
+	t->rsa_next = (i + 1) % RSA_CTX_CACHE;
+	EVP_PKEY_CTX_free(t->rsa[i]);
+	t->rsa[i] = ctx;
+	t->rsa_key[i] = key;
+	t->rsa_encrypt[i] = encrypt;
+	return ctx;
+}
+
+aead_suite_e aead_local_suite(void) {
+	pthread_once(&crypto_once, crypto_setup);
+	return local_suite;
+}
+
+const char* aead_suite_name(aead_suite_e suite) {
+	return cipher_names[suite == AEAD_CHACHA20_POLY1305 ? CIPHER_CHACHA : CIPHER_GCM];
+}
+
+// out receives len bytes of ciphertext followed by the tag. Returns 0, or -1 on failure.
+int aead_seal(aead_suite_e suite, const unsigned char key[AES_KEYLEN], const unsigned char nonce[AEAD_NONCELEN],
+	const unsigned char* aad, size_t aad_len, const unsigned char* in, size_t len, unsigned char* out) {
+	EVP_CIPHER_CTX* ctx = cipher_ctx(suite == AEAD_CHACHA20_POLY1305 ? CIPHER_CHACHA : CIPHER_GCM, 1, key, nonce);
+	int outl = 0, ok = ctx && EVP_EncryptUpdate(ctx, NULL, &outl, aad, aad_len) > 0
+		&& (outl = 0, len == 0 || EVP_EncryptUpdate(ctx, out, &outl, in, len) > 0)
+		&& EVP_EncryptFinal_ex(ctx, out + outl, &outl) > 0
+		&& EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, AEAD_TAGLEN, out + len) > 0;
+	return ok ? 0 : -1;
+}
+
+// in is ciphertext and tag, len counts both. out may be in. Returns the plaintext length, or -1 if the
+// fragment was not sealed with key, nonce and aad.
+int aead_open(aead_suite_e suite, const unsigned char key[AES_KEYLEN], const unsigned char nonce[AEAD_NONCELEN],
+	const unsigned char* aad, size_t aad_len, const unsigned char* in, size_t len, unsigned char* out) {
+	if (len < AEAD_TAGLEN) return -1;
+	size_t ct_len = len - AEAD_TAGLEN;
+	unsigned char tag[AEAD_TAGLEN];
+	memcpy(tag, in + ct_len, AEAD_TAGLEN); // out may overwrite in
+
+	EVP_CIPHER_CTX* ctx = cipher_ctx(suite == AEAD_CHACHA20_POLY1305 ? CIPHER_CHACHA : CIPHER_GCM, 0, key, nonce);
+	int outl = 0, ok = ctx && EVP_DecryptUpdate(ctx, NULL, &outl, aad, aad_len) > 0
+		&& (outl = 0, ct_len == 0 || EVP_DecryptUpdate(ctx, out, &outl, in, ct_len) > 0)
+		&& EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, AEAD_TAGLEN, tag) > 0
+		&& EVP_DecryptFinal_ex(ctx, out + outl, &outl) > 0;
+	return ok ? (int)ct_len : -1;
+}
+
+// key and nonce are HMAC-SHA256(chain, label | epoch | counter), label 1 for the key and 2 for the nonce. A counter is
+// used once per epoch, so neither repeats under the chain key.
+int sender_key_derive(const unsigned char chain[AES_KEYLEN], uint32_t epoch, uint32_t counter,
+	unsigned char key[AES_KEYLEN], unsigned char nonce[AEAD_NONCELEN]) {
+	unsigned char in[1 + 2 * sizeof(uint32_t)];
+	unsigned char out[EVP_MAX_MD_SIZE];
+	unsigned int out_len;
+	uint32_t fields[2] = {htonl(epoch), htonl(counter)};
+	memcpy(in + 1, fields, sizeof(fields));
+
+	in[0] = 1;
+	if (!HMAC(EVP_sha256(), chain, AES_KEYLEN, in, sizeof(in), out, &out_len)) return -1;
+	memcpy(key, out, AES_KEYLEN);
+	in[0] = 2;
+	if (!HMAC(EVP_sha256(), chain, AES_KEYLEN, in, sizeof(in), out, &out_len)) return -1;
+	memcpy(nonce, out, AEAD_NONCELEN);
+	OPENSSL_cleanse(out, sizeof(out));
+	return 0;
+}
+
+// Marks counter as opened. Returns false for a replay, or a counter too far behind to tell.
+bool sender_key_accept(sender_key* sk, uint32_t counter) {
+	if (counter > sk->top) {
+		uint32_t shift = counter - sk->top;
+		sk->window = shift >= 64 ? 0 : sk->window << shift;
+		sk->window |= 1;
+		sk->top = counter;
+		return true;
+	}
+	uint32_t back = sk->top - counter;
+	if (back >= 64 || sk->window & (1ull << back)) return false;
+	sk->window |= 1ull << back;
+	return true;
+}
+
 // input: plaintext, output: ciphertext, plaintext_len: length of plaintext
 unsigned char* encrypt_aes(
 	const unsigned char* plaintext, int plaintext_len, const unsigned char* key, const unsigned char* iv, int* out_len) {
-	EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+	EVP_CIPHER_CTX* ctx = cipher_ctx(CIPHER_CBC, 1, key, iv);
 	if (!ctx) return NULL;
 
-	if (EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, iv) <= 0) {
-		EVP_CIPHER_CTX_free(ctx);
-		return NULL;
-	}
-
 	int max_ciphertext_len = plaintext_len + AES_BLOCK_SIZE;
 	unsigned char* ciphertext = (unsigned char*)malloc(max_ciphertext_len);
-	if (!ciphertext) {
-		EVP_CIPHER_CTX_free(ctx);
-		return NULL;
-	}
+	if (!ciphertext) return NULL;
 
 	int len, ciphertext_len;
 	if (EVP_EncryptUpdate(ctx, ciphertext, &len, plaintext, plaintext_len) <= 0) {
-		EVP_CIPHER_CTX_free(ctx);
 		free(ciphertext);
 		return NULL;
 	}
 	ciphertext_len = len;
 
 	if (EVP_EncryptFinal_ex(ctx, ciphertext + len, &len) <= 0) {
-		EVP_CIPHER_CTX_free(ctx);
 		free(ciphertext);
 		return NULL;
 	}
 	ciphertext_len += len;
 
-	EVP_CIPHER_CTX_free(ctx);
 	*out_len = ciphertext_len;
 	return ciphertext;
 }
 
+// plaintext may be ciphertext
 int decrypt_aes(const unsigned char* ciphertext, int ciphertext_len, const unsigned char* key, const unsigned char* iv,
 	unsigned char* plaintext) {
-	EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+	EVP_CIPHER_CTX* ctx = cipher_ctx(CIPHER_CBC, 0, key, iv);
 	int len, plaintext_len;
+	if (!ctx) return -1;
 
-	if (EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, iv) <= 0) {
-		EVP_CIPHER_CTX_free(ctx);
-		return -1;
-	}
-
-	if (EVP_DecryptUpdate(ctx, plaintext, &len, ciphertext, ciphertext_len) <= 0) {
-		EVP_CIPHER_CTX_free(ctx);
-		return -1;
-	}
+	if (EVP_DecryptUpdate(ctx, plaintext, &len, ciphertext, ciphertext_len) <= 0) return -1;
 	plaintext_len = len;
 
-	if (EVP_DecryptFinal_ex(ctx, plaintext + len, &len) <= 0) {
-		EVP_CIPHER_CTX_free(ctx);
-		return -1;
-	}
+	if (EVP_DecryptFinal_ex(ctx, plaintext + len, &len) <= 0) return -1;
 	plaintext_len += len;
 
-	EVP_CIPHER_CTX_free(ctx);
 	return plaintext_len;
 }
 
 int encrypt_key_with_rsa(EVP_PKEY* pubkey, const unsigned char* aes_key, int keylen, unsigned char* encrypted_key) {
-	EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new(pubkey, NULL);
+	EVP_PKEY_CTX* ctx = rsa_ctx(pubkey, true);
 	size_t outlen = EVP_PKEY_size(pubkey);
-
-	if (EVP_PKEY_encrypt_init(ctx) <= 0) {
-		EVP_PKEY_CTX_free(ctx);
-		return -1;
-	}
-
-	if (EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_PKCS1_OAEP_PADDING) <= 0) {
-		EVP_PKEY_CTX_free(ctx);
-		return -1;
-	}
-
-	if (EVP_PKEY_encrypt(ctx, encrypted_key, &outlen, aes_key, keylen) <= 0) {
-		EVP_PKEY_CTX_free(ctx);
-		return -1;
-	}
-
-	EVP_PKEY_CTX_free(ctx);
+	if (!ctx || EVP_PKEY_encrypt(ctx, encrypted_key, &outlen, aes_key, keylen) <= 0) return -1;
 	return outlen; // encrypted key length
 }
 
 int decrypt_key_with_rsa(
 	EVP_PKEY* privkey, const unsigned char* encrypted_key, int encrypted_keylen, unsigned char* decrypted_key) {
-	EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new(privkey, NULL);
+	EVP_PKEY_CTX* ctx = rsa_ctx(privkey, false);
 	if (!ctx) return -1;
 
-	if (EVP_PKEY_decrypt_init(ctx) <= 0) {
-		EVP_PKEY_CTX_free(ctx);
-		return -1;
-	}
-	if (EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_PKCS1_OAEP_PADDING) <= 0) {
-		EVP_PKEY_CTX_free(ctx);
-		return -1;
-	}
-
 	// 1st call to determine buffer length
 	size_t outlen = 0;
-	if (EVP_PKEY_decrypt(ctx, NULL, &outlen, encrypted_key, encrypted_keylen) <= 0) {
-		EVP_PKEY_CTX_free(ctx);
-		return -1;
-	}
+	if (EVP_PKEY_decrypt(ctx, NULL, &outlen, encrypted_key, encrypted_keylen) <= 0) return -1;
 
 	// 2nd call to do actual decrypt
-	if (EVP_PKEY_decrypt(ctx, decrypted_key, &outlen, encrypted_key, encrypted_keylen) <= 0) {
-		EVP_PKEY_CTX_free(ctx);
-		return -1;
-	}
-
-	EVP_PKEY_CTX_free(ctx);
+	if (EVP_PKEY_decrypt(ctx, decrypted_key, &outlen, encrypted_key, encrypted_keylen) <= 0) return -1;
 	return (int)outlen;
 }
 
-int node_generate_rsa_keypair(node_t* node) {
+static EVP_PKEY* rsa_keygen(void) {
 	EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, NULL);
-	if (!ctx) return 0;
-
-	if (EVP_PKEY_keygen_init(ctx) <= 0) {
-		EVP_PKEY_CTX_free(ctx);
-		return 0;
-	}
-	if (EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, 2048) <= 0) {
-		EVP_PKEY_CTX_free(ctx);
-		return 0;
-	}
+	if (!ctx) return NULL;
 
-	if (EVP_PKEY_keygen(ctx, &(node->keypair)) <= 0) {
-		EVP_PKEY_CTX_free(ctx);
-		return 0;
+	EVP_PKEY* key = NULL;
+	if (EVP_PKEY_keygen_init(ctx) <= 0 || EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, 2048) <= 0
+		|| EVP_PKEY_keygen(ctx, &key) <= 0) {
+		EVP_PKEY_free(key);
+		key = NULL;
 	}
-
 	EVP_PKEY_CTX_free(ctx);
+	return key;
+}
 
+int node_generate_rsa_keypair(node_t* node) {
+	EVP_PKEY* key = rsa_keygen();
+	return key && node_set_keypair(node, key);
+}
+
+// Takes over keypair, and replaces whatever node had before
+int node_set_keypair(node_t* node, EVP_PKEY* keypair) {
 	// Export public key to PEM
 	BIO* mem = BIO_new(BIO_s_mem());
-	if (!PEM_write_bio_PUBKEY(mem, node->keypair)) {
+	if (!mem || !PEM_write_bio_PUBKEY(mem, keypair)) {
 		BIO_free(mem);
+		EVP_PKEY_free(keypair);
 		return 0;
 	}
 	size_t pub_len = BIO_pending(mem);
-	node->pubkey_pem = malloc(pub_len + 1);
-	BIO_read(mem, node->pubkey_pem, pub_len);
-	node->pubkey_pem[pub_len] = '\0';
+	char* pem = malloc(pub_len + 1);
+	if (!pem) {
+		BIO_free(mem);
+		EVP_PKEY_free(keypair);
+		return 0;
+	}
+	BIO_read(mem, pem, pub_len);
+	pem[pub_len] = '\0';
 	BIO_free(mem);
 
-	return 1;
+	if (node->keypair) EVP_PKEY_free(node->keypair);
+	free(node->pubkey_pem);
+	node->keypair = keypair;
+	node->pubkey_pem = pem;
+	return key_fingerprint(node->keypair, node->fingerprint);
 }
 
 // caller must free with EVP_PKEY_free(pubkey)
@@ -399,4 +1583,273 @@ EVP_PKEY* peer_pubkey_from_pem(const char* pubkey_pem) {
 	return pubkey; // caller must free with EVP_PKEY_free(pubkey)
 }
 
+// Works for any key type, heartbeats carry this instead of the PEM
+int key_fingerprint(EVP_PKEY* key, unsigned char fpr[KEY_FPR_LEN]) {
+	unsigned char* der = NULL;
+	int len = i2d_PUBKEY(key, &der);
+	if (len <= 0) return 0;
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int md_len;
+	int ok = EVP_Digest(der, len, md, &md_len, EVP_sha256(), NULL);
+	OPENSSL_free(der);
+	if (!ok) return 0;
+	memcpy(fpr, md, KEY_FPR_LEN);
+	return 1;
+}
+
+// Seals len bytes of in into out with the calling thread's context, or with a new context around the implicitly
+// fetched cipher as every call did before the pools
+static int bench_seal(int cipher, bool pooled, const unsigned char* key, const unsigned char* iv,
+	const unsigned char* in, int len, unsigned char* out) {
+	static const EVP_CIPHER* (*implicit[CIPHERS])(void) = {EVP_aes_256_cbc, EVP_aes_256_gcm, EVP_chacha20_poly1305};
+	bool aead = cipher != CIPHER_CBC;
+	EVP_CIPHER_CTX* ctx;
+	if (pooled) {
+		ctx = cipher_ctx(cipher, 1, key, iv);
+	} else {
+		ctx = EVP_CIPHER_CTX_new();
+		if (ctx
+			&& (EVP_EncryptInit_ex(ctx, implicit[cipher](), NULL, NULL, NULL) <= 0
+				|| (aead && EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_IVLEN, AEAD_NONCELEN, NULL) <= 0)
+				|| EVP_EncryptInit_ex(ctx, NULL, NULL, key, iv) <= 0)) {
+			EVP_CIPHER_CTX_free(ctx);
+			ctx = NULL;
+		}
+	}
+	int outl = 0, ok = ctx && EVP_EncryptUpdate(ctx, out, &outl, in, len) > 0
+		&& EVP_EncryptFinal_ex(ctx, out + outl, &outl) > 0
+		&& (!aead || EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, AEAD_TAGLEN, out + len) > 0);
+	if (!pooled) EVP_CIPHER_CTX_free(ctx);
+	return ok ? 0 : -1;
+}
+
+static int bench_wrap(EVP_PKEY* pubkey, bool pooled, const unsigned char key[AES_KEYLEN], unsigned char* out) {
+	if (pooled) return encrypt_key_with_rsa(pubkey, key, AES_KEYLEN, out);
+	EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new(pubkey, NULL);
+	size_t outlen = EVP_PKEY_size(pubkey);
+	int ok = ctx && EVP_PKEY_encrypt_init(ctx) > 0 && EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_PKCS1_OAEP_PADDING) > 0
+		&& EVP_PKEY_encrypt(ctx, out, &outlen, key, AES_KEYLEN) > 0;
+	EVP_PKEY_CTX_free(ctx);
+	return ok ? (int)outlen : -1;
+}
+
+static double bench_ns(const struct timespec* start, const struct timespec* end, int rounds) {
+	return ((end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec)) / rounds;
+}
+
+// Per message cost of each cipher and of wrapping a key for one peer, before the context pools and with them, and
+// the bulk rate of each cipher. Prints which AEAD suite this CPU picks.
+int crypto_benchmark(void) {
+	pthread_once(&crypto_once, crypto_setup);
+	const int rounds = 100000, bulk_rounds = 2000, rsa_rounds = 2000;
+	const int msg_len = 256, bulk_len = 64 * 1024;
+	unsigned char key[AES_KEYLEN], iv[AES_IVLEN];
+	unsigned char* in = malloc(bulk_len);
+	unsigned char* out = malloc(bulk_len + AES_BLOCK_SIZE + AEAD_TAGLEN);
+	node_t rsa = {0};
+	int ret = 0;
+	if (!in || !out || !node_generate_rsa_keypair(&rsa)) {
+		ret = -1;
+		goto out;
+	}
+	for (int i = 0; i < bulk_len; ++i)
+		in[i] = i;
+	for (int i = 0; i < AES_KEYLEN; ++i)
+		key[i] = i * 7;
+	memcpy(iv, key, AES_IVLEN);
+
+	printf("AEAD suite on this CPU: %s\n", aead_suite_name(local_suite));
+	struct timespec start, end;
+	for (int c = 0; c < CIPHERS; ++c) {
+		if (!ciphers[c]) {
+			printf("%-17s not available\n", cipher_names[c]);
+			ret = -1;
+			continue;
+		}
+		double ns[2];
+		for (int pooled = 0; pooled < 2; ++pooled) {
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			for (int r = 0; r < rounds; ++r) {
+				if (bench_seal(c, pooled, key, iv, in, msg_len, out) < 0) ret = -1;
+			}
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			ns[pooled] = bench_ns(&start, &end, rounds);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (int r = 0; r < bulk_rounds; ++r) {
+			if (bench_seal(c, true, key, iv, in, bulk_len, out) < 0) ret = -1;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		double mbps = (double)bulk_len / (1024 * 1024) / (bench_ns(&start, &end, bulk_rounds) / 1e9);
+		printf("%-17s %d B message %6.0f ns per call, %6.0f ns pooled, %d KB records %6.0f MB/s\n", cipher_names[c],
+			msg_len, ns[0], ns[1], bulk_len / 1024, mbps);
+	}
+
+	double ns[2];
+	for (int pooled = 0; pooled < 2; ++pooled) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (int r = 0; r < rsa_rounds; ++r) {
+			if (bench_wrap(rsa.keypair, pooled, key, out) < 0) ret = -1;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		ns[pooled] = bench_ns(&start, &end, rsa_rounds);
+	}
+	printf("RSA-2048 OAEP     key wrap      %6.0f ns per call, %6.0f ns pooled\n", ns[0], ns[1]);
+
+out:
+	free(in);
+	free(out);
+	EVP_PKEY_free(rsa.keypair);
+	free(rsa.pubkey_pem);
+	return ret;
+}
+
+// --- ### ---
+
+// --- Identity ---
+
+// The keypair is stored unencrypted, so only a regular file of ours that nobody else can read is used
+// Received files land in the working directory under names the sender picks, the identity lives away from them
+int identity_path(char path[PATH_MAX]) {
+	char dir[PATH_MAX];
+	const char* config = getenv("XDG_CONFIG_HOME");
+	const char* home = getenv("HOME");
+	int len;
+	if (config && config[0] == '/')
+		len = snprintf(dir, sizeof(dir), "%s", config);
+	else if (home && home[0] == '/')
+		len = snprintf(dir, sizeof(dir), "%s/.config", home);
+	else
+		return -1;
+	if (len >= (int)sizeof(dir) || (mkdir(dir, 0700) < 0 && errno != EEXIST)) return -1;
+	if (snprintf(path, PATH_MAX, "%s/%s", dir, IDENTITY_DIR) >= PATH_MAX) return -1;
+	if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+		perror("Failed to create the identity directory");
+		return -1;
+	}
+	if (snprintf(path, PATH_MAX, "%s/%s/%s", dir, IDENTITY_DIR, IDENTITY_FILE) >= PATH_MAX) return -1;
+	return 0;
+}
+
+int identity_load(node_t* node, const char* path) {
+	int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno == ENOENT) return 0;
+		perror("Failed to open the identity");
+		return -1;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_uid != geteuid() || st.st_mode & (S_IRWXG | S_IRWXO)) {
+		fprintf(stderr, "%s must be a file of ours that only we can read, see chmod 600\n", path);
+		close(fd);
+		return -1;
+	}
+	FILE* fp = fdopen(fd, "r");
+	if (!fp) {
+		close(fd);
+		return -1;
+	}
+	EVP_PKEY* key = PEM_read_PrivateKey(fp, NULL, NULL, NULL);
+	fclose(fp);
+	if (!key) {
+		fprintf(stderr, "Failed to read the keypair in %s\n", path);
+		return -1;
+	}
+	return node_set_keypair(node, key) ? 1 : -1;
+}
+
+// Written next to path and renamed over it, a crash leaves either the old identity or the new one
+int identity_save(EVP_PKEY* keypair, const char* path) {
+	char tmp[PATH_MAX];
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) return -1;
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		perror("Failed to create the identity");
+		return -1;
+	}
+	FILE* fp = fchmod(fd, 0600) == 0 ? fdopen(fd, "w") : NULL; // A leftover tmp keeps the mode it was created with
+	if (!fp) {
+		perror("Failed to create the identity");
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	bool ok = PEM_write_PrivateKey(fp, keypair, NULL, NULL, 0, NULL, NULL) && fflush(fp) == 0 && fsync(fd) == 0;
+	ok = fclose(fp) == 0 && ok;
+	if (!ok || rename(tmp, path) < 0) {
+		fprintf(stderr, "Failed to write the identity to %s\n", path);
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+// Keypairs generated ahead of time for ephemeral identities
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond; // A key was taken or added, or the pool stops
+	pthread_t thread;
+	bool started; // thread is there to join
+	bool running;
+	EVP_PKEY* keys[KEYGEN_POOL];
+	int count;
+} keygen = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+
+static void* keygen_thread(void* arg) {
+	(void)arg;
+	pthread_mutex_lock(&keygen.lock);
+	while (keygen.running) {
+		if (keygen.count == KEYGEN_POOL) {
+			pthread_cond_wait(&keygen.cond, &keygen.lock);
+			continue;
+		}
+		pthread_mutex_unlock(&keygen.lock);
+		EVP_PKEY* key = rsa_keygen();
+		pthread_mutex_lock(&keygen.lock);
+		if (!key) {
+			fprintf(stderr, "Failed to generate a keypair, the key pool stops\n");
+			keygen.running = false;
+		} else {
+			keygen.keys[keygen.count++] = key;
+		}
+		pthread_cond_broadcast(&keygen.cond);
+	}
+	pthread_mutex_unlock(&keygen.lock);
+	return NULL;
+}
+
+int keygen_pool_start(void) {
+	keygen.running = true;
+	if (pthread_create(&keygen.thread, NULL, keygen_thread, NULL)) {
+		perror("pthread_create");
+		keygen.running = false;
+		return -1;
+	}
+	keygen.started = true;
+	return 0;
+}
+
+// Waits for the key being generated if none is ready, and generates one right here if the pool isn't running
+EVP_PKEY* keygen_pool_take(void) {
+	pthread_mutex_lock(&keygen.lock);
+	while (keygen.running && !keygen.count)
+		pthread_cond_wait(&keygen.cond, &keygen.lock);
+	EVP_PKEY* key = keygen.count ? keygen.keys[--keygen.count] : NULL;
+	pthread_cond_broadcast(&keygen.cond); // Refill
+	pthread_mutex_unlock(&keygen.lock);
+	return key ? key : rsa_keygen();
+}
+
+// Lets the key being generated finish first
+void keygen_pool_stop(void) {
+	pthread_mutex_lock(&keygen.lock);
+	keygen.running = false;
+	pthread_cond_broadcast(&keygen.cond);
+	pthread_mutex_unlock(&keygen.lock);
+	if (keygen.started) pthread_join(keygen.thread, NULL);
+	keygen.started = false;
+	while (keygen.count)
+		EVP_PKEY_free(keygen.keys[--keygen.count]);
+}
+
 // --- ### ---
@@ -8,27 +8,62 @@
 #include <openssl/rsa.h>
 
 #include <openssl/types.h>
+#include <limits.h>
 #include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <sys/types.h>
 
-// --- ID Cache ---
-#define CACHE_SIZE 10
+#define AES_KEYLEN 32 // 256 bits
+#define AES_IVLEN 16 // For AES-CBC
+
+// --- Duplicate suppression ---
+// Fixed size open-addressing set of (uid, packet id, fragment) we have seen recently. One per receiver
+// shard, so no locking. Entries older than ttl count as free, a full probe window evicts its oldest entry.
 
-typedef struct id_cache {
-	uint8_t i;
-	uint32_t cache[CACHE_SIZE];
-} id_cache;
+#define DEDUP_BITS 16 // 65536 slots, room for tens of thousands of fragments in flight
+#define DEDUP_TTL 60 // in second, long after every relayed copy of a fragment has arrived
+#define DEDUP_MAX_PROBE 32
 
-void cache_add(id_cache* cache, uint32_t e);
-int cache_search(const id_cache* cache, uint32_t e);
-void cache_clear(id_cache* cache);
+typedef struct {
+	char uid[UID_LEN];
+	uint16_t id;
+	uint16_t frag_num;
+	uint8_t resend;
+	uint32_t seen; // time() of the last sighting, 0 is an empty slot
+} dedup_entry;
+
+typedef struct {
+	dedup_entry* slots;
+	uint32_t mask;
+	uint32_t ttl;
+
+	unsigned long hits; // Duplicates suppressed
+	unsigned long misses; // New fragments
+	unsigned long evictions; // Live entries pushed out by a full probe window
+} dedup_table;
+
+int dedup_init(dedup_table* table, int bits, uint32_t ttl);
+void dedup_free(dedup_table* table);
+int dedup_check(
+	dedup_table* table, const char uid[UID_LEN], uint16_t id, uint16_t frag_num, uint8_t resend, time_t now);
 
 // --- ### ---
 
 // --- Client Handling ---
 
+// Chain key a peer encrypts its group messages under, see sender_key_derive
+typedef struct {
+	bool valid;
+	uint32_t epoch;
+	unsigned char chain[AES_KEYLEN];
+	uint32_t top; // Highest message counter opened so far
+	uint64_t window; // Bit i is set once counter top - i was opened
+} sender_key;
+
 typedef struct client client;
 
 struct client {
@@ -38,6 +73,11 @@ struct client {
 	time_t last_seen;
 	char* pubkey_pem;
 	EVP_PKEY* pubkey;
+	unsigned char fingerprint[KEY_FPR_LEN]; // Of pubkey, compared against every CL_ALIVE
+	sender_key keys[2]; // Their current and previous epoch, messages under the old one may still be on the way
+	time_t key_requested; // When we last asked them for their sender key
+	time_t key_answered; // When we last sent them ours on request
+	bool chacha; // Has no AES instructions, see CL_CHACHA
 	client* next;
 	client* prev;
 };
@@ -51,62 +91,385 @@ typedef struct {
 int has_client(ll_clients* clients, const char name[NAME_LEN], const char uid[UID_LEN]);
 void add_new_client(ll_clients* clients, const char name[NAME_LEN], const char uid[UID_LEN], node_e type, const char* pubkey_pem);
 client* find_client(ll_clients* clients, const char name[NAME_LEN], const char uid[UID_LEN]);
+int client_set_key(client* c, const char* pubkey_pem);
 void remove_client(ll_clients* clients, const char name[NAME_LEN], const char uid[UID_LEN]);
 void clear_clients(ll_clients* clients);
 
 // --- ### ---
 
-// --- Timer events ---
+// --- Work queue ---
 
-typedef struct timer_event {
-	unsigned int u_delay;
-	unsigned int count;
-	void* (*handler)(void*);
-	void* handler_arg;
+// Bounded lock-free MPMC ring (Vyukov), capacity must be a power of two
+typedef struct {
+	atomic_size_t seq;
+	void* data;
+} mpmc_cell;
+
+typedef struct {
+	mpmc_cell* cells;
+	size_t mask;
+	_Alignas(64) atomic_size_t enqueue_pos; // Producers and consumers on separate cache lines
+	_Alignas(64) atomic_size_t dequeue_pos;
+} mpmc_ring;
 
+int mpmc_init(mpmc_ring* ring, size_t capacity);
+void mpmc_free(mpmc_ring* ring);
+int mpmc_push(mpmc_ring* ring, void* data);
+void* mpmc_pop(mpmc_ring* ring);
+
+typedef struct work_pool work_pool;
+
+// One worker and its queue. Jobs are handed to a lane by key, so jobs with the same key run in the order submitted.
+typedef struct {
+	mpmc_ring ring;
+	sem_t pending; // One post per queued job, plus one on stop
 	pthread_t thread;
-} timer_event;
+	work_pool* pool;
+} work_lane;
+
+// Worker threads draining a lane each, the handler owns each job it is given
+struct work_pool {
+	work_lane* lanes;
+	int num_workers;
+	void (*handler)(void*);
+	atomic_bool running;
+
+	// Backpressure counters
+	atomic_ulong submitted;
+	atomic_ulong completed;
+	atomic_ulong stalls; // A lane was full, the producer waited for its worker
+	atomic_ulong high_water; // Deepest a lane has been
+};
+
+int work_pool_start(work_pool* pool, int num_workers, size_t capacity, void (*handler)(void*));
+void work_pool_submit(work_pool* pool, uint32_t key, void* job);
+void work_pool_stop(work_pool* pool);
+
+// --- ### ---
+
+// --- Buffer pool ---
+// Power of two size classes kept on free lists, shared by every thread. Buffers from buf_pool_get
+// must go back through buf_pool_put, never free().
+
+#define POOL_MIN_SHIFT 12 // 4 KB, smallest class
+#define POOL_MAX_SHIFT 30 // 1 GB, larger than any packet we can reassemble
+#define POOL_CACHE_BYTES (64 * 1024 * 1024) // Idle memory kept on the free lists, the rest is freed
 
-timer_event* new_timer_event(unsigned int u_delay, unsigned int count, void* (*handler)(void*), void* handler_arg);
-void timer_event_stop(timer_event* event);
-void* timer_thread(void* arg);
+void* buf_pool_get(size_t size);
+size_t buf_pool_size(size_t size);
+void buf_pool_put(void* buf);
 
 // --- ### ---
 
-// --- Fragment handling ---
+// --- Arena ---
+// Bump allocator for scratch memory that lives as long as one job. Every thread gets its own on first use, work pool
+// threads reset theirs after each job. What doesn't fit comes from buf_pool and goes back there on reset.
+
+#define ARENA_SIZE (1024 * 1024) // A streamed file's key block and bounce buffers, see advance_stream
+#define ARENA_ALIGN 16
 
 typedef struct {
-	uint16_t id; // Packet id of fragments
-	unsigned char* head; // Allocate at most num_frag * MAX_FRAG bytes
-	int frag_received; // How many fragments we received
+	unsigned char* base;
 	size_t size;
-} fragment;
+	size_t used;
+	void* spill; // buf_pool buffers handed out past size, chained through their first bytes
+	size_t high_water;
+	unsigned long spills;
+} arena_t;
+
+arena_t* thread_arena(void);
+void* arena_alloc(arena_t* arena, size_t size);
+void arena_reset(arena_t* arena);
+void thread_arena_reset(void);
+
+// --- ### ---
+
+// --- File streams ---
+// A packet written straight to disk as its fragments arrive, fragment i at offset i * frag_size. The receiver
+// shard writes, workers post-process the contiguous prefix under lock. Reference counted as both hold it. Nothing
+// is created on disk before file_stream_create, once the key block showed the file is for us.
+
+#define STREAM_CHUNK (256 * 1024) // Bytes of contiguous prefix before workers are asked to catch up
+#define STREAM_RENAMES 100 // Numbered names tried when the file name is taken, see file_stream_create and _finish
+
+// A fragment with its header, out of the receive buffer: a sealed fragment waiting for the key block of its
+// transfer, or one rebuilt from FEC parity
+typedef struct sealed_frag {
+	struct sealed_frag* next;
+	header_t header;
+	unsigned char* data; // From buf_pool_get
+	size_t len;
+} sealed_frag;
+
+#define STREAM_PENDING_MAX (4 * 1024 * 1024) // Sealed bytes a transfer may have parked or queued before it is keyed
 
 typedef struct {
-	fragment* fragments[10]; // 10 fragments at cache at most
-	uint8_t size;
-} fragments;
+	pthread_mutex_t lock; // Held by the worker processing the prefix
+	atomic_int refs;
+	atomic_bool aborted; // Timed out, evicted or not for us, the file is removed on the last put
+	int fd; // -1 before file_stream_create
+	char path[FILENAME_LEN + 4]; // Final name, numbered by file_stream_finish if taken
+	// Written as path.part, or path.N.part if another transfer has that one, until file_stream_finish
+	char part[FILENAME_LEN + 10];
+	uint16_t frag_size;
+	uint16_t total_fragments;
+	atomic_uint contiguous; // Fragments [0, contiguous) are on disk
+	atomic_size_t length; // Payload bytes once the last fragment is in, 0 before
+	unsigned int kicked; // contiguous when the workers were last asked to catch up, receiver only
+
+	// Worker state, only touched under lock
+	EVP_CIPHER_CTX* cipher;
+	size_t in_off; // Next byte of the packet to process
+	size_t out_off; // Next byte of output, always behind in_off so output can overwrite the packet in place
+	size_t end; // Where processing stops, 0 until known
+	bool done;
+
+	// Sealed (CL_AEAD) transfers, every fragment is opened on its own by whichever worker gets it
+	uint8_t key_frags;
+	atomic_bool keyed; // key and iv are set, set under lock
+	unsigned char key[AES_KEYLEN];
+	unsigned char iv[AES_IVLEN];
+	sealed_frag* pending; // Arrived before the key block, under lock
+	atomic_size_t pending_bytes; // Sealed bytes parked or queued for the workers, see reasm_add_sealed
+	atomic_uint opened; // Sealed fragments written out
+} file_stream;
+
+file_stream* file_stream_open(const char* path, uint16_t total_fragments, uint16_t frag_size);
+int file_stream_create(file_stream* stream);
+int file_stream_write(file_stream* stream, uint16_t frag_num, const unsigned char* data, size_t size);
+int file_stream_finish(file_stream* stream, size_t length);
+void file_stream_get(file_stream* stream);
+void file_stream_put(file_stream* stream);
+
+// --- ### ---
+
+// --- Fragment reassembly ---
+// Packets in reassembly, keyed by (uid, id). One table per receiver shard, so no locking. Fragments are
+// written straight into a pooled buffer at frag_num * frag_size and tracked in a bitmap. Packets that
+// stall longer than timeout, or the least recently updated ones once the memory budget shared by all
+// tables is reached, are dropped.
+
+#define REASM_BUCKETS 1024
+#define REASM_MAX_PACKETS 512 // Packets in reassembly per table
+#define REASM_TIMEOUT 30 // in second
+#define REASM_MEMORY (256 * 1024 * 1024) // Budget of all tables together for partially received packets
+#define REASM_DONE 1024 // Packets remembered as complete per table, see reasm_done_t
+#define REASM_DONE_PROBE 4
+
+typedef struct reasm_entry reasm_entry;
+
+struct reasm_entry {
+	char uid[UID_LEN];
+	uint16_t id;
+	uint16_t frag_size; // Sender's fragment size, fragment i lives at head + i * frag_size
+	uint16_t total_fragments;
+	int frag_received;
+	size_t size; // Payload bytes received so far
+	size_t cap; // Bytes reserved from the budget, the pool class of head
+	unsigned char* head; // From buf_pool_get
+	file_stream* stream; // Instead of head for packets streamed to disk
+	uint64_t* bitmap; // Bit i is set once fragment i is in place
+	time_t last_update;
+	uint64_t last_ms; // monotonic_ms() of the last new fragment
+	uint64_t nack_after; // No NACK for this packet before this monotonic_ms()
+	int nacks; // NACKs sent for this packet once it went quiet
+	uint32_t stamp; // header.stamp of the fragment that came in at last_ms
+	uint16_t highest; // Highest fragment in so far
+	uint16_t reported; // Loss below this was reported already
+
+	reasm_entry* hnext; // Bucket chain, or free list
+	reasm_entry* lru_prev; // lru_next is towards the least recently updated packet
+	reasm_entry* lru_next;
+};
+
+// A packet completed, or dropped as not for us, within timeout. Its late fragments, resends for someone else's NACK
+// above all, must not start it over.
+typedef struct {
+	char uid[UID_LEN];
+	uint16_t id;
+	time_t when; // 0 for a free slot
+} reasm_done_t;
+
+typedef struct {
+	reasm_entry* buckets[REASM_BUCKETS];
+	reasm_entry* entries;
+	reasm_entry* free_list;
+	reasm_entry lru; // Sentinel, lru.lru_next is the most recently updated packet
+	reasm_done_t done[REASM_DONE];
+	size_t budget; // Across all tables
+	size_t in_use; // Reserved by this table
+	int timeout;
+
+	unsigned long completed;
+	unsigned long duplicates;
+	unsigned long timeouts;
+	unsigned long evictions; // Dropped to stay within the budget or the packet limit
+	unsigned long rejected; // Fragments inconsistent with their header or packet
+} reasm_table;
+
+int reasm_init(reasm_table* table, size_t budget, int timeout);
+void reasm_free(reasm_table* table);
+int reasm_add(reasm_table* table, const char uid[UID_LEN], uint16_t id, uint16_t frag_num, uint16_t total_fragments,
+	uint16_t frag_size, const unsigned char* data, size_t size, time_t now, uint32_t stamp, unsigned char** out,
+	size_t* out_len);
+int reasm_add_stream(reasm_table* table, const char uid[UID_LEN], uint16_t id, uint16_t frag_num,
+	uint16_t total_fragments, uint16_t frag_size, const unsigned char* data, size_t size, time_t now, uint32_t stamp,
+	const char* path, file_stream** out);
+int reasm_add_sealed(reasm_table* table, const char uid[UID_LEN], uint16_t id, uint16_t frag_num,
+	uint16_t total_fragments, uint16_t frag_size, uint8_t key_frags, const unsigned char* data, size_t size, time_t now,
+	uint32_t stamp, const char* path, file_stream** stream, unsigned char** key_block);
+void reasm_drop(reasm_table* table, const char uid[UID_LEN], uint16_t id, time_t now);
+void reasm_expire(reasm_table* table, time_t now);
+
+// --- ### ---
+
+// --- FEC reassembly ---
+// Blocks of FEC coded packets, keyed by (uid, id, block). Every fragment of a block is copied in until the block is
+// whole or can be rebuilt from its parity. Then the buffer goes, and what is left keeps late fragments from starting
+// the block over until it falls off the LRU. One table per receiver shard, like reasm_table.
+
+#define FEC_BUCKETS 1024
+#define FEC_MAX_BLOCKS 2048 // Blocks tracked per table, finished ones included
+#define FEC_TIMEOUT 5 // in second, parity follows its block right away
+#define FEC_MEMORY (64 * 1024 * 1024) // Budget of all tables together for blocks still open
+
+typedef struct fec_entry fec_entry;
+
+struct fec_entry {
+	char uid[UID_LEN];
+	uint16_t id;
+	uint16_t block;
+	uint8_t data; // Data fragments of this block, the last block of a packet may be short
+	uint8_t parity;
+	uint16_t frag_size;
+	uint64_t have_data; // Bit i once data fragment i of the block is in
+	uint32_t have_parity;
+	unsigned char* buf; // data + parity fragments of frag_size from buf_pool_get, NULL once the block is done
+	size_t cap;
+	time_t last_update;
+
+	fec_entry* hnext; // Bucket chain, or free list
+	fec_entry* lru_prev; // lru_next is towards the least recently updated block
+	fec_entry* lru_next;
+};
+
+typedef struct {
+	fec_entry* buckets[FEC_BUCKETS];
+	fec_entry* entries;
+	fec_entry* free_list;
+	fec_entry lru; // Sentinel, lru.lru_next is the most recently updated block
+	size_t budget; // Across all tables
+	int timeout;
+
+	unsigned long rebuilt; // Data fragments recovered from parity
+	unsigned long lost; // Blocks given up with data fragments missing
+	unsigned long rejected; // Fragments inconsistent with their header or block
+} fec_table;
+
+int fec_table_init(fec_table* table, size_t budget, int timeout);
+void fec_table_free(fec_table* table);
+sealed_frag* fec_add(fec_table* table, const header_t* header, const unsigned char* data, size_t size, time_t now);
+
+// --- ### ---
+
+// --- NACK ---
+// Receivers ask for what they lack once a packet has gone quiet. A NACK is broadcast like any packet, so the
+// others on the subnet hear it and hold their own back for a while, the sender's resend reaches them all anyway.
+// While a packet is still coming in, holes NACK_REORDER fragments behind the highest one are asked for every
+// NACK_DELAY already. Each NACK also tells how many fragments were lost of those new since the last one, which
+// drives the sender's rate control, see rate_ctl_t.
+
+#define NACK_INTERVAL 50000 // in microsecond, how often every shard looks for packets with holes
+#define NACK_DELAY 200 // in millisecond, quiet time before a packet with holes is NACKed, doubles per round
+#define NACK_MAX_ROUNDS 6
+#define NACK_MAX_BITS 2048 // Fragments one NACK asks for, the rest go in later rounds
+#define NACK_REORDER 128 // Fragments behind the highest one before a hole counts as lost, leaves FEC time to fill it
+
+// [uid:char[UID_LEN]][echo:uint32_t][id:uint16_t][fresh:uint16_t][lost:uint16_t][first:uint16_t][nbits:uint16_t]
+// [bitmap:(nbits + 7) / 8 bytes]
+typedef struct {
+	char uid[UID_LEN]; // Sender of the packet
+	uint32_t echo; // header.stamp of the latest fragment plus how long we held it, 0 if unknown
+	uint16_t id;
+	uint16_t fresh; // Fragments this NACK is the first to report on
+	uint16_t lost; // How many of those are missing
+	uint16_t first; // Bit i of bitmap stands for fragment first + i
+	uint16_t nbits;
+	uint8_t bitmap[NACK_MAX_BITS / 8];
+} nack_t;
+
+#define NACK_HEADER_LEN offsetof(nack_t, bitmap)
+
+uint64_t monotonic_ms(void);
+int reasm_collect_nacks(reasm_table* table, uint64_t now_ms, void (*send)(const nack_t* nack, size_t len, void* arg),
+	void* arg);
+void reasm_overheard_nack(reasm_table* table, const char uid[UID_LEN], uint16_t id, uint64_t now_ms);
+
+// --- ### ---
 
-fragment* new_fragment(
-	fragments* fragments, const unsigned char* frag_head, uint16_t id, int frag_num, int total_fragments, int size);
 // --- Crypto ---
 
-#define AES_KEYLEN 32 // 256 bits
-#define AES_IVLEN 16 // For AES-CBC
+// AEAD for sealed fragments and group messages, both suites take AES_KEYLEN keys
+typedef enum {
+	AEAD_AES_GCM, // AES-256-GCM
+	AEAD_CHACHA20_POLY1305, // On CPUs without AES instructions, see CL_CHACHA
+} aead_suite_e;
+
+#define AEAD_NONCELEN 12
+#define AEAD_TAGLEN 16
+#define AEAD_AADLEN (UID_LEN + 4 * sizeof(uint16_t) + sizeof(uint8_t))
+
+void aead_nonce(unsigned char nonce[AEAD_NONCELEN], const unsigned char iv[AES_IVLEN], uint16_t id, uint16_t frag_num);
+void aead_aad(unsigned char aad[AEAD_AADLEN], const char uid[UID_LEN], uint16_t id, uint16_t frag_num,
+	uint16_t total_fragments, uint16_t frag_size, uint8_t key_frags);
+aead_suite_e aead_local_suite(void); // The faster suite on this CPU
+const char* aead_suite_name(aead_suite_e suite);
+int aead_seal(aead_suite_e suite, const unsigned char key[AES_KEYLEN], const unsigned char nonce[AEAD_NONCELEN],
+	const unsigned char* aad, size_t aad_len, const unsigned char* in, size_t len, unsigned char* out);
+int aead_open(aead_suite_e suite, const unsigned char key[AES_KEYLEN], const unsigned char nonce[AEAD_NONCELEN],
+	const unsigned char* aad, size_t aad_len, const unsigned char* in, size_t len, unsigned char* out);
 
 unsigned char* encrypt_aes(
 	const unsigned char* plaintext, int plaintext_len, const unsigned char* key, const unsigned char* iv, int* out_len);
 int decrypt_aes(const unsigned char* ciphertext, int ciperhtext_len, const unsigned char* key, const unsigned char* iv,
 	unsigned char* plaintext);
 
+// Sender keys: every message counter of an epoch gets its own AES-256-GCM key and nonce from the chain key
+#define SENDER_KEY_AADLEN (UID_LEN + 2 * sizeof(uint32_t))
+
+int sender_key_derive(const unsigned char chain[AES_KEYLEN], uint32_t epoch, uint32_t counter,
+	unsigned char key[AES_KEYLEN], unsigned char nonce[AEAD_NONCELEN]);
+bool sender_key_accept(sender_key* sk, uint32_t counter);
+
 int encrypt_key_with_rsa(EVP_PKEY* pubkey, const unsigned char* aes_key, int keylen, unsigned char* encrypted_key);
 
 int decrypt_key_with_rsa(
 	EVP_PKEY* privkey, const unsigned char* encrypted_key, int encrypted_keylen, unsigned char* decrypted_key);
 
 int node_generate_rsa_keypair(node_t* node);
+int node_set_keypair(node_t* node, EVP_PKEY* keypair);
+int crypto_benchmark(void);
 
 EVP_PKEY* peer_pubkey_from_pem(const char* pubkey_pem);
+int key_fingerprint(EVP_PKEY* key, unsigned char fpr[KEY_FPR_LEN]);
+
+// --- ### ---
+
+// --- Identity ---
+
+// A persistent identity is a PEM private key in a mode 0600 file, ephemeral ones come from a pool of keypairs
+// generated in the background
+#define KEYGEN_POOL 2
+#define IDENTITY_DIR "cylock" // Under $XDG_CONFIG_HOME, or ~/.config, never the download directory
+#define IDENTITY_FILE "identity.pem"
+
+int identity_path(char path[PATH_MAX]); // Creates the directory if needed, -1 if there is no config directory
+int identity_load(node_t* node, const char* path); // 1 if loaded, 0 if there is none, -1 if it is unusable
+int identity_save(EVP_PKEY* keypair, const char* path);
+
+int keygen_pool_start(void);
+EVP_PKEY* keygen_pool_take(void);
+void keygen_pool_stop(void);
 
 // --- ### ---
 